@@ -10,9 +10,32 @@
 #include <functional>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <memory>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
 #include <sstream>
+#include <algorithm>
+#include <type_traits>
+#include <cstring>
+#include <array>
+#include <limits>
+#include <chrono>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 using namespace std;
@@ -23,9 +46,16 @@ class state	identifier_state( char currCh, class info& ioInfo );
 class state	string_state( char currCh, class info& ioInfo );
 class state	character_state( char currCh, class info& ioInfo );
 class state	multi_line_comment_state( char currCh, class info& ioInfo );
+class state	number_state( char currCh, class info& ioInfo );
 
-void		parse_function_body( vector<class token>& tokens, vector<class token>::iterator& currToken, class program& theProgram, class classdesc& currClass, class funcdesc& currFunction );
-class term	parse_expression( vector<class token>& tokens, vector<class token>::iterator& currToken, class program& theProgram, class classdesc& currClass, class funcdesc& currFunction );
+typedef uint32_t	term_index;	// Index of a term in its funcdesc's term_arena.
+
+// The parser works on any token_source that provides begin()/end() and a
+//	forward iterator over tokens: a vector<token> or a token_stream.
+template<class token_source>
+void		parse_function_body( token_source& tokens, typename token_source::iterator& currToken, class program& theProgram, class classdesc& currClass, class funcdesc& currFunction );
+template<class token_source>
+term_index	parse_expression( token_source& tokens, typename token_source::iterator& currToken, class program& theProgram, const class scope& currScope, class funcdesc& currFunction );
 
 
 #define PE_TOKEN_NAME	token_text(tokens,currToken)
@@ -49,15 +79,463 @@ class parse_error : public exception
 public:
 	parse_error() : offset(0), line(0) {}
 	
-    virtual const char* what() const _NOEXCEPT { return err_msg.str().c_str(); };
+    virtual const char* what() const noexcept { mMessage = err_msg.str(); return mMessage.c_str(); };
 	
 	stringstream	err_msg;
 	size_t			offset;
 	size_t			line;
+
+protected:
+	mutable string	mMessage;	// Keeps the string what() returns alive.
+};
+
+
+// Memory statistics (--memory-stats):
+//	Counts every allocation and how often the structures a program is made of
+//	are created and copied, so we can tell which phase allocates what and
+//	catch accidental copies of big structures. Counting is off unless asked
+//	for, and then costs one relaxed atomic add per event.
+typedef enum {
+	counted_token,
+	counted_term,
+	counted_typedesc,		// Includes the typedesc part of each classdesc.
+	counted_funcdesc,
+	counted_classdesc,
+	number_of_counted_kinds
+} counted_kind;
+
+const char*	counted_kind_names[number_of_counted_kinds] = { "token", "term", "typedesc", "funcdesc", "classdesc" };
+
+static atomic<bool>		sCountMemory( false );
+static atomic<size_t>	sAllocations( 0 );
+static atomic<size_t>	sAllocatedBytes( 0 );
+static atomic<size_t>	sCreated[number_of_counted_kinds];
+static atomic<size_t>	sCopied[number_of_counted_kinds];
+
+
+inline void	count_memory_event( atomic<size_t>& ioCounter )
+{
+	if( sCountMemory.load( memory_order_relaxed ) )
+		ioCounter.fetch_add( 1, memory_order_relaxed );
+}
+
+
+// Only the plain overload is replaced, so align_val_t allocations aren't
+//	counted (nothing here is over-aligned), and nothrow_t ones only where the
+//	library forwards them to this one, as libstdc++ does.
+void*	operator new( size_t inSize )
+{
+	if( sCountMemory.load( memory_order_relaxed ) )
+	{
+		sAllocations.fetch_add( 1, memory_order_relaxed );
+		sAllocatedBytes.fetch_add( inSize, memory_order_relaxed );
+	}
+	if( inSize == 0 )
+		inSize = 1;
+	void*	memory = nullptr;
+	while( (memory = malloc( inSize )) == nullptr )
+	{
+		new_handler	handler = get_new_handler();
+		if( !handler )
+			throw bad_alloc();
+		handler();
+	}
+	return memory;
+}
+
+
+// Kept out of line, or GCC sees free() inlined next to our operator new and
+//	warns about mismatched allocation functions.
+__attribute__((noinline)) void	operator delete( void* inMemory ) noexcept
+{
+	free( inMemory );
+}
+
+
+__attribute__((noinline)) void	operator delete( void* inMemory, size_t ) noexcept
+{
+	free( inMemory );
+}
+
+
+// Empty base class of everything we count. Moves aren't counted as copies,
+//	and are noexcept so vectors of counted classes move when they grow.
+template<counted_kind kind>
+class counted
+{
+public:
+	counted() noexcept										{ count_memory_event( sCreated[kind] ); }
+	counted( const counted& ) noexcept						{ count_memory_event( sCopied[kind] ); }
+	counted( counted&& ) noexcept							{ count_memory_event( sCreated[kind] ); }
+	counted&	operator =( const counted& ) noexcept		{ count_memory_event( sCopied[kind] ); return *this; }
+	counted&	operator =( counted&& ) noexcept			{ return *this; }
+};
+
+
+struct memory_counts
+{
+	size_t	allocations;
+	size_t	bytes;
+	size_t	created[number_of_counted_kinds];
+	size_t	copied[number_of_counted_kinds];
+	size_t	peak_resident_bytes;
+};
+
+
+// Collects the counters at the end of each phase and prints what changed.
+class memory_report
+{
+public:
+	explicit memory_report( bool inEnabled ) : mEnabled(inEnabled)	{ sCountMemory = inEnabled; mLastCounts = current_counts(); }
+	
+	void	end_phase( const char* inName );
+	void	print( ostream& inStream ) const;
+	
+	static memory_counts	current_counts();
+	
+protected:
+	bool									mEnabled;
+	memory_counts							mLastCounts;
+	vector<pair<const char*,memory_counts>>	mPhases;	// How much each phase added.
+};
+
+
+memory_counts	memory_report::current_counts()
+{
+	memory_counts	counts = {};
+	counts.allocations = sAllocations.load();
+	counts.bytes = sAllocatedBytes.load();
+	for( size_t x = 0; x < number_of_counted_kinds; x++ )
+	{
+		counts.created[x] = sCreated[x].load();
+		counts.copied[x] = sCopied[x].load();
+	}
+	struct rusage	usage = {};
+	getrusage( RUSAGE_SELF, &usage );
+#if __APPLE__
+	counts.peak_resident_bytes = size_t( usage.ru_maxrss );
+#else
+	counts.peak_resident_bytes = size_t( usage.ru_maxrss ) * 1024;
+#endif
+	return counts;
+}
+
+
+void	memory_report::end_phase( const char* inName )
+{
+	if( !mEnabled )
+		return;
+	
+	memory_counts	counts = current_counts();
+	memory_counts	phaseCounts = counts;	// Peak RSS stays the total so far.
+	phaseCounts.allocations -= mLastCounts.allocations;
+	phaseCounts.bytes -= mLastCounts.bytes;
+	for( size_t x = 0; x < number_of_counted_kinds; x++ )
+	{
+		phaseCounts.created[x] -= mLastCounts.created[x];
+		phaseCounts.copied[x] -= mLastCounts.copied[x];
+	}
+	mPhases.emplace_back( inName, phaseCounts );
+	mLastCounts = current_counts();	// Don't count our own bookkeeping.
+}
+
+
+void	memory_report::print( ostream& inStream ) const
+{
+	if( !mEnabled )
+		return;
+	
+	inStream << "phase\tallocations\tKB allocated\tpeak RSS KB";
+	for( const char* currName : counted_kind_names )
+		inStream << "\t" << currName << " created/copied";
+	inStream << endl;
+	for( const pair<const char*,memory_counts>& currPhase : mPhases )
+	{
+		const memory_counts&	counts = currPhase.second;
+		inStream << currPhase.first << "\t" << counts.allocations << "\t" << (counts.bytes / 1024) << "\t" << (counts.peak_resident_bytes / 1024);
+		for( size_t x = 0; x < number_of_counted_kinds; x++ )
+			inStream << "\t" << counts.created[x] << "/" << counts.copied[x];
+		inStream << endl;
+	}
+}
+
+
+// All identifiers, keywords and operators are interned into an atom_table
+//	once, when they are lexed. From then on, names are compared and looked up
+//	using their 32-bit atom IDs instead of string compares.
+//	Interning is thread-safe. Names never move once they have been interned,
+//	so the string returned by atom_table::name() stays valid forever.
+class atom_table
+{
+public:
+	atom_table();
+	
+	uint32_t		intern( string_view inName );
+	uint32_t		lookup( string_view inName ) const;	// Returns 0 if inName hasn't been interned.
+	const string&	name( uint32_t inID ) const	{ return mChunks[inID / chunk_size].load( memory_order_acquire )[inID % chunk_size]; }
+	uint32_t		size() const				{ return mCount.load( memory_order_acquire ); }
+	
+protected:
+	static const size_t	shard_count = 64;
+	static const size_t	chunk_size = 4096;
+	static const size_t	max_chunks = 65536;
+	
+	struct shard
+	{
+		mutable mutex							lock;
+		unordered_map<string_view,uint32_t>		ids;
+	};
+	
+	uint32_t			add_name( string_view inName );
+	
+	shard				mShards[shard_count];
+	atomic<string*>		mChunks[max_chunks];	// Names by ID, in chunks so they never move when we add more.
+	mutex				mAddLock;
+	atomic<uint32_t>	mCount;
+};
+
+
+// Small lock-free cache in front of the shards, so re-interning a name we've
+//	seen recently (which is what almost every identifier is) doesn't lock.
+struct atom_cache_entry
+{
+	const string*	name;
+	uint32_t		id;
+};
+
+static thread_local atom_cache_entry	sAtomCache[1024];
+
+
+atom_table::atom_table() : mCount(0)
+{
+	for( atomic<string*>& currChunk : mChunks )
+		currChunk.store( nullptr, memory_order_relaxed );
+	add_name( "" );	// ID 0 is the empty atom.
+}
+
+
+uint32_t	atom_table::add_name( string_view inName )
+{
+	lock_guard<mutex>	lock( mAddLock );
+	uint32_t	newID = mCount.load( memory_order_relaxed );
+	if( newID / chunk_size >= max_chunks )
+		throw runtime_error( "Too many distinct identifiers." );
+	string*		chunk = mChunks[newID / chunk_size].load( memory_order_relaxed );
+	if( !chunk )
+	{
+		chunk = new string[chunk_size];
+		mChunks[newID / chunk_size].store( chunk, memory_order_release );
+	}
+	chunk[newID % chunk_size] = inName;
+	mCount.store( newID +1, memory_order_release );
+	return newID;
+}
+
+
+uint32_t	atom_table::intern( string_view inName )
+{
+	size_t				hash = std::hash<string_view>()( inName );
+	atom_cache_entry&	cached = sAtomCache[hash % 1024];
+	if( cached.name && *cached.name == inName )
+		return cached.id;
+	
+	shard&				currShard = mShards[hash % shard_count];
+	lock_guard<mutex>	lock( currShard.lock );
+	auto				foundID = currShard.ids.find( inName );
+	uint32_t			theID = 0;
+	if( foundID != currShard.ids.end() )
+		theID = foundID->second;
+	else
+	{
+		theID = add_name( inName );
+		currShard.ids[name( theID )] = theID;	// Key must point at our copy, not the caller's buffer.
+	}
+	
+	cached.name = &name( theID );
+	cached.id = theID;
+	return theID;
+}
+
+
+uint32_t	atom_table::lookup( string_view inName ) const
+{
+	const shard&		currShard = mShards[std::hash<string_view>()( inName ) % shard_count];
+	lock_guard<mutex>	lock( currShard.lock );
+	auto				foundID = currShard.ids.find( inName );
+	return (foundID != currShard.ids.end()) ? foundID->second : 0;
+}
+
+
+atom_table&	atoms()
+{
+	static atom_table	sAtoms;
+	return sAtoms;
+}
+
+
+class atom
+{
+public:
+	atom() : mID(0) {}
+	explicit atom( string_view inName ) : mID(atoms().intern( inName )) {}
+	
+	static atom		find( string_view inName )	{ atom theAtom; theAtom.mID = atoms().lookup( inName ); return theAtom; }
+	
+	uint32_t		id() const		{ return mID; }
+	const string&	name() const	{ return atoms().name( mID ); }
+	bool			empty() const	{ return mID == 0; }
+	
+	bool	operator ==( const atom& inOther ) const	{ return mID == inOther.mID; }
+	bool	operator !=( const atom& inOther ) const	{ return mID != inOther.mID; }
+	
+protected:
+	uint32_t	mID;
+};
+
+
+ostream&	operator <<( ostream& inStream, const atom& inAtom )
+{
+	return inStream << inAtom.name();
+}
+
+
+namespace std
+{
+	template<> struct hash<atom>
+	{
+		size_t	operator()( const atom& inAtom ) const	{ return inAtom.id(); }
+	};
+}
+
+
+// Keywords and operators the parser looks for:
+const atom	atom_class( "class" );
+const atom	atom_struct( "struct" );
+const atom	atom_override( "override" );
+const atom	atom_union( "@union" );
+const atom	atom_hot( "@hot" );
+const atom	atom_cold( "@cold" );
+const atom	atom_unsigned( "unsigned" );
+const atom	atom_long( "long" );
+const atom	atom_short( "short" );
+const atom	atom_int( "int" );
+const atom	atom_char( "char" );
+const atom	atom_return( "return" );
+const atom	atom_this( "this" );
+const atom	atom_null( "null" );
+const atom	atom_init( "init" );
+const atom	atom_object( "object" );
+const atom	atom_void( "void" );
+const atom	atom_open_bracket( "(" );
+const atom	atom_close_bracket( ")" );
+const atom	atom_open_brace( "{" );
+const atom	atom_close_brace( "}" );
+const atom	atom_less_than( "<" );
+const atom	atom_greater_than( ">" );
+const atom	atom_comma( "," );
+const atom	atom_colon( ":" );
+const atom	atom_semicolon( ";" );
+const atom	atom_assign( "=" );
+const atom	atom_dot( "." );
+const atom	atom_arrow( "->" );
+
+
+// A map keyed by atom that keeps its entries in the order they were added.
+//	Small maps are searched linearly, larger ones get a hash index.
+template<class T>
+class atom_map
+{
+public:
+	typedef pair<atom,T>								value_type;
+	typedef typename vector<value_type>::iterator		iterator;
+	typedef typename vector<value_type>::const_iterator	const_iterator;
+	
+	iterator		begin()			{ return mEntries.begin(); }
+	iterator		end()			{ return mEntries.end(); }
+	const_iterator	begin() const	{ return mEntries.begin(); }
+	const_iterator	end() const		{ return mEntries.end(); }
+	size_t			size() const	{ return mEntries.size(); }
+	
+	iterator		find( atom inKey )			{ return mEntries.begin() +visible_index_of( inKey ); }
+	const_iterator	find( atom inKey ) const	{ return mEntries.begin() +visible_index_of( inKey ); }
+	
+	T&	operator []( atom inKey )
+	{
+		size_t	index = index_of( inKey );
+		if( !mHidden.empty() && index != mEntries.size() )
+		{
+			auto	foundHidden = std::find( mHidden.begin(), mHidden.end(), inKey );
+			if( foundHidden != mHidden.end() )
+			{
+				mHidden.erase( foundHidden );
+				mEntries[index].second = T();
+			}
+		}
+		if( index == mEntries.size() )
+		{
+			mEntries.push_back( value_type( inKey, T() ) );
+			if( !mIndex.empty() )
+				mIndex[inKey] = (uint32_t)index;
+			else if( mEntries.size() > linear_search_limit )
+			{
+				for( size_t x = 0; x < mEntries.size(); x++ )
+					mIndex[mEntries[x].first] = (uint32_t)x;
+			}
+		}
+		return mEntries[index].second;
+	}
+	
+	// Make find() act as if inKey wasn't there, until operator[] defines it
+	//	again. That reuses the old slot, so the order of entries stays the
+	//	same. Used to parse a construct again in place.
+	void	hide( atom inKey )
+	{
+		if( index_of( inKey ) != mEntries.size() )
+			mHidden.push_back( inKey );
+	}
+	bool	has_hidden() const	{ return !mHidden.empty(); }
+	
+protected:
+	static const size_t	linear_search_limit = 8;
+	
+	size_t	visible_index_of( atom inKey ) const
+	{
+		if( !mHidden.empty() && std::find( mHidden.begin(), mHidden.end(), inKey ) != mHidden.end() )
+			return mEntries.size();
+		return index_of( inKey );
+	}
+	
+	size_t	index_of( atom inKey ) const
+	{
+		if( mIndex.empty() )
+		{
+			for( size_t x = 0; x < mEntries.size(); x++ )
+			{
+				if( mEntries[x].first == inKey )
+					return x;
+			}
+			return mEntries.size();
+		}
+		
+		auto	foundIndex = mIndex.find( inKey );
+		return (foundIndex == mIndex.end()) ? mEntries.size() : foundIndex->second;
+	}
+	
+	vector<value_type>				mEntries;
+	unordered_map<atom,uint32_t>	mIndex;	// Only built once we have more than linear_search_limit entries.
+	vector<atom>					mHidden;
+};
+
+
+// Value of a numeric literal, decoded once by the lexer.
+union literal_value
+{
+	uint64_t	integer;	// token::integer
+	double		number;		// token::number
 };
 
 
-class token
+class token : public counted<counted_token>
 {
 public:
 	typedef enum {
@@ -70,16 +548,112 @@ public:
 		integer
 	} token_kind;
 	
-	token() : kind(whitespace), offset(0), lineNumber(0) {  }
+	token() : kind(whitespace), offset(0), lineNumber(0), value() {  }
 	
 	token_kind		kind;
-	std::string		text;
+	atom			name;		// Interned text of identifiers and operators.
+	string_view		text;		// Points into the source_buffer the token was lexed from.
 	size_t			offset;
 	size_t			lineNumber;
+	literal_value	value;		// Decoded integer and number literals.
+};
+
+
+// Print a double with as few digits as it takes to read back the same value.
+void	print_number( ostream& inStream, double inValue )
+{
+	char	buffer[32] = {};
+	for( int precision = 1; precision <= 17; precision++ )
+	{
+		snprintf( buffer, sizeof(buffer), "%.*g", precision, inValue );
+		if( strtod( buffer, nullptr ) == inValue )
+			break;
+	}
+	inStream << buffer;
+	if( !strpbrk( buffer, ".en" ) )	// Keep it recognizable as a float.
+		inStream << ".0";
+}
+
+
+// The complete text of a source file. Tokens are views into this buffer,
+//	so it has to stay around as long as the tokens are used.
+class source_buffer
+{
+public:
+	explicit source_buffer( const string& inFilePath, bool inMapFile = true );
+	~source_buffer();
+	
+	source_buffer( const source_buffer& ) = delete;
+	source_buffer&	operator =( const source_buffer& ) = delete;
+	
+	const char*		data() const	{ return mData; }
+	size_t			size() const	{ return mSize; }
+	bool			is_mapped() const	{ return mMapping != nullptr; }
+	
+protected:
+	void			read_file( const string& inFilePath );
+	
+	const char*		mData;
+	size_t			mSize;
+	void*			mMapping;	// Address returned by mmap(), NULL if we read the file into mContents.
+	string			mContents;
 };
 
 
-string	token_text( const vector<token>& tokens, const vector<token>::iterator& tok )
+source_buffer::source_buffer( const string& inFilePath, bool inMapFile ) : mData(nullptr), mSize(0), mMapping(nullptr)
+{
+	if( !inMapFile )
+	{
+		read_file( inFilePath );
+		return;
+	}
+	
+	int	fd = open( inFilePath.c_str(), O_RDONLY );
+	if( fd < 0 )
+		throw runtime_error( "Couldn't open file \"" + inFilePath + "\"." );
+	
+	struct stat	fileInfo = {};
+	if( fstat( fd, &fileInfo ) == 0 && fileInfo.st_size > 0 )
+	{
+		void*	mapping = mmap( nullptr, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( mapping != MAP_FAILED )
+		{
+			madvise( mapping, fileInfo.st_size, MADV_SEQUENTIAL );
+			mMapping = mapping;
+			mData = (const char*) mapping;
+			mSize = fileInfo.st_size;
+		}
+	}
+	close( fd );
+	
+	if( !mMapping )	// Empty file, pipe or anything else we can't map.
+		read_file( inFilePath );
+}
+
+
+source_buffer::~source_buffer()
+{
+	if( mMapping )
+		munmap( mMapping, mSize );
+}
+
+
+void	source_buffer::read_file( const string& inFilePath )
+{
+	ifstream	file( inFilePath, ios::in | ios::binary );
+	if( !file )
+		throw runtime_error( "Couldn't open file \"" + inFilePath + "\"." );
+	
+	stringstream	contents;
+	contents << file.rdbuf();
+	mContents = contents.str();
+	mData = mContents.data();
+	mSize = mContents.size();
+}
+
+
+template<class token_source>
+string_view	token_text( token_source& tokens, const typename token_source::iterator& tok )
 {
 	if( tok == tokens.end() )
 		return "<end of file>";
@@ -87,7 +661,8 @@ string	token_text( const vector<token>& tokens, const vector<token>::iterator& t
 		return tok->text;
 }
 
-size_t	token_offset( const vector<token>& tokens, const vector<token>::iterator& tok )
+template<class token_source>
+size_t	token_offset( token_source& tokens, const typename token_source::iterator& tok )
 {
 	if( tok == tokens.end() )
 		return 0;
@@ -96,7 +671,8 @@ size_t	token_offset( const vector<token>& tokens, const vector<token>::iterator&
 }
 
 
-size_t	token_line( const vector<token>& tokens, const vector<token>::iterator& tok )
+template<class token_source>
+size_t	token_line( token_source& tokens, const typename token_source::iterator& tok )
 {
 	if( tok == tokens.end() )
 		return 0;
@@ -113,6 +689,8 @@ public:
 	state	operator()( char currCh, class info& ioInfo )	{ return mFunc( currCh, ioInfo ); };
 	
 	explicit operator bool()	{ return mFunc != nullptr; }
+	bool	operator ==( const state& inOther ) const	{ return mFunc == inOther.mFunc; }
+	bool	operator !=( const state& inOther ) const	{ return mFunc != inOther.mFunc; }
 	
 protected:
 	state (*mFunc)( char, class info& );
@@ -122,60 +700,86 @@ protected:
 class info
 {
 public:
-	info( istream& inStream ) : stream(inStream), lineNumber(1) {}
+	info( const char* inStart, const char* inEnd );
 	
 	token			curr_token;
 	vector<token>	tokens;
-	istream&		stream;
+	const char*		start;	// Start of the source buffer, token offsets are relative to this.
+	const char*		curr;	// Next character to read.
+	const char*		end;
 	size_t			lineNumber;
+	state			curr_state;
+	bool			just_had_cr;
+	bool			hit_nul;	// Lexing stopped at a '\0' before the end.
 };
 
 
 class vardesc;
 class functypedesc;
 class funcdesc;
+class typedesc;
+
 
+// Types are shared by everything that uses them, so a program holds each
+//	class only once no matter how many variables, parameters or return
+//	types refer to it. Don't change a type once a handle to it was handed
+//	out, make a new one instead.
+typedef shared_ptr<typedesc>	type_handle;
 
+
+// Declaring a virtual destructor suppresses the implicit move constructor
+//	and assignment, so we default them explicitly, or moving a class or
+//	function would copy all its variables and functions.
 class varcontainer
 {
 public:
+	varcontainer() = default;
+	varcontainer( const varcontainer& ) = default;
+	varcontainer( varcontainer&& ) = default;
 	virtual ~varcontainer() {}
 	
+	varcontainer&	operator =( const varcontainer& ) = default;
+	varcontainer&	operator =( varcontainer&& ) = default;
+	
 	virtual void	print( size_t indentLevel ) const;
 	
-	map<string,vardesc>			variables;		// Variables that have been defined.
+	atom_map<vardesc>			variables;		// Variables that have been defined.
 };
 
 
 class varfunccontainer : public varcontainer
 {
 public:
+	varfunccontainer() = default;
+	varfunccontainer( const varfunccontainer& ) = default;
+	varfunccontainer( varfunccontainer&& ) = default;
 	virtual ~varfunccontainer() {}
 	
+	varfunccontainer&	operator =( const varfunccontainer& ) = default;
+	varfunccontainer&	operator =( varfunccontainer&& ) = default;
+	
 	virtual void	print( size_t indentLevel ) const;
 	
-	map<string,functypedesc>	function_types;	// Forward-declared functions.
-	map<string,funcdesc>		functions;		// Function definitions.
+	atom_map<functypedesc>		function_types;	// Forward-declared functions.
+	atom_map<funcdesc>			functions;		// Function definitions.
 };
 
 
-class typedesc : public varfunccontainer
+class typedesc : public varfunccontainer, public counted<counted_typedesc>
 {
 public:
-	typedesc( string inName = "" ) : type_name(inName), is_struct(true), number_of_superclasses(0) {}
-	typedesc( const typedesc& inOriginal ) : type_name(inOriginal.type_name), union_name(inOriginal.union_name), template_arguments(inOriginal.template_arguments), superclass_name(inOriginal.superclass_name), superclass_template_arguments(inOriginal.superclass_template_arguments), is_struct(inOriginal.is_struct), number_of_superclasses(inOriginal.number_of_superclasses) { variables = inOriginal.variables; function_types = inOriginal.function_types; functions = inOriginal.functions; }
+	explicit typedesc( atom inName = atom() ) : type_name(inName), number_of_superclasses(0), is_struct(true), is_placeholder(false) {}
 	
-	funcdesc		find_function( const program& theProgram, const string& name, string& outClassName ) const;
-	size_t			find_override_depth_for_function( const program& theProgram, const string& name ) const;
 	virtual void	print( size_t indentLevel ) const override;
 	
-	string				type_name;					// Name of this type.
-	string				union_name;					// Name of the union this type belongs to.
-	vector<typedesc>	template_arguments;			// Types for all template arguments.
-	string				superclass_name;					// Name of the base class for this type.
-	vector<typedesc>	superclass_template_arguments;	// Types for all template arguments to the base class.
+	atom				type_name;					// Name of this type.
+	atom				union_name;					// Name of the union this type belongs to.
+	vector<type_handle>	template_arguments;			// Types for all template arguments.
+	atom				superclass_name;					// Name of the base class for this type.
+	vector<type_handle>	superclass_template_arguments;	// Types for all template arguments to the base class.
 	size_t				number_of_superclasses;
 	bool				is_struct;
+	bool				is_placeholder;		// Only type_name and is_struct are set yet, see resolve_placeholder_type().
 };
 
 
@@ -186,38 +790,38 @@ void	typedesc::print( size_t indentLevel ) const
 	{
 		cout << "<";
 		bool	isFirst = true;
-		for( auto currArg : template_arguments )
+		for( const type_handle& currArg : template_arguments )
 		{
 			if( !isFirst )
 				cout << ", ";
 			else
 				isFirst = false;
-			currArg.print(0);
+			currArg->print(0);
 		}
 		cout << ">";
 	}
 	
-	if( superclass_name.length() > 0 )
+	if( !superclass_name.empty() )
 	{
 		cout << " : " << superclass_name;
 		if( superclass_template_arguments.size() > 0 )
 		{
 			cout << "<";
 			bool	isFirst = true;
-			for( auto currArg : superclass_template_arguments )
+			for( const type_handle& currArg : superclass_template_arguments )
 			{
 				if( !isFirst )
 					cout << ", ";
 				else
 					isFirst = false;
-				currArg.print(indentLevel);
+				currArg->print(indentLevel);
 			}
 			cout << ">";
 		}
 		
 		cout << " (" << number_of_superclasses << ")";
 	}
-	if( union_name.size() > 0 )
+	if( !union_name.empty() )
 		cout << " @union " << union_name;
 	if( variables.size() > 0 || functions.size() > 0 || function_types.size() > 0 )
 		cout << endl;
@@ -225,37 +829,83 @@ void	typedesc::print( size_t indentLevel ) const
 }
 
 
-class classdesc : public typedesc
+// One entry of a class's vtable. Its index in classdesc::method_slots is
+//	the same in all subclasses.
+struct method_slot
+{
+	method_slot() : owner_depth(0), is_overridden(false) {}
+	
+	atom	owner;			// Class that declared the method first, whose ___isa struct has it.
+	size_t	owner_depth;	// The owner's number_of_superclasses.
+	atom	implementer;	// Most derived class that defines the method.
+	bool	is_overridden;	// The implementer isn't the owner.
+};
+
+
+class classdesc : public typedesc, public counted<counted_classdesc>
 {
 public:
-	classdesc( string inName = "" ) : typedesc(inName) {}
+	explicit classdesc( atom inName = atom() ) : typedesc(inName) {}
+	
+	void	add_method_slot( atom inName );
+	
+	atom_map<method_slot>	method_slots;	// All methods, inherited ones first. See validate_class().
 };
 
 
-class vardesc : public typedesc
+void	classdesc::add_method_slot( atom inName )
+{
+	method_slot&	newSlot = method_slots[inName];
+	newSlot.owner = type_name;
+	newSlot.owner_depth = number_of_superclasses;
+	newSlot.implementer = type_name;
+	newSlot.is_overridden = false;
+}
+
+
+class vardesc
 {
 public:
-	vardesc( string inName, const typedesc& inType ) : typedesc(inType), var_name(inName) {}
-	vardesc() : typedesc("") {}
+	typedef enum : uint8_t {
+		normal_field,
+		hot_field,		// Marked '@hot', goes first so it shares a cache line with the vtable.
+		cold_field		// Marked '@cold', goes into a separate struct, see layout_class().
+	} field_temperature;
 	
-	virtual void	print( size_t indentLevel ) const override;
+	vardesc( atom inName, const type_handle& inType, field_temperature inTemperature = normal_field ) : var_name(inName), type(inType), temperature(inTemperature) {}
+	vardesc() : temperature(normal_field) {}
+	
+	void	print( size_t indentLevel ) const;
 	
-	string	var_name;
+	atom				var_name;
+	type_handle			type;
+	field_temperature	temperature;
 };
 
 
 void	vardesc::print( size_t indentLevel ) const
 {
 	cout << indent( indentLevel );
-	typedesc::print(0);
+	if( temperature == hot_field )
+		cout << "@hot ";
+	else if( temperature == cold_field )
+		cout << "@cold ";
+	type->print(0);
 	cout << "\t" << var_name;
 }
 
 
-class term
+// Terms of a function body all live in that function's term_arena and refer
+//	to each other by 32-bit index instead of owning their parameters, so
+//	building, copying or destroying an expression costs no allocation per node.
+const term_index	no_term = UINT32_MAX;
+const uint32_t		no_slot = UINT32_MAX;
+
+
+class term : public counted<counted_term>
 {
 public:
-	typedef enum {
+	typedef enum : uint8_t {
 		quoted_string,
 		character,
 		integer,
@@ -268,91 +918,159 @@ public:
 		class_object
 	} term_type;
 
-	term( std::string inName = "" ) : func_name(inName), kind(function_call) {}
-	
-	void	print( size_t indentLevel ) const
-	{
-		switch( kind )
-		{
-			case quoted_string:
-				cout << indent(indentLevel) << "\"" << func_name << "\"";
-				break;
-			case character:
-				cout << indent(indentLevel) << "'" << func_name << "'";
-				break;
-			case integer:
-				cout << indent(indentLevel) << func_name;
-				break;
-			case number:
-				cout << indent(indentLevel) << func_name;
-				break;
-			case function_call:
-			{
-				cout << indent(indentLevel) << func_name << "( ";
-				bool	isFirst = true;
-				for( auto currParam : parameters )
-				{
-					if( !isFirst )
-						cout << ", ";
-					else
-						isFirst = false;
-					currParam.print(0);
-				}
-				cout << " )";
-				break;
-			}
-			case field:
-				cout << indent(indentLevel) << "@field(" << func_name << ")";
-				break;
-			case variable:
-				cout << indent(indentLevel) << func_name;
-				break;
-			case global_variable:
-				cout << indent(indentLevel) << "@global(" << func_name << ")";
-				break;
-			case parameter:
-				cout << indent(indentLevel) << "@parameter(" << func_name << ")";
-				break;
-			case class_object:
-				cout << indent(indentLevel) << "@class(" << func_name << ")";
-				break;
-		}
-	}
+	explicit term( atom inName = atom(), term_type inKind = function_call ) : kind(inKind), slot(no_slot), func_name(inName), first_parameter(no_term), next_parameter(no_term), value() {}
 	
 	term_type			kind;
-	std::string			func_name;
-	vector<term>		parameters;
+	uint32_t			slot;		// What a variable, parameter or field term refers to, see scope.
+	atom				func_name;
+	term_index			first_parameter;	// Parameters are a list linked through next_parameter.
+	term_index			next_parameter;
+	atom				direct_class;	// Whose method a member of '.' or '->' calls without the vtable, see devirtualize_calls().
+	literal_value		value;		// Of integer and number terms.
 };
 
 
-class functypedesc
+class term_arena
 {
 public:
-	functypedesc( string inName = "" ) : func_name(inName) {}
-	virtual ~functypedesc() {}
+	// Returns an index, not a reference: Adding terms may move the others.
+	term_index	new_term( atom inName = atom(), term::term_type inKind = term::function_call )
+	{
+		mTerms.emplace_back( inName, inKind );
+		return term_index( mTerms.size() -1 );
+	}
 	
-	virtual void	print( size_t indentLevel ) const
+	term&		operator []( term_index inIndex )			{ return mTerms[inIndex]; }
+	const term&	operator []( term_index inIndex ) const		{ return mTerms[inIndex]; }
+	
+	void		add_parameter( term_index inParent, term_index inParameter )
+	{
+		term_index*	lastLink = &mTerms[inParent].first_parameter;
+		while( *lastLink != no_term )
+			lastLink = &mTerms[*lastLink].next_parameter;
+		*lastLink = inParameter;
+	}
+	
+	term_index	parameter( term_index inParent, size_t inNumber ) const	// no_term if there are fewer parameters.
+	{
+		term_index	currParam = mTerms[inParent].first_parameter;
+		while( currParam != no_term && inNumber-- > 0 )
+			currParam = mTerms[currParam].next_parameter;
+		return currParam;
+	}
+	
+	size_t		size() const	{ return mTerms.size(); }
+	void		reserve( size_t inCount )	{ mTerms.reserve( inCount ); }
+	
+	void		print( term_index inIndex, size_t indentLevel ) const;
+	
+protected:
+	vector<term>	mTerms;
+};
+
+
+void	term_arena::print( term_index inIndex, size_t indentLevel ) const
+{
+	const term&	theTerm = mTerms[inIndex];
+	if( !theTerm.direct_class.empty() )
+	{
+		cout << indent(indentLevel) << "@direct(" << theTerm.direct_class << "___" << theTerm.func_name << ")";
+		return;
+	}
+	switch( theTerm.kind )
+	{
+		case term::quoted_string:
+			cout << indent(indentLevel) << "\"" << theTerm.func_name << "\"";
+			break;
+		case term::character:
+			cout << indent(indentLevel) << "'" << theTerm.func_name << "'";
+			break;
+		case term::integer:
+			cout << indent(indentLevel) << theTerm.value.integer;
+			break;
+		case term::number:
+			cout << indent(indentLevel);
+			print_number( cout, theTerm.value.number );
+			break;
+		case term::function_call:
+		{
+			cout << indent(indentLevel) << theTerm.func_name << "( ";
+			for( term_index currParam = theTerm.first_parameter; currParam != no_term; currParam = mTerms[currParam].next_parameter )
+			{
+				if( currParam != theTerm.first_parameter )
+					cout << ", ";
+				print( currParam, 0 );
+			}
+			cout << " )";
+			break;
+		}
+		case term::field:
+			cout << indent(indentLevel) << "@field(" << theTerm.func_name << ")";
+			break;
+		case term::variable:
+			cout << indent(indentLevel) << theTerm.func_name;
+			break;
+		case term::global_variable:
+			cout << indent(indentLevel) << "@global(" << theTerm.func_name << ")";
+			break;
+		case term::parameter:
+			cout << indent(indentLevel) << "@parameter(" << theTerm.func_name << ")";
+			break;
+		case term::class_object:
+			cout << indent(indentLevel) << "@class(" << theTerm.func_name << ")";
+			break;
+	}
+}
+
+
+class functypedesc
+{
+public:
+	explicit functypedesc( atom inName = atom() ) : func_name(inName) {}
+	functypedesc( const functypedesc& ) = default;
+	functypedesc( functypedesc&& ) = default;	// See varcontainer.
+	virtual ~functypedesc() {}
+	
+	functypedesc&	operator =( const functypedesc& ) = default;
+	functypedesc&	operator =( functypedesc&& ) = default;
+	
+	virtual void	print( size_t indentLevel ) const
 	{
 		cout << indent(indentLevel);
-		return_type.print(0);
+		return_type->print(0);
 		cout << "\t" << func_name << "( ";
-		for( auto currParam : param_types )
+		for( const vardesc& currParam : param_types )
 		{
 			currParam.print(0);
 		}
 		cout << " )" << endl;
 	}
 	
-	string				func_name;
+	atom				func_name;
 	vector<vardesc>		param_types;
-	typedesc			return_type;
+	type_handle			return_type;
+};
+
+
+struct parse_snapshot;
+
+
+// Where a function body is that the parser skipped because
+//	program::lazy_function_bodies was set, and what it could see there:
+struct skipped_function_body
+{
+	shared_ptr<const parse_snapshot>	snapshot;
+	size_t								first_token;		// Just after the '{'.
+	size_t								end_token;			// The '}'.
+	size_t								construct_index;	// In snapshot's outline.
+	vector<atom>						visible_fields;		// Of its class, declared before it.
 };
 
 
-class funcdesc : public functypedesc, public varcontainer
+class funcdesc : public functypedesc, public varcontainer, public counted<counted_funcdesc>
 {
 public:
-	funcdesc( string inName = "" ) : functypedesc(inName), is_pure_virtual(false), is_override(false) {}
+	explicit funcdesc( atom inName = atom() ) : functypedesc(inName), is_pure_virtual(false), is_override(false) {}
 	
 	virtual void	print( size_t indentLevel ) const override
 	{
@@ -361,93 +1079,144 @@ public:
 		if( commands.size() > 0 )
 		{
 			cout << indent(indentLevel) << "COMMANDS:" << endl;
-			for( auto currCmd : commands )
+			for( term_index currCmd : commands )
 			{
-				currCmd.print( indentLevel +1 );
+				terms.print( currCmd, indentLevel +1 );
 				cout << endl;
 			}
 		}
 	}
 
-	vector<term>	commands;
+	term_arena			terms;		// Owns all terms of commands.
+	vector<term_index>	commands;
+	shared_ptr<const skipped_function_body>	skipped_body;	// Set until parse_skipped_function_bodies() parses the body.
 	
 	bool	is_pure_virtual;
 	bool	is_override;
 };
 
 
-class program : public varfunccontainer
+// One level of names a function body can refer to, in the order they hide
+//	each other: local variables, then parameters, then fields of the class.
+//	Each level finds a name with one probe and tells which slot it is in:
+//	its index in funcdesc::variables, funcdesc::param_types or the class's
+//	variables. Classes and global variables are looked up in the program.
+class scope
 {
 public:
-	program();
-	
-	virtual void	print( size_t indentLevel ) const override;
+	scope( term::term_type inKind, const scope* inOuter ) : kind(inKind), outer(inOuter), variables(nullptr) {}
+	scope( term::term_type inKind, const atom_map<vardesc>& inVariables, const scope* inOuter ) : kind(inKind), outer(inOuter), variables(&inVariables) {}
 	
-	map<string,typedesc>		types;			// Forward-declared types.
-	map<string,classdesc>		classes;		// Class definitions.
-	map<string,size_t>			binary_operator_priorities;
-};
-
-
-funcdesc	typedesc::find_function( const program& theProgram, const string& name, string& outClassName ) const
-{
-	auto	foundFunc = functions.find( name );
-	if( foundFunc != functions.end() )
-	{
-		outClassName = type_name;
-		return foundFunc->second;
-	}
+	void			declare( atom inName, uint32_t inSlot )	{ names.emplace( inName, inSlot ); }	// The first one wins.
 	
-	if( superclass_name.length() > 0 )
+	// The innermost scope that has inName, or NULL:
+	const scope*	resolve( atom inName, uint32_t& outSlot ) const
 	{
-		auto	foundClass = theProgram.classes.find( superclass_name );
-		if( foundClass != theProgram.classes.end() && !foundClass->second.is_struct )
-			foundClass->second.find_function( theProgram, name, outClassName );
-		
-		auto	foundType = theProgram.types.find( superclass_name );
-		if( foundType != theProgram.types.end() && !foundType->second.is_struct )
+		for( const scope* currScope = this; currScope; currScope = currScope->outer )
 		{
-			foundType->second.find_function( theProgram, name, outClassName );
+			if( currScope->variables )
+			{
+				auto	foundVar = currScope->variables->find( inName );
+				if( foundVar != currScope->variables->end() )
+				{
+					outSlot = uint32_t( foundVar -currScope->variables->begin() );
+					return currScope;
+				}
+			}
+			else
+			{
+				auto	foundName = currScope->names.find( inName );
+				if( foundName != currScope->names.end() )
+				{
+					outSlot = foundName->second;
+					return currScope;
+				}
+			}
 		}
+		return nullptr;
 	}
 	
-	return funcdesc();
-}
+	term::term_type				kind;		// Of terms naming something found here.
+	const scope*				outer;
+	const atom_map<vardesc>*	variables;	// Looked up instead of names if set, so it sees additions.
+	unordered_map<atom,uint32_t>	names;
+};
+
 
+typedef uint8_t	operator_id;	// Index into program::binary_operators, 0 means "not an operator".
 
-size_t	typedesc::find_override_depth_for_function( const program& theProgram, const string& name ) const
+
+class binary_operator
 {
-	auto	foundFunc = functions.find( name );
-	if( foundFunc != functions.end() )
-	{
-		if( !foundFunc->second.is_override )	// This one is topmost!
-			return 0;
-	}
+public:
+	atom		name;
+	size_t		priority;
+	bool		is_right_associative;
+};
+
+
+// Operators are lexed one character per token, so the parser matches them
+//	character by character through a trie whose nodes say which operator
+//	ends there, if any.
+class operator_trie_node
+{
+public:
+	operator_trie_node() : operator_index(0) { next_node.fill(0); }
 	
-	if( superclass_name.length() > 0 )
-	{
-		auto	foundClass = theProgram.classes.find( superclass_name );
-		if( foundClass != theProgram.classes.end() && !foundClass->second.is_struct )
-			return foundClass->second.find_override_depth_for_function( theProgram, name ) +1;
-	}
+	array<uint8_t,128>	next_node;	// Index of the node for each ASCII character, 0 if none.
+	operator_id			operator_index;
+};
+
+
+class program_outline;
+
+
+class program : public varfunccontainer
+{
+public:
+	program();
 	
-	return 1;
-}
+	virtual void	print( size_t indentLevel ) const override;
+	
+	// Lookups the parser does, which also see the declarations of earlier
+	//	constructs in outline while one construct is parsed on its own:
+	bool		find_type( atom inName, type_handle& outType );
+	type_handle	named_type( atom inName );	// A type that is only a name, like a built-in one.
+	bool	has_class( atom inName ) const;
+	bool	has_global_variable( atom inName ) const;
+	
+	atom_map<type_handle>		types;			// Forward-declared types.
+	atom_map<type_handle>		classes;		// Class definitions, the same objects as in types.
+	atom_map<type_handle>		named_types;	// Made by named_type().
+	atom_map<size_t>			binary_operator_priorities;
+	vector<binary_operator>		binary_operators;		// Compiled from binary_operator_priorities, indexed by operator_id.
+	vector<operator_trie_node>	binary_operator_trie;	// Node 0 is the root.
+	
+	const program_outline*		outline;				// Set while parsing constructs in parallel.
+	size_t						outline_position;		// Index of the construct being parsed in outline.
+	bool						saw_redeclared_type;	// Made a placeholder for a type declared more than once.
+	bool						lazy_function_bodies;	// Only note where function bodies are, see skip_function_body().
+	bool						replaced_skipped_body;	// A definition replaced one whose body was skipped, so that body never gets parsed.
+	shared_ptr<const parse_snapshot>	body_snapshot;	// Set while parsing constructs in parallel.
+
+protected:
+	void	compile_binary_operators();
+};
 
 
 void	program::print( size_t indentLevel ) const
 {
 	varfunccontainer::print( indentLevel );
 	cout << "TYPES:" << endl;
-	for( auto currType : types )
+	for( const pair<atom,type_handle>& currType : types )
 	{
-		currType.second.print( indentLevel +1 );
+		currType.second->print( indentLevel +1 );
 		cout << endl;
 	}
 	cout << "CLASSES:" << endl;
-	for( const pair<string,classdesc>& currClass : classes )
+	for( const pair<atom,type_handle>& currClass : classes )
 	{
-		currClass.second.print( indentLevel +1 );
+		currClass.second->print( indentLevel +1 );
 	}
 }
 
@@ -457,7 +1226,7 @@ void	varcontainer::print( size_t indentLevel ) const
 	if( variables.size() > 0 )
 	{
 		cout << indent(indentLevel) << "VARIABLES:" << endl;
-		for( const std::pair<string,vardesc>& currVar : variables )
+		for( const pair<atom,vardesc>& currVar : variables )
 		{
 			currVar.second.print(indentLevel +1);
 			cout << endl;
@@ -472,12 +1241,12 @@ void	varfunccontainer::print( size_t indentLevel ) const
 	{
 		varcontainer::print( indentLevel );
 		cout << indent(indentLevel) << "FUNCTIONS:" << endl;
-		for( const std::pair<string,funcdesc>& currVar : functions )
+		for( const pair<atom,funcdesc>& currVar : functions )
 		{
 			currVar.second.print(indentLevel +1);
 		}
 		cout << indent(indentLevel) << "FUNCTION DECLARATIONS:" << endl;
-		for( auto currVar : function_types )
+		for( const pair<atom,functypedesc>& currVar : function_types )
 		{
 			currVar.second.print(indentLevel +1);
 		}
@@ -485,43 +1254,226 @@ void	varfunccontainer::print( size_t indentLevel ) const
 }
 
 
-program::program()
-{
-	types["bool"] = typedesc("bool");
-	types["int32_t"] = typedesc("int32_t");
-	types["uint32_t"] = typedesc("uint32_t");
-	types["int16_t"] = typedesc("int16_t");
-	types["uint16_t"] = typedesc("uint16_t");
-	types["int8_t"] = typedesc("int8_t");
-	types["uint8_t"] = typedesc("uint8_t");
-	types["void"] = typedesc("void");
-	types["object"] = typedesc("object");
-	classdesc	objClass("object");
-	funcdesc	deallocFunc("dealloc");
-	deallocFunc.return_type = typedesc("void");
-	objClass.functions["dealloc"] = deallocFunc;
-	classes["object"] = objClass;
-	
-	binary_operator_priorities["="] = 1000;
-	binary_operator_priorities["<<"] = 2000;
-	binary_operator_priorities[">>"] = 2000;
-	binary_operator_priorities["&&"] = 3000;
-	binary_operator_priorities["||"] = 4000;
-	binary_operator_priorities["=="] = 5000;
-	binary_operator_priorities["!="] = 5000;
-	binary_operator_priorities["<"] = 5000;
-	binary_operator_priorities[">"] = 5000;
-	binary_operator_priorities["<="] = 5000;
-	binary_operator_priorities[">="] = 5000;
-	binary_operator_priorities["+"] = 6000;
-	binary_operator_priorities["-"] = 6000;
-	binary_operator_priorities["*"] = 7000;
-	binary_operator_priorities["/"] = 7000;
-	binary_operator_priorities["%"] = 7000;
-	binary_operator_priorities["."] = 9000;
-	binary_operator_priorities["->"] = 9000;
+program::program() : outline(nullptr), outline_position(0), saw_redeclared_type(false), lazy_function_bodies(false), replaced_skipped_body(false)
+{
+	for( const char* currName : { "bool", "int32_t", "uint32_t", "int16_t", "uint16_t", "int8_t", "uint8_t", "void", "object" } )
+		types[atom(currName)] = make_shared<typedesc>( atom(currName) );
+	shared_ptr<classdesc>	objClass = make_shared<classdesc>( atom_object );
+	objClass->is_struct = false;
+	funcdesc	deallocFunc( atom("dealloc") );
+	deallocFunc.return_type = types.find( atom("void") )->second;
+	objClass->functions[deallocFunc.func_name] = deallocFunc;
+	objClass->add_method_slot( deallocFunc.func_name );
+	classes[atom_object] = objClass;
+	
+	binary_operator_priorities[atom_assign] = 1000;
+	binary_operator_priorities[atom("<<")] = 2000;
+	binary_operator_priorities[atom(">>")] = 2000;
+	binary_operator_priorities[atom("&&")] = 3000;
+	binary_operator_priorities[atom("||")] = 4000;
+	binary_operator_priorities[atom("==")] = 5000;
+	binary_operator_priorities[atom("!=")] = 5000;
+	binary_operator_priorities[atom_less_than] = 5000;
+	binary_operator_priorities[atom_greater_than] = 5000;
+	binary_operator_priorities[atom("<=")] = 5000;
+	binary_operator_priorities[atom(">=")] = 5000;
+	binary_operator_priorities[atom("+")] = 6000;
+	binary_operator_priorities[atom("-")] = 6000;
+	binary_operator_priorities[atom("*")] = 7000;
+	binary_operator_priorities[atom("/")] = 7000;
+	binary_operator_priorities[atom("%")] = 7000;
+	binary_operator_priorities[atom_dot] = 9000;
+	binary_operator_priorities[atom_arrow] = 9000;
+	
+	compile_binary_operators();
+}
+
+
+void	program::compile_binary_operators()
+{
+	binary_operators.assign( 1, binary_operator{ atom(), 0, false } );
+	binary_operator_trie.assign( 1, operator_trie_node() );
+	for( const pair<atom,size_t>& currOperator : binary_operator_priorities )
+	{
+		if( binary_operators.size() > numeric_limits<operator_id>::max() )
+			throw runtime_error( "Too many binary operators." );
+		binary_operators.push_back( binary_operator{ currOperator.first, currOperator.second, currOperator.first == atom_assign } );
+		
+		size_t	currNode = 0;
+		for( char currCh : currOperator.first.name() )
+		{
+			uint8_t	nextNode = binary_operator_trie[currNode].next_node[currCh & 0x7F];
+			if( nextNode == 0 )
+			{
+				if( binary_operator_trie.size() > numeric_limits<uint8_t>::max() )
+					throw runtime_error( "Binary operator names too long." );
+				nextNode = uint8_t( binary_operator_trie.size() );
+				binary_operator_trie[currNode].next_node[currCh & 0x7F] = nextNode;
+				binary_operator_trie.emplace_back();
+			}
+			currNode = nextNode;
+		}
+		binary_operator_trie[currNode].operator_index = operator_id( binary_operators.size() -1 );
+	}
+}
+
+// Numeric literals:
+//	The lexer collects everything C would consider part of a number (digits,
+//	letters, '.' and a sign right after an exponent 'e' or 'p'), and then it
+//	is decoded here, once. Decimal and hex integers with optional u/l/ll
+//	suffixes become token::integer, floats with an optional f/l suffix
+//	token::number. Anything else (like "12abc", or an integer that doesn't
+//	fit into 64 bits) stays an identifier, which the parser reports.
+
+const double	exact_powers_of_ten[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+										1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+
+constexpr bool	is_digit( char currCh )
+{
+	return currCh >= '0' && currCh <= '9';
+}
+
+
+constexpr bool	is_exponent_char( char currCh )
+{
+	return currCh == 'e' || currCh == 'E' || currCh == 'p' || currCh == 'P';
+}
+
+
+inline unsigned	digit_value( char currCh )
+{
+	if( currCh >= '0' && currCh <= '9' )
+		return currCh -'0';
+	else if( currCh >= 'a' && currCh <= 'f' )
+		return currCh -'a' +10;
+	else if( currCh >= 'A' && currCh <= 'F' )
+		return currCh -'A' +10;
+	return 16;
+}
+
+
+// Accumulate digits of the given base into ioMantissa. Sets ioOverflow if
+//	they don't fit into 64 bits. Returns the first character after them.
+inline const char*	parse_digits( const char* inStart, const char* inEnd, unsigned inBase, uint64_t& ioMantissa, size_t& outDigitCount, bool& ioOverflow )
+{
+	const char*	curr = inStart;
+	for( unsigned digit; curr != inEnd && (digit = digit_value( *curr )) < inBase; curr++ )
+	{
+		if( __builtin_mul_overflow( ioMantissa, (uint64_t)inBase, &ioMantissa )
+			|| __builtin_add_overflow( ioMantissa, (uint64_t)digit, &ioMantissa ) )
+			ioOverflow = true;
+	}
+	outDigitCount = curr -inStart;
+	return curr;
+}
+
+
+// u, l, ll, ul, ull, lu, llu in any case (but not lL).
+bool	is_integer_suffix( string_view inSuffix )
+{
+	size_t	x = 0;
+	bool	hadUnsigned = false;
+	if( x < inSuffix.length() && (inSuffix[x] == 'u' || inSuffix[x] == 'U') )
+	{
+		hadUnsigned = true;
+		x++;
+	}
+	if( x < inSuffix.length() && (inSuffix[x] == 'l' || inSuffix[x] == 'L') )
+	{
+		x++;
+		if( x < inSuffix.length() && inSuffix[x] == inSuffix[x -1] )
+			x++;
+	}
+	if( !hadUnsigned && x < inSuffix.length() && (inSuffix[x] == 'u' || inSuffix[x] == 'U') )
+		x++;
+	return x == inSuffix.length();
+}
+
+
+// Returns false if inText isn't a valid numeric literal.
+bool	decode_number( string_view inText, token::token_kind& outKind, literal_value& outValue )
+{
+	const char*	start = inText.data();
+	const char*	end = start +inText.length();
+	bool		isHex = inText.length() > 2 && start[0] == '0' && (start[1] == 'x' || start[1] == 'X');
+	unsigned	base = isHex ? 16 : 10;
+	uint64_t	mantissa = 0;
+	size_t		digitCount = 0, fractionDigitCount = 0;
+	bool		overflow = false;
+	bool		isFloat = false;
+	long		exponent = 0;
+	
+	const char*	curr = parse_digits( isHex ? start +2 : start, end, base, mantissa, digitCount, overflow );
+	if( digitCount == 0 )
+		return false;
+	
+	if( curr != end && *curr == '.' )
+	{
+		isFloat = true;
+		curr = parse_digits( curr +1, end, base, mantissa, fractionDigitCount, overflow );
+		exponent = -(long)fractionDigitCount;
+	}
+	if( curr != end && (isHex ? (*curr == 'p' || *curr == 'P') : (*curr == 'e' || *curr == 'E')) )
+	{
+		isFloat = true;
+		curr++;
+		bool	isNegative = (curr != end && *curr == '-');
+		if( curr != end && (*curr == '-' || *curr == '+') )
+			curr++;
+		if( curr == end || !is_digit( *curr ) )
+			return false;
+		long	exponentValue = 0;
+		for( ; curr != end && is_digit( *curr ); curr++ )
+			exponentValue = min( exponentValue * 10 +(*curr -'0'), 100000L );
+		exponent += isNegative ? -exponentValue : exponentValue;
+	}
+	else if( isHex && isFloat )
+		return false;	// Hex floats need a binary exponent.
+	
+	string_view	suffix( curr, end -curr );
+	if( !isFloat )
+	{
+		if( overflow || !is_integer_suffix( suffix ) )
+			return false;
+		outKind = token::integer;
+		outValue.integer = mantissa;
+		return true;
+	}
+	
+	if( !suffix.empty() && suffix != "f" && suffix != "F" && suffix != "l" && suffix != "L" )
+		return false;
+	
+	double	value;
+	if( !isHex && !overflow && mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22 )
+	{
+		// Clinger's fast path: Both mantissa and power of ten are exact doubles,
+		//	so a single multiplication or division is correctly rounded.
+		value = (double)mantissa;
+		value = (exponent < 0) ? value / exact_powers_of_ten[-exponent] : value * exact_powers_of_ten[exponent];
+	}
+	else
+	{
+		string	numberText( start, curr );	// strtod() needs a terminated string.
+		value = strtod( numberText.c_str(), nullptr );
+	}
+	if( suffix == "f" || suffix == "F" )
+		value = (float)value;
+	
+	outKind = token::number;
+	outValue.number = value;
+	return true;
+}
+
+
+// Numbers are lexed as token::integer until they're complete:
+void	decode_number_token( token& ioToken )
+{
+	if( !decode_number( ioToken.text, ioToken.kind, ioToken.value ) )
+		ioToken.kind = token::identifier;
 }
 
+
 void	finish_token( info& ioInfo )
 {
 	if( ioInfo.curr_token.kind != token::quoted_string && ioInfo.curr_token.kind != token::character
@@ -530,49 +1482,236 @@ void	finish_token( info& ioInfo )
 	
 	if( ioInfo.curr_token.kind != token::whitespace )
 	{
-		ioInfo.curr_token.lineNumber = ioInfo.lineNumber;
+		if( ioInfo.curr_token.kind == token::integer )	// Any number, we only know which kind once we have all of it.
+			decode_number_token( ioInfo.curr_token );
+		if( ioInfo.curr_token.kind == token::identifier || ioInfo.curr_token.kind == token::operator_identifier )
+			ioInfo.curr_token.name = atom( ioInfo.curr_token.text );
 		ioInfo.tokens.push_back( ioInfo.curr_token );
-		ioInfo.curr_token.text.erase();
+		ioInfo.curr_token.name = atom();
+		ioInfo.curr_token.value = literal_value();
+		ioInfo.curr_token.text = string_view();
 		ioInfo.curr_token.kind = token::whitespace;
 	}
 }
 
 
-bool	is_operator( char currCh )
+// Start an empty token of the given kind right after the character we just read.
+//	Used for quoted strings and characters, which may legitimately be empty.
+void	begin_token( info& ioInfo, token::token_kind inKind )
 {
-	switch( currCh )
+	ioInfo.curr_token.kind = inKind;
+	ioInfo.curr_token.text = string_view( ioInfo.curr, 0 );
+	ioInfo.curr_token.offset = ioInfo.curr -ioInfo.start;
+	ioInfo.curr_token.lineNumber = ioInfo.lineNumber;
+}
+
+
+// Add the character we just read to the current token. Since the text is
+//	a view into the source buffer, this just grows the view.
+void	append_to_token( info& ioInfo )
+{
+	if( ioInfo.curr_token.text.length() == 0 )
 	{
-		case '[':
-		case ']':
-		case '{':
-		case '}':
-		case '(':
-		case ')':
-		case '.':
-		case ',':
-		case ':':
-		case ';':
-		case '<':
-		case '>':
-		case '!':
-		case '%':
-		case '^':
-		case '&':
-		case '*':
-		case '-':
-		case '+':
-		case '/':
-		case '=':
-		case '|':
-		case '?':
-			return true;
-			break;
-		
-		default:
-			return false;
+		const char*	tokenStart = ioInfo.curr -1;
+		ioInfo.curr_token.text = string_view( tokenStart, 0 );
+		ioInfo.curr_token.offset = tokenStart -ioInfo.start;
+		ioInfo.curr_token.lineNumber = ioInfo.lineNumber;
+	}
+	ioInfo.curr_token.text = string_view( ioInfo.curr_token.text.data(), ioInfo.curr -ioInfo.curr_token.text.data() );
+}
+
+
+// Table of all characters that are lexed as single-character operators:
+constexpr array<bool,256>	make_operator_table()
+{
+	array<bool,256>	table = {};
+	for( char currCh : string_view("[]{}().,:;<>!%^&*-+/=|?") )
+		table[(unsigned char)currCh] = true;
+	return table;
+}
+
+constexpr array<bool,256>	operator_table = make_operator_table();
+
+
+inline bool	is_operator( char currCh )
+{
+	return operator_table[(unsigned char)currCh];
+}
+
+
+// Run scanners:
+//	Each of these returns a pointer to the first character at or after
+//	inStart that is *not* part of the run, or inEnd. They only skip
+//	characters that the lexer states would just have appended to the
+//	current token (or ignored) anyway, and never skip line breaks or NUL
+//	bytes, so the main loop in tokenize() still sees all characters that
+//	change state or line numbers. The SIMD versions classify 16 (SSE2) or
+//	32 (AVX2) bytes per step, the scalar loops handle the rest.
+
+inline bool	is_fast_identifier_char( char currCh )
+{
+	unsigned char	ch = (unsigned char)currCh;
+	return (ch >= '0' && ch <= '9') || (ch >= '@' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || ch == '_' || ch >= 0x80;
+}
+
+
+inline bool	is_blank( char currCh )
+{
+	return currCh == ' ' || currCh == '\t';
+}
+
+
+inline bool	is_line_end_or_nul( char currCh )
+{
+	return currCh == '\n' || currCh == '\r' || currCh == '\0';
+}
+
+
+#if defined(__AVX2__)
+
+typedef __m256i	scan_vector;
+
+inline scan_vector	scan_load( const char* inStart )				{ return _mm256_loadu_si256( (const __m256i*) inStart ); }
+inline scan_vector	scan_splat( char inCh )							{ return _mm256_set1_epi8( inCh ); }
+inline scan_vector	scan_equal( scan_vector a, char inCh )			{ return _mm256_cmpeq_epi8( a, scan_splat(inCh) ); }
+inline scan_vector	scan_or( scan_vector a, scan_vector b )			{ return _mm256_or_si256( a, b ); }
+inline scan_vector	scan_negative( scan_vector a )					{ return _mm256_cmpgt_epi8( _mm256_setzero_si256(), a ); }
+inline uint32_t		scan_mask( scan_vector a )						{ return (uint32_t)_mm256_movemask_epi8( a ); }
+
+#elif defined(__SSE2__)
+
+typedef __m128i	scan_vector;
+
+inline scan_vector	scan_load( const char* inStart )				{ return _mm_loadu_si128( (const __m128i*) inStart ); }
+inline scan_vector	scan_splat( char inCh )							{ return _mm_set1_epi8( inCh ); }
+inline scan_vector	scan_equal( scan_vector a, char inCh )			{ return _mm_cmpeq_epi8( a, scan_splat(inCh) ); }
+inline scan_vector	scan_or( scan_vector a, scan_vector b )			{ return _mm_or_si128( a, b ); }
+inline scan_vector	scan_negative( scan_vector a )					{ return _mm_cmplt_epi8( a, _mm_setzero_si128() ); }
+inline uint32_t		scan_mask( scan_vector a )						{ return (uint32_t)_mm_movemask_epi8( a ); }
+
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+
+#define SCAN_HAVE_SIMD	1
+
+const size_t	scan_vector_size = sizeof(scan_vector);
+const uint32_t	scan_all_bytes = (scan_vector_size == 32) ? 0xffffffffU : 0xffffU;
+
+
+// Bytes in the range inFirst...inLast (inclusive, both < 0x80):
+inline scan_vector	scan_in_range( scan_vector a, char inFirst, char inLast )
+{
+	// Shift the range down so it starts at -128, then one signed compare does it:
+#if defined(__AVX2__)
+	scan_vector	shifted = _mm256_add_epi8( a, scan_splat( (char)(-128 -inFirst) ) );
+	return _mm256_cmpgt_epi8( scan_splat( (char)(-128 +(inLast -inFirst) +1) ), shifted );
+#else
+	scan_vector	shifted = _mm_add_epi8( a, scan_splat( (char)(-128 -inFirst) ) );
+	return _mm_cmplt_epi8( shifted, scan_splat( (char)(-128 +(inLast -inFirst) +1) ) );
+#endif
+}
+
+#endif // defined(__AVX2__) || defined(__SSE2__)
+
+
+const char*	skip_identifier_chars( const char* inStart, const char* inEnd )
+{
+	const char*	curr = inStart;
+#if SCAN_HAVE_SIMD
+	while( (size_t)(inEnd -curr) >= scan_vector_size )
+	{
+		scan_vector	chars = scan_load( curr );
+		scan_vector	identifierChars = scan_or( scan_or( scan_in_range( chars, '0', '9' ), scan_in_range( chars, '@', 'Z' ) ),
+											scan_or( scan_or( scan_in_range( chars, 'a', 'z' ), scan_equal( chars, '_' ) ), scan_negative( chars ) ) );
+		uint32_t	stopMask = ~scan_mask( identifierChars ) & scan_all_bytes;
+		if( stopMask != 0 )
+			return curr +__builtin_ctz( stopMask );
+		curr += scan_vector_size;
+	}
+#endif
+	while( curr != inEnd && is_fast_identifier_char( *curr ) )
+		curr++;
+	return curr;
+}
+
+
+const char*	skip_blanks( const char* inStart, const char* inEnd )
+{
+	const char*	curr = inStart;
+#if SCAN_HAVE_SIMD
+	while( (size_t)(inEnd -curr) >= scan_vector_size )
+	{
+		scan_vector	chars = scan_load( curr );
+		uint32_t	stopMask = ~scan_mask( scan_or( scan_equal( chars, ' ' ), scan_equal( chars, '\t' ) ) ) & scan_all_bytes;
+		if( stopMask != 0 )
+			return curr +__builtin_ctz( stopMask );
+		curr += scan_vector_size;
+	}
+#endif
+	while( curr != inEnd && is_blank( *curr ) )
+		curr++;
+	return curr;
+}
+
+
+// Skip the body of a quoted string or character, stopping at the closing
+//	quote inQuote, at a backslash or at a line break:
+const char*	skip_quoted_chars( const char* inStart, const char* inEnd, char inQuote )
+{
+	const char*	curr = inStart;
+#if SCAN_HAVE_SIMD
+	while( (size_t)(inEnd -curr) >= scan_vector_size )
+	{
+		scan_vector	chars = scan_load( curr );
+		scan_vector	stopChars = scan_or( scan_or( scan_equal( chars, inQuote ), scan_equal( chars, '\\' ) ),
+										scan_or( scan_or( scan_equal( chars, '\n' ), scan_equal( chars, '\r' ) ), scan_equal( chars, '\0' ) ) );
+		uint32_t	stopMask = scan_mask( stopChars );
+		if( stopMask != 0 )
+			return curr +__builtin_ctz( stopMask );
+		curr += scan_vector_size;
+	}
+#endif
+	while( curr != inEnd && *curr != inQuote && *curr != '\\' && !is_line_end_or_nul( *curr ) )
+		curr++;
+	return curr;
+}
+
+
+// Skip comment text up to the end of the line, or up to the next '*' if
+//	inStopAtStar is true (for multi-line comments):
+const char*	skip_comment_chars( const char* inStart, const char* inEnd, bool inStopAtStar )
+{
+	const char*	curr = inStart;
+	char		starOrNul = inStopAtStar ? '*' : '\0';
+#if SCAN_HAVE_SIMD
+	while( (size_t)(inEnd -curr) >= scan_vector_size )
+	{
+		scan_vector	chars = scan_load( curr );
+		scan_vector	stopChars = scan_or( scan_or( scan_equal( chars, '\n' ), scan_equal( chars, '\r' ) ),
+										scan_or( scan_equal( chars, '\0' ), scan_equal( chars, starOrNul ) ) );
+		uint32_t	stopMask = scan_mask( stopChars );
+		if( stopMask != 0 )
+			return curr +__builtin_ctz( stopMask );
+		curr += scan_vector_size;
+	}
+#endif
+	while( curr != inEnd && *curr != starOrNul && !is_line_end_or_nul( *curr ) )
+		curr++;
+	return curr;
+}
+
+
+// Move past a run of characters one of the scanners above found. None of them
+//	are line breaks, so if there were any, a CR before them can't be part of
+//	a CRLF anymore.
+inline void	skip_run( info& ioInfo, const char* inRunEnd )
+{
+	if( inRunEnd != ioInfo.curr )
+	{
+		ioInfo.curr = inRunEnd;
+		ioInfo.just_had_cr = false;
 	}
-	
-	return false;
 }
 
 
@@ -607,17 +1746,19 @@ state	string_state( char currCh, class info& ioInfo )
 			return whitespace_state;
 			break;
 		
-		case '\\':
-		{
-			char	escapedChar = 0;
-			ioInfo.stream.get( escapedChar );
-			escapedChar = decode_escape(escapedChar);
-			ioInfo.curr_token.text.append( 1, currCh );
-			break;
-		}
+		case '\\':	// Keep escape sequences in the token text verbatim, just make sure the escaped quote doesn't end the string.
+			append_to_token( ioInfo );
+			if( ioInfo.curr != ioInfo.end )
+			{
+				ioInfo.curr++;
+				append_to_token( ioInfo );
+			}
+			break;
 		
 		default:
-			ioInfo.curr_token.text.append( 1, currCh );
+			append_to_token( ioInfo );
+			skip_run( ioInfo, skip_quoted_chars( ioInfo.curr, ioInfo.end, '"' ) );
+			append_to_token( ioInfo );
 			break;
 	}
 	
@@ -635,16 +1776,18 @@ state	character_state( char currCh, class info& ioInfo )
 			break;
 		
 		case '\\':
-		{
-			char	escapedChar = 0;
-			ioInfo.stream.get( escapedChar );
-			escapedChar = decode_escape(escapedChar);
-			ioInfo.curr_token.text.append( 1, currCh );
+			append_to_token( ioInfo );
+			if( ioInfo.curr != ioInfo.end )
+			{
+				ioInfo.curr++;
+				append_to_token( ioInfo );
+			}
 			break;
-		}
 		
 		default:
-			ioInfo.curr_token.text.append( 1, currCh );
+			append_to_token( ioInfo );
+			skip_run( ioInfo, skip_quoted_chars( ioInfo.curr, ioInfo.end, '\'' ) );
+			append_to_token( ioInfo );
 			break;
 	}
 	
@@ -666,13 +1809,13 @@ state	identifier_state( char currCh, class info& ioInfo )
 		
 		case '"':
 			finish_token( ioInfo );
-			ioInfo.curr_token.kind = token::quoted_string;
+			begin_token( ioInfo, token::quoted_string );
 			return string_state;
 			break;
 
 		case '\'':
 			finish_token( ioInfo );
-			ioInfo.curr_token.kind = token::character;
+			begin_token( ioInfo, token::character );
 			return character_state;
 			break;
 		
@@ -681,12 +1824,21 @@ state	identifier_state( char currCh, class info& ioInfo )
 			{
 				finish_token( ioInfo );
 				ioInfo.curr_token.kind = token::operator_identifier;
-				ioInfo.curr_token.text.append( 1, currCh );
+				append_to_token( ioInfo );
 				finish_token( ioInfo );
 				ioInfo.curr_token.kind = token::identifier;
 			}
+			else if( ioInfo.curr_token.text.empty() && is_digit( currCh ) )
+			{
+				ioInfo.curr_token.kind = token::integer;
+				return number_state( currCh, ioInfo );
+			}
 			else
-				ioInfo.curr_token.text.append( 1, currCh );
+			{
+				append_to_token( ioInfo );
+				skip_run( ioInfo, skip_identifier_chars( ioInfo.curr, ioInfo.end ) );
+				append_to_token( ioInfo );
+			}
 			break;
 	}
 	
@@ -694,6 +1846,25 @@ state	identifier_state( char currCh, class info& ioInfo )
 }
 
 
+// Take everything that might be part of a number, finish_token() decodes it:
+state	number_state( char currCh, class info& ioInfo )
+{
+	if( currCh == '.' || ((currCh == '+' || currCh == '-') && is_exponent_char( ioInfo.curr_token.text.back() )) )
+	{
+		append_to_token( ioInfo );
+		return number_state;
+	}
+	else if( is_operator(currCh) || is_blank(currCh) || currCh == '\r' || currCh == '\n' || currCh == '"' || currCh == '\'' )
+		return identifier_state( currCh, ioInfo );
+	
+	append_to_token( ioInfo );
+	skip_run( ioInfo, skip_identifier_chars( ioInfo.curr, ioInfo.end ) );
+	append_to_token( ioInfo );
+	
+	return number_state;
+}
+
+
 state	single_line_comment_state( char currCh, class info& ioInfo )
 {
 	if( currCh == '\r' || currCh == '\n' )
@@ -702,7 +1873,10 @@ state	single_line_comment_state( char currCh, class info& ioInfo )
 		return whitespace_state;
 	}
 	else
+	{
+		skip_run( ioInfo, skip_comment_chars( ioInfo.curr, ioInfo.end, false ) );
 		return single_line_comment_state;
+	}
 }
 
 
@@ -722,7 +1896,10 @@ state	multi_line_comment_state( char currCh, class info& ioInfo )
 	if( currCh == '*' )
 		return possible_multi_line_comment_end_state;
 	else
-		return single_line_comment_state;
+	{
+		skip_run( ioInfo, skip_comment_chars( ioInfo.curr, ioInfo.end, true ) );
+		return multi_line_comment_state;
+	}
 }
 
 
@@ -739,8 +1916,10 @@ state	possible_comment_state( char currCh, class info& ioInfo )
 	else
 	{
 		finish_token( ioInfo );
-		ioInfo.curr_token.kind = token::identifier;
-		ioInfo.curr_token.text.append( 1, '/' );
+		ioInfo.curr_token.kind = token::operator_identifier;
+		ioInfo.curr_token.text = string_view( ioInfo.curr -2, 1 );	// The '/' we skipped to get here.
+		ioInfo.curr_token.offset = ioInfo.curr -2 -ioInfo.start;
+		ioInfo.curr_token.lineNumber = ioInfo.lineNumber;
 		finish_token( ioInfo );
 		return whitespace_state( currCh, ioInfo );
 	}
@@ -753,19 +1932,22 @@ state	whitespace_state( char currCh, class info& ioInfo )
 	{
 		case ' ':
 		case '\t':
+			skip_run( ioInfo, skip_blanks( ioInfo.curr, ioInfo.end ) );
+			break;
+		
 		case '\r':
 		case '\n':
 			break;
 		
 		case '"':
 			finish_token( ioInfo );
-			ioInfo.curr_token.kind = token::quoted_string;
+			begin_token( ioInfo, token::quoted_string );
 			return string_state;
 			break;
 
 		case '\'':
 			finish_token( ioInfo );
-			ioInfo.curr_token.kind = token::character;
+			begin_token( ioInfo, token::character );
 			return character_state;
 			break;
 		
@@ -778,7 +1960,7 @@ state	whitespace_state( char currCh, class info& ioInfo )
 			{
 				finish_token( ioInfo );
 				ioInfo.curr_token.kind = token::operator_identifier;
-				ioInfo.curr_token.text.append( 1, currCh );
+				append_to_token( ioInfo );
 				finish_token( ioInfo );
 				ioInfo.curr_token.kind = token::identifier;
 			}
@@ -795,787 +1977,5436 @@ state	whitespace_state( char currCh, class info& ioInfo )
 }
 
 
-vector<token>	tokenize( istream& inStream )
+info::info( const char* inStart, const char* inEnd ) : start(inStart), curr(inStart), end(inEnd), lineNumber(1), curr_state(whitespace_state), just_had_cr(false), hit_nul(false)
 {
-	info			currInfo( inStream );
-	state			currState = whitespace_state;
-	bool			justHadCR = false;
 	
-	while( true )
+}
+
+
+// Feed the next character to the lexer state machine. Returns false once
+//	there are no more characters.
+inline bool	lex_next_char( info& ioInfo )
+{
+	if( ioInfo.curr == ioInfo.end )
+		return false;
+	
+	char	currCh = *(ioInfo.curr++);
+	if( currCh == '\0' )
 	{
-		char	currCh = 0;
-		inStream.get( currCh );
-		if( currCh == '\0' || inStream.eof() )
-			break;
-		if( currCh == '\r' )
-		{
-			currInfo.lineNumber++;
-			justHadCR = true;
-		}
-		else if( currCh == '\n' && !justHadCR )
-			currInfo.lineNumber++;
-		else
-			justHadCR = false;
-		currState = currState( currCh, currInfo );
-		currInfo.curr_token.offset++;
+		ioInfo.curr = ioInfo.end;
+		ioInfo.hit_nul = true;
+		return false;
 	}
-	finish_token( currInfo );
+	if( currCh == '\r' )
+	{
+		ioInfo.lineNumber++;
+		ioInfo.just_had_cr = true;
+	}
+	else if( currCh == '\n' && !ioInfo.just_had_cr )
+		ioInfo.lineNumber++;
+	else
+		ioInfo.just_had_cr = false;
+	ioInfo.curr_state = ioInfo.curr_state( currCh, ioInfo );
 	
-	return currInfo.tokens;
+	return true;
 }
 
 
-size_t	priority_for_binary_operator( const program& program, const string& opName )
+// Lex the whole text. The returned tokens point into it, nothing is
+//	copied and no per-character allocations are done.
+vector<token>	tokenize( const char* inStart, const char* inEnd )
 {
-	auto foundOperator = program.binary_operator_priorities.find( opName );
+	info			currInfo( inStart, inEnd );
+	
+	currInfo.tokens.reserve( (inEnd -inStart) / 3 );	// Rough guess at token density, saves most reallocations.
 	
-	return( (foundOperator == program.binary_operator_priorities.end()) ? 0 : foundOperator->second );
+	while( lex_next_char( currInfo ) )
+		;
+	finish_token( currInfo );
+	
+	return std::move( currInfo.tokens );
 }
 
 
-typedesc	parse_type( vector<token>& tokens, vector<token>::iterator& currToken, program& theProgram )
+vector<token>	tokenize( const source_buffer& inSource )
 {
-	typedesc	theType;
-	bool		nothingYet = true;
-	
-	if( currToken->kind == token::identifier && currToken->text.compare("unsigned") == 0 )
+	return tokenize( inSource.data(), inSource.data() +inSource.size() );
+}
+
+
+// Run inBody( x ) for every x in 0...inCount -1 on up to inThreadCount
+//	threads. Returns once all of them are done.
+void	parallel_for( size_t inCount, size_t inThreadCount, const function<void(size_t)>& inBody )
+{
+	atomic<size_t>	nextIndex( 0 );
+	auto			worker = [&]()
 	{
-		theType.type_name.append( currToken->text );
-		
-		currToken++;
-		
-		nothingYet = false;
-	}
+		for( size_t x = nextIndex++; x < inCount; x = nextIndex++ )
+			inBody( x );
+	};
 	
-	if( currToken->kind == token::identifier && currToken->text.compare("long") == 0 )
+	vector<thread>	threads;
+	for( size_t x = 1; x < min( inThreadCount, inCount ); x++ )
+		threads.emplace_back( worker );
+	worker();
+	for( thread& currThread : threads )
+		currThread.join();
+}
+
+
+// Runs inBody for tasks that form a forest, each one only after its parent
+//	is done: inParents[x] is the index of task x's parent, which must be
+//	smaller than x, or SIZE_MAX for a root. If inBody returns false, the
+//	task's descendants are skipped. Every thread runs tasks from its own
+//	queue, newest first, and steals the oldest task of another thread when
+//	it runs out, so a subtree mostly stays on one thread. inBody must not
+//	throw.
+void	parallel_for_tree( const vector<size_t>& inParents, size_t inThreadCount, const function<bool(size_t)>& inBody )
+{
+	size_t			count = inParents.size();
+	vector<size_t>	firstChild( count +1, 0 ), children( count ), subtreeSizes( count, 1 );
+	for( size_t x = 0; x < count; x++ )
 	{
-		theType.type_name.append( currToken->text );
-		
-		currToken++;
-		
-		nothingYet = false;
-		
-		if( currToken->kind == token::identifier && currToken->text.compare("long") == 0 )
-		{
-			theType.type_name.append( 1, ' ' );
-			theType.type_name.append( currToken->text );
-			
-			currToken++;
-		
-			nothingYet = false;
-		}
+		if( inParents[x] != SIZE_MAX )
+			firstChild[inParents[x] +1]++;
 	}
-	else if( currToken->kind == token::identifier && currToken->text.compare("short") == 0 )
+	for( size_t x = 0; x < count; x++ )
+		firstChild[x +1] += firstChild[x];
+	vector<size_t>	nextChild( firstChild.begin(), firstChild.end() -1 );
+	for( size_t x = 0; x < count; x++ )
 	{
-		theType.type_name.append( currToken->text );
-		
-		currToken++;
-		
-		nothingYet = false;
+		if( inParents[x] != SIZE_MAX )
+			children[nextChild[inParents[x]]++] = x;
 	}
-
-	if( currToken->kind == token::identifier && currToken->text.compare("int") == 0 )
+	for( size_t x = count; x-- > 0; )
 	{
-		theType.type_name.append( currToken->text );
-		
-		currToken++;
-		
-		nothingYet = false;
+		if( inParents[x] != SIZE_MAX )
+			subtreeSizes[inParents[x]] += subtreeSizes[x];
 	}
-	else if( currToken->kind == token::identifier && currToken->text.compare("char") == 0 )
+	
+	struct task_queue
 	{
-		theType.type_name.append( currToken->text );
-		
-		currToken++;
-		
-		nothingYet = false;
+		mutex			lock;
+		deque<size_t>	tasks;
+	};
+	size_t				threadCount = max<size_t>( min( inThreadCount, count ), 1 );
+	vector<task_queue>	queues( threadCount );
+	size_t				rootNumber = 0;
+	for( size_t x = 0; x < count; x++ )
+	{
+		if( inParents[x] == SIZE_MAX )
+			queues[rootNumber++ % threadCount].tasks.push_back( x );
 	}
 	
-	if( nothingYet && currToken->kind == token::identifier )
+	atomic<size_t>	remaining( count );
+	auto			worker = [&]( size_t inQueue )
 	{
-		map<string,typedesc>::iterator itty = theProgram.types.find( currToken->text );
-		if( itty != theProgram.types.end() )
+		while( remaining > 0 )
 		{
-			theType = itty->second;
-			currToken++;
+			size_t	task = SIZE_MAX;
+			for( size_t x = 0; x < threadCount && task == SIZE_MAX; x++ )
+			{
+				task_queue&			currQueue = queues[(inQueue +x) % threadCount];
+				lock_guard<mutex>	guard( currQueue.lock );
+				if( currQueue.tasks.empty() )
+					continue;
+				if( x == 0 )
+				{
+					task = currQueue.tasks.back();
+					currQueue.tasks.pop_back();
+				}
+				else
+				{
+					task = currQueue.tasks.front();
+					currQueue.tasks.pop_front();
+				}
+			}
+			if( task == SIZE_MAX )
+			{
+				this_thread::yield();	// Others still run the tasks ours depend on.
+				continue;
+			}
+			
+			if( inBody( task ) )
+			{
+				{
+					lock_guard<mutex>	guard( queues[inQueue].lock );
+					queues[inQueue].tasks.insert( queues[inQueue].tasks.end(), children.begin() +firstChild[task], children.begin() +firstChild[task +1] );
+				}
+				remaining--;
+			}
+			else
+				remaining -= subtreeSizes[task];
 		}
+	};
+	
+	vector<thread>	threads;
+	for( size_t x = 1; x < threadCount; x++ )
+		threads.emplace_back( worker, x );
+	worker( 0 );
+	for( thread& currThread : threads )
+		currThread.join();
+}
+
+
+// Parallel lexer:
+//	Splits the text into chunks that each start at the beginning of a line
+//	and lexes them all at once, each assuming it starts in whitespace_state
+//	on line 0. Then the chunks are stitched together in order: If the
+//	previous chunk really ended in whitespace_state, the guess was right and
+//	only line numbers need to be moved. If it ended inside a string,
+//	character or comment, the chunk is lexed again from the real state until
+//	it produces an identifier where the guess did, from which point on both
+//	are the same. Produces exactly the same tokens as tokenize().
+
+const size_t	parallel_lex_min_chunk_size = 256 * 1024;
+
+
+vector<token>	tokenize_parallel( const char* inStart, const char* inEnd, size_t inThreadCount, size_t inChunkSize = parallel_lex_min_chunk_size )
+{
+	size_t	length = inEnd -inStart;
+	size_t	chunkCount = min( inThreadCount * 4, length / max( inChunkSize, size_t(1) ) );	// More chunks than threads, in case some lex slower.
+	if( inThreadCount < 2 || chunkCount < 2 )
+		return tokenize( inStart, inEnd );
+	
+	vector<const char*>	chunkStarts( 1, inStart );
+	for( size_t x = 1; x < chunkCount; x++ )
+	{
+		const char*	guess = max( inStart +(length * x) / chunkCount, chunkStarts.back() );
+		const char*	lineEnd = (const char*) memchr( guess, '\n', inEnd -guess );
+		if( !lineEnd || lineEnd +1 == inEnd )
+			break;
+		if( lineEnd +1 != chunkStarts.back() )
+			chunkStarts.push_back( lineEnd +1 );
 	}
-	else if( nothingYet )
+	chunkStarts.push_back( inEnd );
+	chunkCount = chunkStarts.size() -1;
+	
+	vector<info>	chunks;
+	chunks.reserve( chunkCount );
+	for( size_t x = 0; x < chunkCount; x++ )
 	{
-		PE_ERROR( "Expected type here, found " << PE_TOKEN_NAME);
+		chunks.emplace_back( inStart, chunkStarts[x +1] );
+		chunks.back().curr = chunkStarts[x];
+		chunks.back().lineNumber = 0;
 	}
 	
-	if( !nothingYet && currToken != tokens.end() && currToken->kind == token::operator_identifier && currToken->text.compare("<") == 0 )
+	parallel_for( chunkCount, inThreadCount, [&]( size_t inIndex )
 	{
-		currToken++;
+		info&	currChunk = chunks[inIndex];
+		currChunk.tokens.reserve( (currChunk.end -currChunk.curr) / 3 );
+		while( lex_next_char( currChunk ) )
+			;
+	});
+	
+	// Stitch. Token line numbers in a chunk stay relative to its first line
+	//	until the final copy below.
+	vector<size_t>	firstLines( 1, 1 );
+	for( size_t x = 1; x < chunkCount; x++ )
+	{
+		const info&	prevChunk = chunks[x -1];
+		if( prevChunk.hit_nul )
+		{
+			chunkCount = x;
+			break;
+		}
+		firstLines.push_back( firstLines.back() +prevChunk.lineNumber );
+		if( prevChunk.curr_state == state( whitespace_state ) )
+			continue;	// The chunk starts after a line break, so there's no CR or pending token to carry over.
 		
-		while( true )
+		info&	guessedChunk = chunks[x];
+		info	realChunk( inStart, guessedChunk.end );
+		realChunk.curr = chunkStarts[x];
+		realChunk.lineNumber = 0;
+		realChunk.curr_state = prevChunk.curr_state;
+		realChunk.just_had_cr = prevChunk.just_had_cr;
+		realChunk.curr_token = prevChunk.curr_token;
+		realChunk.curr_token.lineNumber -= prevChunk.lineNumber;	// Relative to this chunk now, wraps around if it was started in an earlier one.
+		
+		bool	converged = false;
+		size_t	checkedTokens = 0;
+		while( !converged && lex_next_char( realChunk ) )
 		{
-			typedesc currTemplateType = parse_type( tokens, currToken, theProgram );
-			if( currTemplateType.type_name.length() > 0 )
+			for( ; checkedTokens < realChunk.tokens.size() && !converged; checkedTokens++ )
 			{
-				if( currToken == tokens.end() )
-					PE_ERROR( "Expected '>' here, found " << PE_TOKEN_NAME);
-				else if( currToken->kind == token::operator_identifier && currToken->text.compare(">") == 0 )
+				const token&	realToken = realChunk.tokens[checkedTokens];
+				if( realToken.kind != token::identifier )
+					continue;
+				
+				auto	guessedToken = lower_bound( guessedChunk.tokens.begin(), guessedChunk.tokens.end(), realToken.offset, []( const token& a, size_t b ){ return a.offset < b; } );
+				if( guessedToken == guessedChunk.tokens.end() || guessedToken->offset != realToken.offset || guessedToken->kind != token::identifier )
+					continue;
+				
+				// Lexer was in the same state at the start of this identifier in both, so the rest is the same:
+				size_t	lineDelta = realToken.lineNumber -guessedToken->lineNumber;
+				realChunk.tokens.resize( checkedTokens );
+				for( auto currToken = guessedToken; currToken != guessedChunk.tokens.end(); currToken++ )
 				{
-					currToken++;
-					break;
+					realChunk.tokens.push_back( *currToken );
+					realChunk.tokens.back().lineNumber += lineDelta;
 				}
-				else if( currToken->kind != token::operator_identifier || currToken->text.compare(",") != 0 )
-					currToken++;
+				realChunk.curr_state = guessedChunk.curr_state;
+				realChunk.just_had_cr = guessedChunk.just_had_cr;
+				realChunk.curr_token = guessedChunk.curr_token;
+				realChunk.curr_token.lineNumber += lineDelta;
+				realChunk.lineNumber = guessedChunk.lineNumber +lineDelta;
+				realChunk.hit_nul = guessedChunk.hit_nul;
+				converged = true;
 			}
-			theType.template_arguments.push_back(currTemplateType);
 		}
+		
+		guessedChunk = std::move( realChunk );
 	}
 	
-	return theType;
+	finish_token( chunks[chunkCount -1] );
+	
+	vector<size_t>	firstTokens( 1, 0 );
+	for( size_t x = 0; x < chunkCount; x++ )
+		firstTokens.push_back( firstTokens.back() +chunks[x].tokens.size() );
+	
+	vector<token>	tokens( firstTokens.back() );
+	parallel_for( chunkCount, inThreadCount, [&]( size_t inIndex )
+	{
+		token*	currDest = tokens.data() +firstTokens[inIndex];
+		for( const token& currToken : chunks[inIndex].tokens )
+		{
+			*currDest = currToken;
+			currDest->lineNumber += firstLines[inIndex];
+			currDest++;
+		}
+		vector<token>().swap( chunks[inIndex].tokens );	// Don't hold on to two copies of everything.
+	});
+	
+	return tokens;
 }
 
 
-void	parse_function_parameters( vector<token>& tokens, vector<token>::iterator& currToken, program& theProgram, funcdesc& currFunction )
+vector<token>	tokenize_parallel( const source_buffer& inSource, size_t inThreadCount )
 {
-	if( currToken == tokens.end() || (currToken->kind == token::operator_identifier && currToken->text.compare(")") == 0) )
-		return;
-	
-	while( true )
+	return tokenize_parallel( inSource.data(), inSource.data() +inSource.size(), inThreadCount );
+}
+
+
+// Lexes tokens only as the parser asks for them, instead of tokenizing the
+//	whole file up front. Only the most recent tokens are kept around, so
+//	memory use is bounded by the window size, not the file size. The parser
+//	never needs to go back further than the longest operator it glues
+//	together, so the default window is plenty.
+class token_stream
+{
+public:
+	class iterator
 	{
-		vardesc theVar( "", parse_type( tokens, currToken, theProgram ) );
-		if( theVar.type_name.length() == 0 )
-			PE_ERROR( "Expected parameter type here, found " << PE_TOKEN_NAME);
+	public:
+		iterator( token_stream* inStream = nullptr, size_t inIndex = 0 ) : mStream(inStream), mIndex(inIndex) {}
 		
-		if( currToken == tokens.end() || currToken->kind != token::identifier )
-			PE_ERROR( "Expected parameter name after" << theVar.type_name << ", found " << PE_TOKEN_NAME);
+		const token&	operator *() const	{ return *mStream->token_at( mIndex ); }
+		const token*	operator ->() const	{ return mStream->token_at( mIndex ); }
+		iterator&		operator ++()		{ mIndex++; return *this; }
+		iterator		operator ++( int )	{ iterator prevPosition( *this ); mIndex++; return prevPosition; }
 		
-		theVar.var_name = currToken->text;
-		currFunction.param_types.push_back( theVar );
-		currToken++;
-
-		if( currToken == tokens.end() || currToken->kind != token::operator_identifier )
-			PE_ERROR("Expected ',' or ')' here, found " << PE_TOKEN_NAME);
+		bool	operator ==( const iterator& inOther ) const
+		{
+			bool	atEnd = is_at_end(), otherAtEnd = inOther.is_at_end();
+			return (atEnd || otherAtEnd) ? (atEnd == otherAtEnd) : (mIndex == inOther.mIndex);
+		}
+		bool	operator !=( const iterator& inOther ) const	{ return !(*this == inOther); }
 		
-		if( currToken->text.compare(")") == 0 )	// End of list.
-			break;
-		else if( currToken->text.compare(",") == 0 )	// Another param follows.
-			currToken++;
-		else
-			PE_ERROR("Expected ',' or ')' here, found " << PE_TOKEN_NAME);
-	}
-}
-
-void	parse_var_or_function( vector<token>& tokens, vector<token>::iterator& currToken, program& theProgram, varfunccontainer& container, classdesc& currClass, bool isOverride, bool mayParseFunctions )
-{
-	typedesc	theType = parse_type( tokens, currToken,  theProgram );
+	protected:
+		bool	is_at_end() const	{ return mIndex == end_index || mStream->token_at( mIndex ) == nullptr; }
+		
+		token_stream*	mStream;
+		size_t			mIndex;
+	};
 	
-	if( currToken == tokens.end() || currToken->kind != token::identifier )
-		PE_ERROR("Expected identifier after " << theType.type_name << ", found " << PE_TOKEN_NAME);
+	explicit token_stream( const source_buffer& inSource, size_t inWindowSize = 256 );
 	
-	string	thingName = currToken->text;
-	currToken++;
+	iterator	begin()	{ return iterator( this, 0 ); }
+	iterator	end()	{ return iterator( this, end_index ); }
 	
-	if( currToken == tokens.end() || currToken->kind != token::operator_identifier )
-		PE_ERROR( "Expected semicolon after variable name, or opening bracket after function name, found " << PE_TOKEN_NAME );
+	size_t		peak_window_size() const	{ return mPeakWindowSize; }
 	
-	if( !isOverride && currToken->text.compare(";") == 0 )	// Variable!
-	{
-		if( container.variables.find(thingName) != container.variables.end() )
-			PE_ERROR( "A variable named " << thingName << "already exists" );
-		container.variables[thingName] = vardesc(thingName, theType);
-		currToken++;
-	}
-	else if( currToken->text.compare("(") == 0 )	// Function!
+protected:
+	static const size_t	end_index = SIZE_MAX;
+	
+	const token*	token_at( size_t inIndex );	// NULL if inIndex is past the last token.
+	
+	info			mInfo;
+	bool			mAtEnd;
+	deque<token>	mWindow;
+	size_t			mWindowStart;	// Index of the token at mWindow.front().
+	size_t			mWindowSize;
+	size_t			mPeakWindowSize;
+};
+
+
+token_stream::token_stream( const source_buffer& inSource, size_t inWindowSize )
+	: mInfo( inSource.data(), inSource.data() +inSource.size() ), mAtEnd(false), mWindowStart(0), mWindowSize(inWindowSize), mPeakWindowSize(0)
+{
+	
+}
+
+
+const token*	token_stream::token_at( size_t inIndex )
+{
+	while( !mAtEnd && inIndex >= mWindowStart +mWindow.size() )
 	{
-		currToken++;
-		
-		funcdesc	newFunction( thingName );
-		newFunction.return_type = theType;
-		newFunction.is_override = isOverride;
-		
-		parse_function_parameters( tokens, currToken, theProgram, newFunction );
-		
-		if( currToken == tokens.end() || currToken->kind != token::operator_identifier || currToken->text.compare(")") != 0 )
-			PE_ERROR( "Expected ')' at end of function parameter list, found " << PE_TOKEN_NAME );
-		currToken++;
-		
-		if( currToken == tokens.end() || currToken->kind != token::operator_identifier )
-			PE_ERROR( "Expected ';' or '{' after function parameter list, found " << PE_TOKEN_NAME );
-		if( currToken->text.compare(";") == 0 )
+		while( mInfo.tokens.empty() && lex_next_char( mInfo ) )
+			;
+		if( mInfo.tokens.empty() )
 		{
-			container.function_types[thingName] = newFunction;
-			currToken ++;
-		}
-		else if( currToken->text.compare("=") == 0 )
-		{	// pure virtual declaration:
-			currToken++;
-			
-			if( currToken == tokens.end() || currToken->kind != token::identifier || currToken->text.compare("null") != 0 )
-				PE_ERROR( "Expected 'null' following a '=' after a function declaration, found " << PE_TOKEN_NAME );
-
-			currToken++;
-			
-			if( currToken == tokens.end() || currToken->kind != token::operator_identifier || currToken->text.compare(";") != 0 )
-				PE_ERROR( "Expected ';' after pure virtual function declaration, found " << PE_TOKEN_NAME );
-			
-			newFunction.is_pure_virtual = true;
-			container.function_types[thingName] = newFunction;
-			container.functions[thingName] = newFunction;
-			currToken ++;
+			finish_token( mInfo );
+			mAtEnd = true;
 		}
-		else if( currToken->text.compare("{") == 0 )
+		
+		mWindow.insert( mWindow.end(), mInfo.tokens.begin(), mInfo.tokens.end() );
+		mInfo.tokens.clear();
+		
+		mPeakWindowSize = max( mPeakWindowSize, mWindow.size() );
+		while( mWindow.size() > mWindowSize && mWindowStart +mWindowSize < inIndex )
 		{
-			currToken ++;
-			
-			parse_function_body( tokens, currToken, theProgram, currClass, newFunction );
-			
-			container.function_types[thingName] = newFunction;
-			container.functions[thingName] = newFunction;
-			
-			if( currToken == tokens.end() || currToken->kind != token::operator_identifier || currToken->text.compare("}") != 0 )
-				PE_ERROR( "Expected '}' at end of function body, found " << PE_TOKEN_NAME );
-			
-			currToken++;
+			mWindow.pop_front();
+			mWindowStart++;
 		}
 	}
+	
+	if( inIndex < mWindowStart )
+		throw runtime_error( "Parser looked back further than the token stream keeps tokens around." );
+	if( inIndex >= mWindowStart +mWindow.size() )
+		return nullptr;
+	return &mWindow[inIndex -mWindowStart];
 }
 
 
-term	parse_term( vector<token>& tokens, vector<token>::iterator& currToken, program& theProgram, classdesc& currClass, funcdesc& currFunction )
+// Table-driven lexer:
+//	Implements the same token rules as the state functions above, but as a
+//	DFA whose transition table is generated at compile time. Each entry
+//	holds the next state and the actions to perform, so the hot loop does a
+//	single table lookup per byte and never calls through a state pointer.
+//	Tokens are only touched on state changes, since their text is a view.
+
+enum dfa_state
 {
-	term		result;
-	if( currToken == tokens.end() )
-		return result;
+	dfa_whitespace,
+	dfa_empty_identifier,	// identifier_state right after an operator, no text yet.
+	dfa_identifier,
+	dfa_number,
+	dfa_number_exponent,	// Right after an 'e' or 'p' in a number, so a sign may follow.
+	dfa_empty_string,		// Right after the opening quote.
+	dfa_string,
+	dfa_string_escape,
+	dfa_empty_character,
+	dfa_character,
+	dfa_character_escape,
+	dfa_possible_comment,
+	dfa_single_line_comment,
+	dfa_multi_line_comment,
+	dfa_possible_multi_line_comment_end,
+	dfa_stopped,
+	dfa_state_count
+};
+
+
+// Layout of a table entry. The low bits are the index of the next row,
+//	which is the dfa_state *2 +1 if we just had a CR (so CRLF counts once).
+enum
+{
+	dfa_row_mask			= 0x1F,
+	dfa_line_break			= 1 << 5,
+	dfa_stop				= 1 << 6,	// '\0', end lexing like lex_next_char() does.
+	dfa_emit_slash			= 1 << 7,	// A '/' that didn't start a comment, from the previous byte.
+	dfa_finish_token		= 1 << 8,
+	dfa_begin_identifier	= 1 << 9,
+	dfa_emit_operator		= 1 << 10,
+	dfa_begin_string		= 1 << 11,
+	dfa_begin_character		= 1 << 12,
+	dfa_take_line_number	= 1 << 13,	// Quoted tokens get the line of their first character.
+	dfa_begin_number		= 1 << 14,
+	dfa_action_mask			= dfa_stop | dfa_emit_slash | dfa_finish_token | dfa_begin_identifier
+								| dfa_emit_operator | dfa_begin_string | dfa_begin_character | dfa_take_line_number
+								| dfa_begin_number
+};
+
+
+// The token rules: Returns the next dfa_state for a state and a byte,
+//	or'ed with the actions to perform.
+constexpr uint16_t	dfa_transition( int inState, unsigned char inCh )
+{
+	const bool	isBlank = (inCh == ' ' || inCh == '\t' || inCh == '\r' || inCh == '\n');
 	
-	if( currToken->kind == token::quoted_string )
-	{
-		result.kind = term::quoted_string;
-		result.func_name = currToken->text;
-		currToken++;
-	}
-	else if( currToken->kind == token::character )
-	{
-		result.kind = term::character;
-		result.func_name = currToken->text;
-		currToken++;
-	}
-	else if( currToken->kind == token::integer )
-	{
-		result.kind = term::integer;
-		result.func_name = currToken->text;
-		currToken++;
-	}
-	else if( currToken->kind == token::number )
+	if( inCh == '\0' && inState != dfa_string_escape && inState != dfa_character_escape )
+		return dfa_stopped | dfa_stop;
+	
+	switch( inState )
 	{
-		result.kind = term::number;
-		result.func_name = currToken->text;
-		currToken++;
+		case dfa_whitespace:
+			if( isBlank )
+				return dfa_whitespace;
+			else if( inCh == '"' )
+				return dfa_empty_string | dfa_begin_string;
+			else if( inCh == '\'' )
+				return dfa_empty_character | dfa_begin_character;
+			else if( inCh == '/' )
+				return dfa_possible_comment;
+			else if( operator_table[inCh] )
+				return dfa_whitespace | dfa_emit_operator;
+			else if( is_digit( inCh ) )
+				return dfa_number | dfa_begin_number;
+			return dfa_identifier | dfa_begin_identifier;
+		
+		case dfa_empty_identifier:
+			if( isBlank )
+				return dfa_whitespace;
+			else if( inCh == '"' )
+				return dfa_empty_string | dfa_begin_string;
+			else if( inCh == '\'' )
+				return dfa_empty_character | dfa_begin_character;
+			else if( operator_table[inCh] )
+				return dfa_empty_identifier | dfa_emit_operator;
+			else if( is_digit( inCh ) )
+				return dfa_number | dfa_begin_number;
+			return dfa_identifier | dfa_begin_identifier;
+		
+		case dfa_identifier:
+			if( isBlank )
+				return dfa_whitespace | dfa_finish_token;
+			else if( inCh == '"' )
+				return dfa_empty_string | dfa_finish_token | dfa_begin_string;
+			else if( inCh == '\'' )
+				return dfa_empty_character | dfa_finish_token | dfa_begin_character;
+			else if( operator_table[inCh] )
+				return dfa_empty_identifier | dfa_finish_token | dfa_emit_operator;
+			return dfa_identifier;
+		
+		case dfa_number_exponent:
+			if( inCh == '+' || inCh == '-' )
+				return dfa_number;
+			return dfa_transition( dfa_number, inCh );
+		
+		case dfa_number:
+			if( inCh == '.' )
+				return dfa_number;
+			else if( is_exponent_char( inCh ) )
+				return dfa_number_exponent;
+			else if( isBlank )
+				return dfa_whitespace | dfa_finish_token;
+			else if( inCh == '"' )
+				return dfa_empty_string | dfa_finish_token | dfa_begin_string;
+			else if( inCh == '\'' )
+				return dfa_empty_character | dfa_finish_token | dfa_begin_character;
+			else if( operator_table[inCh] )
+				return dfa_empty_identifier | dfa_finish_token | dfa_emit_operator;
+			return dfa_number;
+		
+		case dfa_empty_string:
+			return dfa_take_line_number | dfa_transition( dfa_string, inCh );
+		
+		case dfa_string:
+			if( inCh == '"' )
+				return dfa_whitespace | dfa_finish_token;
+			else if( inCh == '\\' )
+				return dfa_string_escape;
+			return dfa_string;
+		
+		case dfa_string_escape:
+			return dfa_string;
+		
+		case dfa_empty_character:
+			return dfa_take_line_number | dfa_transition( dfa_character, inCh );
+		
+		case dfa_character:
+			if( inCh == '\'' )
+				return dfa_whitespace | dfa_finish_token;
+			else if( inCh == '\\' )
+				return dfa_character_escape;
+			return dfa_character;
+		
+		case dfa_character_escape:
+			return dfa_character;
+		
+		case dfa_possible_comment:
+			if( inCh == '/' )
+				return dfa_single_line_comment;
+			else if( inCh == '*' )
+				return dfa_multi_line_comment;
+			return dfa_emit_slash | dfa_transition( dfa_whitespace, inCh );
+		
+		case dfa_single_line_comment:
+			if( inCh == '\r' || inCh == '\n' )
+				return dfa_whitespace;
+			return dfa_single_line_comment;
+		
+		case dfa_multi_line_comment:
+			if( inCh == '*' )
+				return dfa_possible_multi_line_comment_end;
+			return dfa_multi_line_comment;
+		
+		case dfa_possible_multi_line_comment_end:
+			if( inCh == '/' )
+				return dfa_whitespace;
+			else if( inCh == '*' )
+				return dfa_possible_multi_line_comment_end;
+			return dfa_multi_line_comment;
 	}
-	else if( currToken->kind == token::operator_identifier && currToken->text == "(" )
+	
+	return dfa_stopped | dfa_stop;
+}
+
+
+typedef array<array<uint16_t,256>,dfa_state_count * 2>	dfa_table;
+
+
+// Expand the token rules into the full table, adding line counting.
+//	The character after a backslash in a quoted string is swallowed
+//	without counting lines, like string_state() does.
+constexpr dfa_table	make_dfa_table()
+{
+	dfa_table	table = {};
+	for( int currState = 0; currState < dfa_state_count; currState++ )
 	{
-		currToken++;
-		
-		result = parse_expression( tokens, currToken, theProgram, currClass, currFunction );
+		const bool	isEscape = (currState == dfa_string_escape || currState == dfa_character_escape);
+		for( int hadCR = 0; hadCR < 2; hadCR++ )
+		{
+			for( int currCh = 0; currCh < 256; currCh++ )
+			{
+				const uint16_t	transition = dfa_transition( currState, (unsigned char)currCh );
+				const bool		nowHadCR = isEscape ? (hadCR != 0) : (currCh == '\r');
+				const bool		isLineBreak = !isEscape && (currCh == '\r' || (currCh == '\n' && !hadCR));
+				
+				table[currState * 2 +hadCR][currCh] = uint16_t( ((transition & dfa_row_mask) * 2 +nowHadCR)
+															| (transition & dfa_action_mask)
+															| (isLineBreak ? dfa_line_break : 0) );
+			}
+		}
+	}
+	return table;
+}
+
+constexpr dfa_table	dfa_transitions = make_dfa_table();
+static_assert( dfa_state_count * 2 <= dfa_row_mask +1, "DFA rows don't fit in a table entry." );
+
+
+inline void	push_dfa_token( vector<token>& ioTokens, token::token_kind inKind, const char* inStart, const char* inTextStart, size_t inLength, size_t inLineNumber )
+{
+	ioTokens.emplace_back();
+	token&	newToken = ioTokens.back();
+	newToken.kind = inKind;
+	newToken.text = string_view( inTextStart, inLength );
+	newToken.offset = inTextStart -inStart;
+	newToken.lineNumber = inLineNumber;
+	if( inKind == token::integer )
+		decode_number_token( newToken );
+	if( newToken.kind == token::identifier || newToken.kind == token::operator_identifier )
+		newToken.name = atom( newToken.text );
+}
+
+
+// Lex the whole source buffer using the table. Produces exactly the same
+//	tokens as tokenize().
+vector<token>	tokenize_dfa( const source_buffer& inSource )
+{
+	const char*			start = inSource.data();
+	const char*			end = start +inSource.size();
+	const char*			curr = start;
+	vector<token>		tokens;
+	unsigned			currRow = dfa_whitespace * 2;
+	size_t				lineNumber = 1;
+	token::token_kind	pendingKind = token::whitespace;
+	const char*			pendingStart = nullptr;
+	size_t				pendingLineNumber = 0;
+	
+	tokens.reserve( inSource.size() / 3 );
+	
+	for( ; curr != end; curr++ )
+	{
+		const uint16_t	entry = dfa_transitions[currRow][(unsigned char)*curr];
+		lineNumber += (entry & dfa_line_break) ? 1 : 0;
+		if( (entry & dfa_action_mask) == 0 )
+		{
+			currRow = entry & dfa_row_mask;
+			continue;
+		}
 		
-		if( currToken->kind != token::operator_identifier || currToken->text != ")" )
-			PE_ERROR( "Expected ')' at end of bracketed expression, found " << PE_TOKEN_NAME );
+		if( entry & dfa_stop )	// Keep currRow, so we know what token we were in.
+			break;
+		currRow = entry & dfa_row_mask;
+		if( entry & dfa_emit_slash )
+			push_dfa_token( tokens, token::operator_identifier, start, curr -1, 1, lineNumber );
+		if( entry & dfa_finish_token )
+			push_dfa_token( tokens, pendingKind, start, pendingStart, curr -pendingStart, pendingLineNumber );
+		if( entry & dfa_begin_identifier )
+		{
+			pendingKind = token::identifier;
+			pendingStart = curr;
+			pendingLineNumber = lineNumber;
+		}
+		if( entry & dfa_emit_operator )
+			push_dfa_token( tokens, token::operator_identifier, start, curr, 1, lineNumber );
+		if( entry & dfa_begin_number )
+		{
+			pendingKind = token::integer;	// Decoded once it's complete, like finish_token() does.
+			pendingStart = curr;
+			pendingLineNumber = lineNumber;
+		}
+		if( entry & (dfa_begin_string | dfa_begin_character) )
+		{
+			pendingKind = (entry & dfa_begin_string) ? token::quoted_string : token::character;
+			pendingStart = curr +1;
+			pendingLineNumber = lineNumber;
+		}
+		if( entry & dfa_take_line_number )
+			pendingLineNumber = lineNumber;
+	}
+	
+	switch( currRow / 2 )	// End of file or '\0' in the middle of a token.
+	{
+		case dfa_identifier:
+		case dfa_number:
+		case dfa_number_exponent:
+		case dfa_empty_string:
+		case dfa_string:
+		case dfa_string_escape:
+		case dfa_empty_character:
+		case dfa_character:
+		case dfa_character_escape:
+			push_dfa_token( tokens, pendingKind, start, pendingStart, curr -pendingStart, pendingLineNumber );
+			break;
+	}
+	
+	return tokens;
+}
+
+
+// Report the first token where two lexers disagree. Returns whether they
+//	produced identical tokens.
+bool	compare_tokens( const vector<token>& inExpected, const vector<token>& inActual, const char* inLexerName, ostream& inReport )
+{
+	size_t	count = min( inExpected.size(), inActual.size() );
+	
+	for( size_t x = 0; x < count; x++ )
+	{
+		const token&	a = inExpected[x];
+		const token&	b = inActual[x];
+		if( a.kind != b.kind || a.text.data() != b.text.data() || a.text.length() != b.text.length()
+			|| a.offset != b.offset || a.lineNumber != b.lineNumber || a.name != b.name
+			|| memcmp( &a.value, &b.value, sizeof(a.value) ) != 0 )
+		{
+			inReport << "Token " << x << " differs: state machine lexed \"" << a.text << "\" (kind " << a.kind
+				<< ") at " << a.lineNumber << ":" << a.offset << ", " << inLexerName << " lexed \"" << b.text << "\" (kind " << b.kind
+				<< ") at " << b.lineNumber << ":" << b.offset << "." << endl;
+			return false;
+		}
+	}
+	
+	if( inExpected.size() != inActual.size() )
+	{
+		inReport << "State machine lexed " << inExpected.size() << " tokens, " << inLexerName << " lexed " << inActual.size() << "." << endl;
+		return false;
+	}
+	
+	return true;
+}
+
+
+// Run all lexers over the same source and compare their tokens to those of
+//	tokenize(). The parallel lexer is run with tiny chunks, so even small files
+//	exercise stitching. Returns whether all of them agree.
+bool	check_lexers( const source_buffer& inSource, size_t inThreadCount, ostream& inReport )
+{
+	vector<token>	expected = tokenize( inSource );
+	
+	if( !compare_tokens( expected, tokenize_dfa( inSource ), "table", inReport )
+		|| !compare_tokens( expected, tokenize_parallel( inSource.data(), inSource.data() +inSource.size(), max( inThreadCount, size_t(2) ), 16 ), "parallel lexer", inReport ) )
+		return false;
+	
+	inReport << "All lexers produced the same " << expected.size() << " tokens." << endl;
+	return true;
+}
+
+
+// Parallel parser:
+//	A quick pre-pass finds where each top-level construct starts and ends by
+//	matching brackets, and what it declares. Then all constructs are parsed
+//	at once, each on its own, looking up what earlier ones declare in that
+//	outline. Types declared by other constructs are only placeholders then.
+//	Finally the constructs are merged into the program in source order,
+//	which validates classes and fills in placeholders, so the result is
+//	exactly what parsing them one after the other gives. From the first
+//	construct that doesn't parse the way the outline predicted (or has an
+//	error) on, we parse sequentially.
+
+class program_outline
+{
+public:
+	enum construct_kind : uint8_t
+	{
+		class_declaration = 1 << 0,
+		class_definition = 1 << 1,
+		global_variable = 1 << 2,
+		global_function = 1 << 3,
+		type_declaration = class_declaration | class_definition
+	};
+	
+	struct construct
+	{
+		size_t			first_token;
+		size_t			end_token;
+		atom			name;
+		construct_kind	kind;
+		bool			is_struct;
+	};
+	
+	explicit program_outline( const vector<token>& inTokens );
+	
+	// The last construct before inBefore that declares inName as one of inKinds, or NULL.
+	const construct*	latest_declaration( atom inName, size_t inBefore, uint8_t inKinds ) const;
+	size_t				number_of_declarations( atom inName, uint8_t inKinds ) const;
+	
+	vector<construct>						constructs;		// May end before the last token if we couldn't tell what follows.
+	unordered_map<atom,vector<uint32_t>>	declarations;	// Indexes of the constructs declaring each name, in order.
+};
+
+
+// What parse_skipped_function_bodies() needs to parse function bodies just
+//	like parse_program_parallel() would have:
+struct parse_snapshot
+{
+	parse_snapshot( const vector<token>& inTokens, const program& inProgram ) : outline( inTokens ), base_program( inProgram ) {}
+	
+	program_outline		outline;
+	program				base_program;	// Before any construct was added.
+};
+
+
+bool	is_operator_token( const token& inToken, atom inName )
+{
+	return inToken.kind == token::operator_identifier && inToken.name == inName;
+}
+
+
+// Index of the token after the inClose that matches the inOpen at inStart,
+//	or SIZE_MAX if there is none.
+size_t	skip_brackets( const vector<token>& inTokens, size_t inStart, atom inOpen, atom inClose )
+{
+	size_t	depth = 0;
+	for( size_t x = inStart; x < inTokens.size(); x++ )
+	{
+		if( is_operator_token( inTokens[x], inOpen ) )
+			depth++;
+		else if( is_operator_token( inTokens[x], inClose ) && --depth == 0 )
+			return x +1;
+	}
+	return SIZE_MAX;
+}
+
+
+program_outline::program_outline( const vector<token>& inTokens )
+{
+	size_t	currToken = 0;
+	while( currToken < inTokens.size() )
+	{
+		construct	newConstruct = { currToken, currToken, atom(), global_variable, false };
+		size_t		endToken = currToken;
+		if( inTokens[currToken].kind == token::identifier && (inTokens[currToken].name == atom_class || inTokens[currToken].name == atom_struct) )
+		{
+			if( currToken +1 >= inTokens.size() || inTokens[currToken +1].kind != token::identifier )
+				break;
+			newConstruct.name = inTokens[currToken +1].name;
+			newConstruct.is_struct = inTokens[currToken].name == atom_struct;
+			
+			endToken = currToken +2;
+			while( endToken < inTokens.size() && !is_operator_token( inTokens[endToken], atom_semicolon ) && !is_operator_token( inTokens[endToken], atom_open_brace ) )
+				endToken++;
+			if( endToken >= inTokens.size() )
+				break;
+			if( inTokens[endToken].name == atom_semicolon )
+			{
+				newConstruct.kind = class_declaration;
+				endToken++;
+			}
+			else
+			{
+				newConstruct.kind = class_definition;
+				endToken = skip_brackets( inTokens, endToken, atom_open_brace, atom_close_brace );
+			}
+		}
+		else
+		{
+			// Type, then name, then ';' or a parameter list:
+			while( endToken < inTokens.size() && !is_operator_token( inTokens[endToken], atom_semicolon ) && !is_operator_token( inTokens[endToken], atom_open_bracket )
+					&& !is_operator_token( inTokens[endToken], atom_open_brace ) && !is_operator_token( inTokens[endToken], atom_close_brace ) )
+				endToken++;
+			if( endToken >= inTokens.size() || endToken == currToken || inTokens[endToken -1].kind != token::identifier
+				|| (inTokens[endToken].name != atom_semicolon && inTokens[endToken].name != atom_open_bracket) )
+				break;
+			newConstruct.name = inTokens[endToken -1].name;
+			
+			if( inTokens[endToken].name == atom_semicolon )
+				endToken++;
+			else
+			{
+				newConstruct.kind = global_function;
+				endToken = skip_brackets( inTokens, endToken, atom_open_bracket, atom_close_bracket );
+				if( endToken >= inTokens.size() )
+					break;
+				if( is_operator_token( inTokens[endToken], atom_open_brace ) )
+					endToken = skip_brackets( inTokens, endToken, atom_open_brace, atom_close_brace );
+				else
+				{
+					while( endToken < inTokens.size() && !is_operator_token( inTokens[endToken], atom_semicolon ) )
+						endToken++;
+					endToken++;
+				}
+			}
+		}
+		if( endToken > inTokens.size() )
+			break;
 		
-		currToken++;
+		newConstruct.end_token = endToken;
+		declarations[newConstruct.name].push_back( (uint32_t) constructs.size() );
+		constructs.push_back( newConstruct );
+		currToken = endToken;
 	}
-	else if( currToken->kind == token::operator_identifier )
+}
+
+
+const program_outline::construct*	program_outline::latest_declaration( atom inName, size_t inBefore, uint8_t inKinds ) const
+{
+	auto	foundDeclarations = declarations.find( inName );
+	if( foundDeclarations == declarations.end() )
+		return nullptr;
+	const vector<uint32_t>&	indexes = foundDeclarations->second;
+	for( auto currIndex = lower_bound( indexes.begin(), indexes.end(), inBefore ); currIndex != indexes.begin(); )
 	{
-		result.func_name = currToken->text;
-		currToken++;
-		result.parameters.push_back( parse_term( tokens, currToken, theProgram, currClass, currFunction ) );
+		const construct&	currConstruct = constructs[*--currIndex];
+		if( currConstruct.kind & inKinds )
+			return &currConstruct;
 	}
-	else if( currToken->kind == token::identifier )
+	return nullptr;
+}
+
+
+size_t	program_outline::number_of_declarations( atom inName, uint8_t inKinds ) const
+{
+	auto	foundDeclarations = declarations.find( inName );
+	if( foundDeclarations == declarations.end() )
+		return 0;
+	return count_if( foundDeclarations->second.begin(), foundDeclarations->second.end(), [&]( uint32_t inIndex ){ return (constructs[inIndex].kind & inKinds) != 0; } );
+}
+
+
+bool	program::find_type( atom inName, type_handle& outType )
+{
+	if( outline )
 	{
-		if( currToken->text == "this" )
+		const program_outline::construct*	declaration = outline->latest_declaration( inName, outline_position, program_outline::type_declaration );
+		if( declaration )
 		{
-			result.kind = term::parameter;
-			result.func_name = currToken->text;
-			currToken++;
-			return result;
+			outType = make_shared<typedesc>( inName );
+			outType->is_struct = declaration->is_struct;
+			outType->is_placeholder = true;
+			if( outline->number_of_declarations( inName, program_outline::type_declaration ) > 1 )
+				saw_redeclared_type = true;
+			return true;
 		}
+	}
+	
+	auto	foundType = types.find( inName );
+	if( foundType == types.end() )
+		return false;
+	outType = foundType->second;
+	return true;
+}
+
+
+type_handle	program::named_type( atom inName )
+{
+	type_handle&	namedType = named_types[inName];
+	if( !namedType )
+		namedType = make_shared<typedesc>( inName );
+	return namedType;
+}
+
+
+bool	program::has_class( atom inName ) const
+{
+	return classes.find( inName ) != classes.end()
+		|| (outline && outline->latest_declaration( inName, outline_position, program_outline::class_definition ));
+}
+
+
+bool	program::has_global_variable( atom inName ) const
+{
+	return variables.find( inName ) != variables.end()
+		|| (outline && outline->latest_declaration( inName, outline_position, program_outline::global_variable ));
+}
+
+
+template<class token_source>
+type_handle	parse_type( token_source& tokens, typename token_source::iterator& currToken, program& theProgram )
+{
+	type_handle	theType = theProgram.named_type( atom() );	// No type.
+	string		builtInTypeName;	// Built-in types can consist of several keywords.
+	bool		nothingYet = true;
+	
+	if( currToken->kind == token::identifier && currToken->name == atom_unsigned )
+	{
+		builtInTypeName.append( currToken->text );
 		
-		auto	foundClass = theProgram.classes.find( currToken->text );
-		if( foundClass != theProgram.classes.end() )
+		currToken++;
+		
+		nothingYet = false;
+	}
+	
+	if( currToken->kind == token::identifier && currToken->name == atom_long )
+	{
+		if( !nothingYet )
+			builtInTypeName.append( 1, ' ' );
+		builtInTypeName.append( currToken->text );
+		
+		currToken++;
+		
+		nothingYet = false;
+		
+		if( currToken->kind == token::identifier && currToken->name == atom_long )
 		{
-			result.kind = term::class_object;
-			result.func_name = currToken->text;
+			builtInTypeName.append( 1, ' ' );
+			builtInTypeName.append( currToken->text );
+			
 			currToken++;
-			return result;
+		
+			nothingYet = false;
 		}
+	}
+	else if( currToken->kind == token::identifier && currToken->name == atom_short )
+	{
+		if( !nothingYet )
+			builtInTypeName.append( 1, ' ' );
+		builtInTypeName.append( currToken->text );
 		
-		auto	foundVar = currFunction.variables.find( currToken->text );
-		if( foundVar != currFunction.variables.end() )
-			result.kind = term::variable;
+		currToken++;
+		
+		nothingYet = false;
+	}
+
+	if( currToken->kind == token::identifier && currToken->name == atom_int )
+	{
+		if( !nothingYet )
+			builtInTypeName.append( 1, ' ' );
+		builtInTypeName.append( currToken->text );
+		
+		currToken++;
+		
+		nothingYet = false;
+	}
+	else if( currToken->kind == token::identifier && currToken->name == atom_char )
+	{
+		if( !nothingYet )
+			builtInTypeName.append( 1, ' ' );
+		builtInTypeName.append( currToken->text );
+		
+		currToken++;
+		
+		nothingYet = false;
+	}
+	
+	if( !nothingYet )
+		theType = theProgram.named_type( atom( builtInTypeName ) );
+	
+	if( nothingYet && currToken->kind == token::identifier )
+	{
+		if( theProgram.find_type( currToken->name, theType ) )
+			currToken++;
+	}
+	else if( nothingYet )
+	{
+		PE_ERROR( "Expected type here, found " << PE_TOKEN_NAME);
+	}
+	
+	if( !nothingYet && currToken != tokens.end() && currToken->kind == token::operator_identifier && currToken->name == atom_less_than )
+	{
+		currToken++;
 		
-		if( result.kind == term::function_call )
+		type_handle	templateType = make_shared<typedesc>( *theType );
+		theType = templateType;
+		while( true )
 		{
-			for( auto currParam : currFunction.param_types )
+			type_handle currTemplateType = parse_type( tokens, currToken, theProgram );
+			if( !currTemplateType->type_name.empty() )
 			{
-				if( currParam.var_name == currToken->text )
+				if( currToken == tokens.end() )
+					PE_ERROR( "Expected '>' here, found " << PE_TOKEN_NAME);
+				else if( currToken->kind == token::operator_identifier && currToken->name == atom_greater_than )
 				{
-					result.kind = term::parameter;
+					currToken++;
 					break;
 				}
+				else if( currToken->kind != token::operator_identifier || currToken->name != atom_comma )
+					currToken++;
 			}
+			templateType->template_arguments.push_back(currTemplateType);
 		}
+	}
+	
+	return theType;
+}
 
-		if( result.kind == term::function_call )
-		{
-			foundVar = currClass.variables.find( currToken->text );
-			if( foundVar != currClass.variables.end() )
-			{
-				result.kind = term::function_call;
-				result.func_name = ".";
-				result.parameters.push_back( term("this") );
-				result.parameters[0].kind = term::parameter;
-				result.parameters.push_back( term(currToken->text) );
-				result.parameters[1].kind = term::field;
-				currToken++;
-				return result;
-			}
-		}
 
-		if( result.kind == term::function_call )
-		{
-			foundVar = theProgram.variables.find( currToken->text );
-			if( foundVar != theProgram.variables.end() )
-				result.kind = term::global_variable;
-		}
+template<class token_source>
+void	parse_function_parameters( token_source& tokens, typename token_source::iterator& currToken, program& theProgram, funcdesc& currFunction )
+{
+	if( currToken == tokens.end() || (currToken->kind == token::operator_identifier && currToken->name == atom_close_bracket) )
+		return;
+	
+	while( true )
+	{
+		vardesc theVar( atom(), parse_type( tokens, currToken, theProgram ) );
+		if( theVar.type->type_name.empty() )
+			PE_ERROR( "Expected parameter type here, found " << PE_TOKEN_NAME);
 		
-		result.func_name = currToken->text;
+		if( currToken == tokens.end() || currToken->kind != token::identifier )
+			PE_ERROR( "Expected parameter name after" << theVar.type->type_name << ", found " << PE_TOKEN_NAME);
+		
+		theVar.var_name = currToken->name;
+		currFunction.param_types.push_back( theVar );
 		currToken++;
+
+		if( currToken == tokens.end() || currToken->kind != token::operator_identifier )
+			PE_ERROR("Expected ',' or ')' here, found " << PE_TOKEN_NAME);
+		
+		if( currToken->name == atom_close_bracket )	// End of list.
+			break;
+		else if( currToken->name == atom_comma )	// Another param follows.
+			currToken++;
+		else
+			PE_ERROR("Expected ',' or ')' here, found " << PE_TOKEN_NAME);
+	}
+}
+
+// With lazy_function_bodies, skips the body at currToken (just after its
+//	'{') and only remembers where it is. Returns false if it has to be
+//	parsed right away instead.
+template<class token_source>
+bool	skip_function_body( token_source& tokens, typename token_source::iterator& currToken, program& theProgram, classdesc& currClass, funcdesc& currFunction )
+{
+	if constexpr( is_same<token_source, vector<token>>::value )
+	{
+		if( !theProgram.lazy_function_bodies || !theProgram.body_snapshot )
+			return false;
+		
+		size_t	firstToken = currToken -tokens.begin();
+		size_t	endToken = skip_brackets( tokens, firstToken -1, atom_open_brace, atom_close_brace );
+		if( endToken == SIZE_MAX )
+			return false;
+		
+		// Which version of a type declared more than once a body sees depends
+		//	on where it is, and later ones replace it, so parse those now:
+		const program_outline&	outline = theProgram.body_snapshot->outline;
+		for( size_t x = firstToken; x < endToken; x++ )
+		{
+			if( tokens[x].kind == token::identifier && outline.number_of_declarations( tokens[x].name, program_outline::type_declaration ) > 1 )
+				return false;
+		}
+		
+		shared_ptr<skipped_function_body>	skippedBody = make_shared<skipped_function_body>();
+		skippedBody->snapshot = theProgram.body_snapshot;
+		skippedBody->first_token = firstToken;
+		skippedBody->end_token = endToken -1;
+		skippedBody->construct_index = theProgram.outline_position;
+		for( auto& currField : currClass.variables )
+			skippedBody->visible_fields.push_back( currField.first );
+		currFunction.skipped_body = skippedBody;
+		
+		currToken = tokens.begin() +(endToken -1);
+		return true;
+	}
+	else
+		return false;	// Only a vector<token> is still around to parse it later.
+}
+
+
+// Returns the name of the variable or function that was parsed.
+template<class token_source>
+atom	parse_var_or_function( token_source& tokens, typename token_source::iterator& currToken, program& theProgram, varfunccontainer& container, classdesc& currClass, bool isOverride, bool mayParseFunctions )
+{
+	type_handle	theType = parse_type( tokens, currToken,  theProgram );
+	
+	if( currToken == tokens.end() || currToken->kind != token::identifier )
+		PE_ERROR("Expected identifier after " << theType->type_name << ", found " << PE_TOKEN_NAME);
+	
+	atom	thingName = currToken->name;
+	currToken++;
+	
+	if( currToken == tokens.end() || currToken->kind != token::operator_identifier )
+		PE_ERROR( "Expected semicolon after variable name, or opening bracket after function name, found " << PE_TOKEN_NAME );
+	
+	if( !isOverride && currToken->name == atom_semicolon )	// Variable!
+	{
+		if( container.variables.find(thingName) != container.variables.end() )
+			PE_ERROR( "A variable named " << thingName << "already exists" );
+		container.variables[thingName] = vardesc(thingName, theType);
+		currToken++;
+	}
+	else if( currToken->name == atom_open_bracket )	// Function!
+	{
+		currToken++;
+		
+		funcdesc	newFunction( thingName );
+		newFunction.return_type = theType;
+		newFunction.is_override = isOverride;
+		
+		parse_function_parameters( tokens, currToken, theProgram, newFunction );
+		
+		if( currToken == tokens.end() || currToken->kind != token::operator_identifier || currToken->name != atom_close_bracket )
+			PE_ERROR( "Expected ')' at end of function parameter list, found " << PE_TOKEN_NAME );
+		currToken++;
+		
+		if( currToken == tokens.end() || currToken->kind != token::operator_identifier )
+			PE_ERROR( "Expected ';' or '{' after function parameter list, found " << PE_TOKEN_NAME );
+		auto	foundFunction = container.functions.find( thingName );
+		if( currToken->name != atom_semicolon && foundFunction != container.functions.end() && foundFunction->second.skipped_body )
+			theProgram.replaced_skipped_body = true;
+		if( currToken->name == atom_semicolon )
+		{
+			container.function_types[thingName] = newFunction;
+			currToken ++;
+		}
+		else if( currToken->name == atom_assign )
+		{	// pure virtual declaration:
+			currToken++;
+			
+			if( currToken == tokens.end() || currToken->kind != token::identifier || currToken->name != atom_null )
+				PE_ERROR( "Expected 'null' following a '=' after a function declaration, found " << PE_TOKEN_NAME );
+
+			currToken++;
+			
+			if( currToken == tokens.end() || currToken->kind != token::operator_identifier || currToken->name != atom_semicolon )
+				PE_ERROR( "Expected ';' after pure virtual function declaration, found " << PE_TOKEN_NAME );
+			
+			newFunction.is_pure_virtual = true;
+			container.function_types[thingName] = newFunction;
+			container.functions[thingName] = std::move(newFunction);
+			currToken ++;
+		}
+		else if( currToken->name == atom_open_brace )
+		{
+			currToken ++;
+			
+			if( !skip_function_body( tokens, currToken, theProgram, currClass, newFunction ) )
+				parse_function_body( tokens, currToken, theProgram, currClass, newFunction );
+			
+			container.function_types[thingName] = newFunction;
+			container.functions[thingName] = std::move(newFunction);
+			
+			if( currToken == tokens.end() || currToken->kind != token::operator_identifier || currToken->name != atom_close_brace )
+				PE_ERROR( "Expected '}' at end of function body, found " << PE_TOKEN_NAME );
+			
+			currToken++;
+		}
+	}
+	
+	return thingName;
+}
+
+
+template<class token_source>
+term_index	parse_term( token_source& tokens, typename token_source::iterator& currToken, program& theProgram, const scope& currScope, funcdesc& currFunction )
+{
+	term_arena&	terms = currFunction.terms;
+	if( currToken == tokens.end() )
+		return terms.new_term();
+	
+	term_index	result = no_term;
+	if( currToken->kind == token::quoted_string )
+	{
+		result = terms.new_term( atom( currToken->text ), term::quoted_string );
+		currToken++;
+	}
+	else if( currToken->kind == token::character )
+	{
+		result = terms.new_term( atom( currToken->text ), term::character );
+		currToken++;
+	}
+	else if( currToken->kind == token::integer )
+	{
+		result = terms.new_term( atom(), term::integer );
+		terms[result].value = currToken->value;
+		currToken++;
+	}
+	else if( currToken->kind == token::number )
+	{
+		result = terms.new_term( atom(), term::number );
+		terms[result].value = currToken->value;
+		currToken++;
+	}
+	else if( currToken->kind == token::operator_identifier && currToken->name == atom_open_bracket )
+	{
+		currToken++;
+		
+		result = parse_expression( tokens, currToken, theProgram, currScope, currFunction );
+		
+		if( currToken->kind != token::operator_identifier || currToken->name != atom_close_bracket )
+			PE_ERROR( "Expected ')' at end of bracketed expression, found " << PE_TOKEN_NAME );
+		
+		currToken++;
+	}
+	else if( currToken->kind == token::operator_identifier )
+	{
+		result = terms.new_term( currToken->name );
+		currToken++;
+		term_index	operand = parse_term( tokens, currToken, theProgram, currScope, currFunction );
+		terms.add_parameter( result, operand );
+	}
+	else if( currToken->kind == token::identifier )
+	{
+		if( is_digit( currToken->text[0] ) )
+			PE_ERROR( "Invalid number " << PE_TOKEN_NAME );
+		
+		if( currToken->name == atom_this )
+		{
+			result = terms.new_term( currToken->name, term::parameter );
+			currToken++;
+			return result;
+		}
+		
+		if( theProgram.has_class( currToken->name ) )
+		{
+			result = terms.new_term( currToken->name, term::class_object );
+			currToken++;
+			return result;
+		}
+		
+		uint32_t		slot = no_slot;
+		const scope*	foundScope = currScope.resolve( currToken->name, slot );
+		if( foundScope && foundScope->kind == term::field )
+		{
+			result = terms.new_term( atom_dot );
+			terms.add_parameter( result, terms.new_term( atom_this, term::parameter ) );
+			term_index	fieldTerm = terms.new_term( currToken->name, term::field );
+			terms[fieldTerm].slot = slot;
+			terms.add_parameter( result, fieldTerm );
+			currToken++;
+			return result;
+		}
+		
+		term::term_type	kind = term::function_call;
+		if( foundScope )
+			kind = foundScope->kind;
+		else if( theProgram.has_global_variable( currToken->name ) )
+			kind = term::global_variable;
+		
+		result = terms.new_term( currToken->name, kind );
+		terms[result].slot = slot;
+		currToken++;
+	}
+	else
+		PE_ERROR( "Expected term here, found " << PE_TOKEN_NAME );
+	
+	return result;
+}
+
+
+template<class token_source>
+operator_id	parse_longest_binary_operator( token_source& tokens, typename token_source::iterator& currToken, const program& theProgram )
+{
+	operator_id						foundOperator = 0;
+	typename token_source::iterator	afterOperator = currToken;
+	size_t							currNode = 0;
+	
+	// Glue together as many operator tokens as form a known operator. The
+	//	trie stops us at the longest operator, so a token_stream only needs a
+	//	small lookahead window.
+	while( currToken != tokens.end() && currToken->kind == token::operator_identifier )
+	{
+		for( char currCh : currToken->text )
+		{
+			currNode = (currCh & 0x80) ? 0 : theProgram.binary_operator_trie[currNode].next_node[int(currCh)];
+			if( currNode == 0 )
+				break;
+		}
+		if( currNode == 0 )
+			break;
+		currToken++;
+		if( theProgram.binary_operator_trie[currNode].operator_index != 0 )
+		{
+			foundOperator = theProgram.binary_operator_trie[currNode].operator_index;
+			afterOperator = currToken;
+		}
+	}
+	
+	currToken = afterOperator;
+	return foundOperator;
+}
+
+
+// Precedence climbing: Parses a term and all following binary operators of
+//	at least inMinPriority. Each operator's right argument is parsed by a
+//	recursive call that only takes operators binding tighter than it, so
+//	every token is looked at once and no subtree is ever moved or copied.
+template<class token_source>
+term_index	parse_binary_operators( token_source& tokens, typename token_source::iterator& currToken, program& theProgram, const scope& currScope, funcdesc& currFunction, size_t inMinPriority )
+{
+	term_arena&	terms = currFunction.terms;
+	term_index	result = parse_term( tokens, currToken, theProgram, currScope, currFunction );
+	
+	while( true )
+	{
+		typename token_source::iterator	afterOperator = currToken;
+		operator_id	opIndex = parse_longest_binary_operator( tokens, afterOperator, theProgram );
+		if( opIndex == 0 || theProgram.binary_operators[opIndex].priority < inMinPriority )
+			break;
+		currToken = afterOperator;
+		
+		const binary_operator&	currOp = theProgram.binary_operators[opIndex];
+		term_index				argTwo = no_term;
+		if( currOp.name == atom_dot || currOp.name == atom_arrow )
+		{
+			if( currToken == tokens.end() || currToken->kind != token::identifier )
+				PE_ERROR("Expected field name after '" << currOp.name << "', found " << PE_TOKEN_NAME);
+			argTwo = terms.new_term( currToken->name, term::field );
+			currToken++;
+		}
+		else
+			argTwo = parse_binary_operators( tokens, currToken, theProgram, currScope, currFunction, currOp.is_right_associative ? currOp.priority : currOp.priority +1 );
+		
+		term_index	opTerm = terms.new_term( currOp.name );
+		terms[opTerm].first_parameter = result;
+		terms[result].next_parameter = argTwo;
+		result = opTerm;
+	}
+	
+	return result;
+}
+
+
+template<class token_source>
+term_index	parse_expression( token_source& tokens, typename token_source::iterator& currToken, program& theProgram, const scope& currScope, funcdesc& currFunction )
+{
+	if( currToken == tokens.end() )
+		return currFunction.terms.new_term();
+	
+	return parse_binary_operators( tokens, currToken, theProgram, currScope, currFunction, 0 );
+}
+
+
+template<class token_source>
+void	parse_function_body( token_source& tokens, typename token_source::iterator& currToken, program& theProgram, classdesc& currClass, funcdesc& currFunction )
+{
+	scope	fieldScope( term::field, currClass.variables, nullptr );
+	scope	parameterScope( term::parameter, &fieldScope );
+	for( size_t x = 0; x < currFunction.param_types.size(); x++ )
+		parameterScope.declare( currFunction.param_types[x].var_name, uint32_t(x) );
+	scope	localScope( term::variable, currFunction.variables, &parameterScope );
+	
+	while( true )
+	{
+		if( currToken == tokens.end() || (currToken->kind == token::operator_identifier && currToken->name == atom_close_brace ) )
+			break;
+		
+		if( currToken->kind == token::identifier && currToken->name == atom_return )
+		{
+			currToken++;
+			
+			term_index	currCommand = currFunction.terms.new_term( atom_return );
+			term_index	expr = parse_expression( tokens, currToken, theProgram, localScope, currFunction );
+			currFunction.terms.add_parameter( currCommand, expr );
+			currFunction.commands.push_back( currCommand );
+		}
+		else
+		{
+			type_handle	theType = parse_type( tokens, currToken, theProgram );
+			atom		varName;
+			uint32_t	varSlot = no_slot;
+			if( !theType->type_name.empty() )
+			{
+				if( currToken == tokens.end() || currToken->kind != token::identifier )
+					PE_ERROR( "Expected identifier for variable name here, found " << PE_TOKEN_NAME );
+				varName = currToken->name;
+				
+				currToken++;
+				
+				if( currToken == tokens.end() || currToken->kind != token::operator_identifier )
+					PE_ERROR( "Expected ';' or '=' here, found " << PE_TOKEN_NAME );
+				
+				currFunction.variables[varName] = vardesc(varName,theType);
+				varSlot = uint32_t( currFunction.variables.find( varName ) -currFunction.variables.begin() );
+				if( currToken->name == atom_semicolon )
+				{
+					currToken++;
+				
+					if( !theType->is_struct )
+					{
+						term_arena&	terms = currFunction.terms;
+						term_index	assignmentStmt = terms.new_term( atom_dot );
+						term_index	varTerm = terms.new_term( varName, term::variable );
+						terms[varTerm].slot = varSlot;
+						terms.add_parameter( assignmentStmt, varTerm );
+						terms.add_parameter( assignmentStmt, terms.new_term( atom_init ) );
+						currFunction.commands.push_back( assignmentStmt );
+					}
+					continue;
+				}
+				if( currToken->name != atom_assign )
+					PE_ERROR( "Expected ';' or '=' here, found " << PE_TOKEN_NAME );
+				currToken++;
+			}
+			term_index	expr = parse_expression( tokens, currToken, theProgram, localScope, currFunction );
+			if( !varName.empty() )
+			{
+				term_arena&	terms = currFunction.terms;
+				term_index	assignmentStmt = terms.new_term( atom_assign );
+				term_index	varTerm = terms.new_term( varName, term::variable );
+				terms[varTerm].slot = varSlot;
+				terms.add_parameter( assignmentStmt, varTerm );
+				terms.add_parameter( assignmentStmt, expr );
+				currFunction.commands.push_back( assignmentStmt );
+			}
+			else
+				currFunction.commands.push_back( expr );
+		}
+		
+		if( currToken == tokens.end() || currToken->kind != token::operator_identifier || currToken->name != atom_semicolon )
+			PE_ERROR( "Expected ';' here, found " << PE_TOKEN_NAME );
+		
+		currToken++;
+	}
+}
+
+
+// Checks newClass's methods against those it inherits and lays out its
+//	vtable: A copy of its superclass's method_slots, in which its overrides
+//	take over their slot, followed by a slot for each method it adds.
+//	inSuperclass must have been validated already, or be nullptr if it
+//	isn't defined before newClass. See validate_classes().
+void	validate_class( const program& theProgram, classdesc& newClass, const classdesc* inSuperclass )
+{
+	bool	hasSuperClass = !newClass.superclass_name.empty();
+	if( hasSuperClass )
+	{
+		if( !inSuperclass )
+		{
+			parse_error err;
+			err.err_msg << "Class '" << newClass.type_name << "' has unknown superclass '" << newClass.superclass_name << "'";
+			throw err;
+		}
+		
+		newClass.number_of_superclasses = inSuperclass->number_of_superclasses +1;
+		newClass.method_slots = inSuperclass->method_slots;
+	}
+	else
+		newClass.method_slots = atom_map<method_slot>();
+
+	for( const pair<atom,funcdesc>& currMethod : newClass.functions )
+	{
+		auto	inheritedSlot = newClass.method_slots.find( currMethod.second.func_name );
+		bool	foundOriginal = (inheritedSlot != newClass.method_slots.end());
+		if( !foundOriginal && currMethod.second.is_override )
+		{
+			parse_error err;
+			if( hasSuperClass )
+				err.err_msg << newClass.type_name << "::" << currMethod.second.func_name << " is declared as an override, but there is no method to override in its superclasses.";
+			else
+				err.err_msg << newClass.type_name << "::" << currMethod.second.func_name << " is declared as an override, but there is no base class.";
+			throw err;
+		}
+		
+		if( !foundOriginal )
+		{
+			newClass.add_method_slot( currMethod.second.func_name );
+			continue;
+		}
+		
+		atom	className = inheritedSlot->second.implementer;
+		if( !currMethod.second.is_override )
+		{
+			parse_error err;
+			err.err_msg << newClass.type_name << "::" << currMethod.second.func_name << " hides method inherited from " << className << ". Did you mean to mark it as 'override'?";
+			throw err;
+		}
+		
+		auto	foundClass = theProgram.classes.find( className );
+		if( foundClass != theProgram.classes.end() )
+		{
+			auto	originalFunction = foundClass->second->functions.find( currMethod.second.func_name );
+			if( originalFunction != foundClass->second->functions.end() )
+			{
+				const vector<vardesc>&			foundFuncParams = originalFunction->second.param_types;
+				vector<vardesc>::const_iterator	currFoundParam = foundFuncParams.begin();
+				for( const vardesc& currParam : currMethod.second.param_types )
+				{
+					if( currFoundParam == foundFuncParams.end() )
+					{
+						parse_error err;
+						err.err_msg << newClass.type_name << "::" << originalFunction->second.func_name << "'s parameter count doesn't match the one defined in " << className;
+						throw err;
+					}
+					
+					if( currParam.type->type_name != currFoundParam->type->type_name )
+					{
+						parse_error err;
+						err.err_msg << newClass.type_name << "::" << originalFunction->second.func_name << "'s parameters don't match the one defined in " << className << ". Expected an " << currFoundParam->type->type_name << ", found a " << currParam.type->type_name;
+						throw err;
+					}
+					
+					currFoundParam++;
+				}
+			}
+		}
+		
+		inheritedSlot->second.implementer = newClass.type_name;
+		inheritedSlot->second.is_overridden = true;
+	}
+}
+
+
+// Semantic checks run as a separate pass once everything is parsed. Each
+//	class only depends on its superclass, so the class hierarchy is a forest
+//	we validate in parallel, every class once its superclass is done. The
+//	first error in source order is reported, no matter which thread found
+//	it first. Classes have to be defined before their subclasses, so
+//	theProgram.classes is in an order in which superclasses come first.
+void	validate_classes( program& theProgram, size_t inThreadCount )
+{
+	vector<classdesc*>	classes;		// Definitions in source order, then declarations.
+	vector<size_t>		superclasses;	// Index in classes, SIZE_MAX if there is none.
+	for( const pair<atom,type_handle>& currClass : theProgram.classes )
+		classes.push_back( static_cast<classdesc*>( currClass.second.get() ) );
+	size_t	numberOfDefinitions = classes.size();
+	for( const pair<atom,type_handle>& currType : theProgram.types )
+	{
+		classdesc*	declaration = dynamic_cast<classdesc*>( currType.second.get() );
+		auto		foundClass = theProgram.classes.find( currType.first );
+		if( declaration && (foundClass == theProgram.classes.end() || foundClass->second != currType.second) )
+			classes.push_back( declaration );
+	}
+	
+	for( size_t x = 0; x < classes.size(); x++ )
+	{
+		size_t	superclass = SIZE_MAX;
+		if( !classes[x]->superclass_name.empty() )
+		{
+			auto	foundSuperclass = theProgram.classes.find( classes[x]->superclass_name );
+			size_t	superclassIndex = foundSuperclass -theProgram.classes.begin();
+			if( foundSuperclass != theProgram.classes.end() && (superclassIndex < x || x >= numberOfDefinitions) )
+				superclass = superclassIndex;
+		}
+		superclasses.push_back( superclass );
+	}
+	
+	vector<exception_ptr>	errors( classes.size() );
+	parallel_for_tree( superclasses, inThreadCount, [&]( size_t inIndex )
+	{
+		try
+		{
+			validate_class( theProgram, *classes[inIndex], (superclasses[inIndex] != SIZE_MAX) ? classes[superclasses[inIndex]] : nullptr );
+			return true;
+		}
+		catch( ... )
+		{
+			errors[inIndex] = current_exception();
+			return false;	// Its subclasses come later in the source, so we won't report their errors.
+		}
+	});
+	
+	for( const exception_ptr& currError : errors )
+	{
+		if( currError )
+			rethrow_exception( currError );
+	}
+}
+
+
+// Static devirtualization:
+//	Follows the commands of a function in order, keeping track of which
+//	local variables are known to hold an object of exactly their class. A
+//	non-struct local is, right after its declaration created it (which is
+//	where parse_function_body adds an init call), and stays so while only
+//	objects of exactly that class are assigned to it. A method called on such
+//	a receiver can only be that class's implementation, so the member term
+//	gets direct_class set and code for it can call Class___method directly
+//	instead of going through the ___isa vtable.
+class call_resolver
+{
+public:
+	call_resolver( const program& theProgram, const classdesc* inClass, funcdesc& ioFunction )
+		: mProgram(theProgram), mClass(inClass), mFunction(ioFunction) {}
+	
+	void	resolve();
+	
+protected:
+	struct inferred_type
+	{
+		const classdesc*	the_class;	// nullptr if it isn't an object, or we don't know its class.
+		bool				is_exact;	// Can't be an object of a subclass.
+	};
+	
+	inferred_type		infer( term_index inTerm );
+	const classdesc*	class_of( const type_handle& inType ) const;
+	
+	const program&			mProgram;
+	const classdesc*		mClass;		// Whose method mFunction is, nullptr for global functions.
+	funcdesc&				mFunction;
+	vector<inferred_type>	mLocals;	// Indexed like mFunction.variables.
+};
+
+
+void	call_resolver::resolve()
+{
+	mLocals.clear();
+	for( const pair<atom,vardesc>& currVar : mFunction.variables )
+		mLocals.push_back( inferred_type{ class_of( currVar.second.type ), false } );
+	
+	term_arena&	terms = mFunction.terms;
+	for( term_index currCommand : mFunction.commands )
+	{
+		const term&	command = terms[currCommand];
+		term_index	receiver = command.first_parameter;
+		term_index	member = (receiver != no_term) ? terms[receiver].next_parameter : no_term;
+		if( command.func_name == atom_dot && member != no_term && terms[receiver].kind == term::variable
+			&& terms[member].kind == term::function_call && terms[member].func_name == atom_init
+			&& terms[receiver].slot < mLocals.size() )
+			mLocals[terms[receiver].slot].is_exact = (mLocals[terms[receiver].slot].the_class != nullptr);	// Declaration that creates the object.
+		infer( currCommand );
+	}
+}
+
+
+const classdesc*	call_resolver::class_of( const type_handle& inType ) const
+{
+	if( !inType || inType->is_struct )
+		return nullptr;
+	auto	foundClass = mProgram.classes.find( inType->type_name );
+	return (foundClass != mProgram.classes.end()) ? static_cast<const classdesc*>( foundClass->second.get() ) : nullptr;
+}
+
+
+call_resolver::inferred_type	call_resolver::infer( term_index inTerm )
+{
+	term_arena&		terms = mFunction.terms;
+	term&			theTerm = terms[inTerm];
+	inferred_type	result = { nullptr, false };
+	theTerm.direct_class = atom();
+	switch( theTerm.kind )
+	{
+		case term::variable:
+			if( theTerm.slot < mLocals.size() )
+				result = mLocals[theTerm.slot];
+			break;
+		case term::parameter:
+			if( theTerm.func_name == atom_this )
+				result.the_class = mClass;
+			else if( theTerm.slot < mFunction.param_types.size() )
+				result.the_class = class_of( mFunction.param_types[theTerm.slot].type );
+			break;
+		case term::global_variable:
+		{
+			auto	foundVar = mProgram.variables.find( theTerm.func_name );
+			if( foundVar != mProgram.variables.end() )
+				result.the_class = class_of( foundVar->second.type );
+			break;
+		}
+		case term::function_call:
+		{
+			term_index	firstParam = theTerm.first_parameter;
+			term_index	secondParam = (firstParam != no_term) ? terms[firstParam].next_parameter : no_term;
+			if( (theTerm.func_name == atom_dot || theTerm.func_name == atom_arrow) && secondParam != no_term )
+			{
+				inferred_type	receiver = infer( firstParam );
+				term&			member = terms[secondParam];
+				member.direct_class = atom();
+				if( !receiver.the_class )
+					break;
+				auto	foundSlot = receiver.the_class->method_slots.find( member.func_name );
+				if( foundSlot != receiver.the_class->method_slots.end() )
+				{
+					if( receiver.is_exact )
+						member.direct_class = foundSlot->second.implementer;
+					break;
+				}
+				auto	foundField = receiver.the_class->variables.find( member.func_name );
+				if( foundField != receiver.the_class->variables.end() )
+					result.the_class = class_of( foundField->second.type );
+				break;
+			}
+			
+			vector<inferred_type>	params;
+			for( term_index currParam = firstParam; currParam != no_term; currParam = terms[currParam].next_parameter )
+				params.push_back( infer( currParam ) );
+			if( theTerm.func_name == atom_assign && params.size() == 2 )
+			{
+				result = params[1];
+				const term&	target = terms[firstParam];
+				if( target.kind == term::variable && target.slot < mLocals.size() )
+				{
+					inferred_type&	local = mLocals[target.slot];
+					local.is_exact = (local.the_class != nullptr && result.is_exact && result.the_class == local.the_class);
+				}
+			}
+			break;
+		}
+		default:
+			break;
+	}
+	return result;
+}
+
+
+// Runs call_resolver on every function, in parallel. Needs the method_slots
+//	validate_classes() makes.
+void	devirtualize_calls( program& theProgram, size_t inThreadCount )
+{
+	vector<pair<const classdesc*,funcdesc*>>	functions;
+	for( pair<atom,type_handle>& currClass : theProgram.classes )
+	{
+		classdesc&	theClass = static_cast<classdesc&>( *currClass.second );
+		for( pair<atom,funcdesc>& currFunction : theClass.functions )
+			functions.emplace_back( &theClass, &currFunction.second );
+	}
+	for( pair<atom,funcdesc>& currFunction : theProgram.functions )
+		functions.emplace_back( nullptr, &currFunction.second );
+	
+	parallel_for( functions.size(), inThreadCount, [&]( size_t inIndex )
+	{
+		call_resolver( theProgram, functions[inIndex].first, *functions[inIndex].second ).resolve();
+	});
+}
+
+
+// Parses, then validates all classes and devirtualizes what calls it can.
+//	If parsing fails, the classes it got to are validated anyway, because
+//	any error in them comes first in the source.
+void	parse_and_validate( program& theProgram, size_t inThreadCount, const function<void()>& inParse )
+{
+	try
+	{
+		inParse();
+	}
+	catch( const exception& )
+	{
+		validate_classes( theProgram, inThreadCount );
+		throw;
+	}
+	validate_classes( theProgram, inThreadCount );
+	devirtualize_calls( theProgram, inThreadCount );
+}
+
+
+// Parses a class or struct declaration or definition into outClass without
+//	validating it or adding it to theProgram. Returns whether it was only a
+//	declaration.
+template<class token_source>
+bool	parse_class( token_source& tokens, typename token_source::iterator& currToken, program& theProgram, classdesc& outClass )
+{
+	bool	isStruct = currToken->name == atom_struct;
+	
+	currToken++;
+	
+	if( currToken->kind != token::identifier )
+		PE_ERROR( "Expected identifier after 'class', found " << PE_TOKEN_NAME );
+	
+	atom		className = currToken->name;
+	atom		baseClassName = atom_object;
+	atom		unionName;
+	bool		mayBeDeclaration = true;
+	bool		isDeclaration = false;
+	
+	currToken++;
+	
+	if( !isStruct && currToken->kind == token::operator_identifier && currToken->name == atom_colon )
+	{
+		currToken++;
+		
+		if( currToken->kind != token::identifier )
+			PE_ERROR( "Expected base class name after ':', found " << PE_TOKEN_NAME );
+		
+		baseClassName = currToken->name;
+		
+		currToken++;
+		
+		mayBeDeclaration = false;
+	}
+	if( !isStruct && currToken->kind == token::identifier && currToken->name == atom_union )
+	{
+		currToken++;
+		
+		if( currToken->kind != token::identifier )
+			PE_ERROR( "Expected identifier after '@union', found " << PE_TOKEN_NAME );
+		
+		unionName = currToken->name;
+		
+		currToken++;
+		
+		mayBeDeclaration = false;
+	}
+
+	outClass.type_name = className;
+	outClass.superclass_name = isStruct ? atom() : baseClassName;
+	outClass.is_struct = isStruct;
+	outClass.union_name = unionName;
+
+	if( mayBeDeclaration && currToken != tokens.end() && currToken->kind == token::operator_identifier && currToken->name == atom_semicolon )
+	{	// declaration:
+		currToken++;
+		isDeclaration = true;
+	}
+	else if( currToken != tokens.end() && (currToken->kind == token::operator_identifier && currToken->name == atom_open_brace) )
+	{	// definition:
+		currToken++;
+		
+		while( true )
+		{
+			if( currToken == tokens.end() || (currToken->kind == token::operator_identifier && currToken->name == atom_close_brace ) )
+				break;
+			
+			bool	isOverride = false;
+			if( !isStruct && currToken->kind == token::identifier && currToken->name == atom_override )
+			{
+				currToken++;
+				if( currToken == tokens.end() )
+					PE_ERROR( "Expected method declaration or definition after 'override', found " << PE_TOKEN_NAME );
+				isOverride = true;
+			}
+			vardesc::field_temperature	temperature = vardesc::normal_field;
+			atom						temperatureName;
+			if( !isOverride && currToken->kind == token::identifier && (currToken->name == atom_hot || currToken->name == atom_cold) )
+			{
+				temperatureName = currToken->name;
+				temperature = (temperatureName == atom_hot) ? vardesc::hot_field : vardesc::cold_field;
+				currToken++;
+				if( currToken == tokens.end() )
+					PE_ERROR( "Expected field declaration after '" << temperatureName << "', found " << PE_TOKEN_NAME );
+			}
+			size_t	fieldCount = outClass.variables.size();
+			atom	thingName = parse_var_or_function( tokens, currToken, theProgram, outClass, outClass, isOverride, !isStruct );
+			if( temperature != vardesc::normal_field )
+			{
+				if( outClass.variables.size() == fieldCount )
+					PE_ERROR( "Only fields can be marked '" << temperatureName << "', but " << className << "::" << thingName << " is a method" );
+				outClass.variables.find( thingName )->second.temperature = temperature;
+			}
+		}
+		
+		if( currToken == tokens.end() || currToken->kind != token::operator_identifier || currToken->name != atom_close_brace )
+			PE_ERROR( "Expected '}' at end of class/struct, found " << PE_TOKEN_NAME );
+		
+		currToken++;
+	}
+	else
+	{
+		throw runtime_error( "This class declaration/definition is incomplete." );
+	}
+	
+	return isDeclaration;
+}
+
+
+// Returns the name of the class, struct, variable or function that was parsed.
+template<class token_source>
+atom	parse_top_level_construct( token_source& tokens, typename token_source::iterator& currToken, program& theProgram )
+{
+	if( currToken->kind == token::identifier && (currToken->name == atom_class
+												|| currToken->name == atom_struct) )
+	{
+		classdesc	newClass;
+		bool		isDeclaration = parse_class( tokens, currToken, theProgram, newClass );
+		atom		className = newClass.type_name;
+		
+		type_handle	classType = make_shared<classdesc>( std::move(newClass) );
+		if( !isDeclaration )
+		{
+			if( theProgram.classes.find(className) != theProgram.classes.end() )
+				PE_ERROR( "A class named '" << className << "' already exists" );
+			theProgram.classes[className] = classType;
+		}
+		
+		theProgram.types[className] = classType;
+		return className;
+	}
+	else
+	{
+		classdesc	dummy_class( atom("__dummy_class") );
+		return parse_var_or_function( tokens, currToken, theProgram, theProgram, dummy_class, false, true );
+	}
+}
+
+
+template<class token_source>
+void	parse_program( token_source& tokens, program& theProgram )
+{
+	typename token_source::iterator	currToken = tokens.begin();
+	
+	while( currToken != tokens.end() )
+	{
+		parse_top_level_construct( tokens, currToken, theProgram );
+	}
+}
+
+
+// Replace a placeholder the parallel parser made with the full type it
+//	stands for, which has to be the one in theProgram at this point:
+void	resolve_placeholder_type( type_handle& ioType, const program& theProgram )
+{
+	if( ioType->is_placeholder )
+	{
+		ioType = theProgram.types.find( ioType->type_name )->second;
+		return;
+	}
+	
+	// Only types with template arguments are made for each use, so nobody
+	//	else sees us change them:
+	for( type_handle& currArgument : ioType->template_arguments )
+		resolve_placeholder_type( currArgument, theProgram );
+	for( type_handle& currArgument : ioType->superclass_template_arguments )
+		resolve_placeholder_type( currArgument, theProgram );
+}
+
+
+void	resolve_placeholder_types( varcontainer& ioContainer, const program& theProgram )
+{
+	for( auto& currVar : ioContainer.variables )
+		resolve_placeholder_type( currVar.second.type, theProgram );
+}
+
+
+void	resolve_placeholder_types( functypedesc& ioFunction, const program& theProgram )
+{
+	resolve_placeholder_type( ioFunction.return_type, theProgram );
+	for( vardesc& currParam : ioFunction.param_types )
+		resolve_placeholder_type( currParam.type, theProgram );
+}
+
+
+void	resolve_placeholder_types( funcdesc& ioFunction, const program& theProgram )
+{
+	resolve_placeholder_types( static_cast<functypedesc&>(ioFunction), theProgram );
+	resolve_placeholder_types( static_cast<varcontainer&>(ioFunction), theProgram );
+}
+
+
+void	resolve_placeholder_types( varfunccontainer& ioContainer, const program& theProgram )
+{
+	resolve_placeholder_types( static_cast<varcontainer&>(ioContainer), theProgram );
+	for( auto& currFunction : ioContainer.function_types )
+		resolve_placeholder_types( currFunction.second, theProgram );
+	for( auto& currFunction : ioContainer.functions )
+		resolve_placeholder_types( currFunction.second, theProgram );
+}
+
+
+// One top-level construct as the parallel parser parsed it on its own:
+struct parsed_construct
+{
+	parsed_construct() : end_token(0), is_declaration(false), failed(false), has_redeclared_types(false), replaced_skipped_body(false) {}
+	
+	classdesc			new_class;		// Of a class or struct.
+	varfunccontainer	globals;		// Of a global variable or function.
+	size_t				end_token;
+	bool				is_declaration;
+	bool				failed;
+	bool				has_redeclared_types;
+	bool				replaced_skipped_body;
+};
+
+
+void	parse_outlined_construct( vector<token>& tokens, program& theProgram, const program_outline::construct& inConstruct, parsed_construct& outConstruct )
+{
+	vector<token>::iterator	currToken = tokens.begin() +inConstruct.first_token;
+	theProgram.saw_redeclared_type = false;
+	theProgram.replaced_skipped_body = false;
+	try
+	{
+		if( inConstruct.kind & program_outline::type_declaration )
+			outConstruct.is_declaration = parse_class( tokens, currToken, theProgram, outConstruct.new_class );
+		else
+		{
+			classdesc	dummy_class( atom("__dummy_class") );
+			parse_var_or_function( tokens, currToken, theProgram, outConstruct.globals, dummy_class, false, true );
+		}
+		outConstruct.end_token = currToken -tokens.begin();
+	}
+	catch( const exception& )
+	{
+		outConstruct.failed = true;	// Parse it again sequentially to report the error.
+	}
+	outConstruct.has_redeclared_types = theProgram.saw_redeclared_type;
+	outConstruct.replaced_skipped_body = theProgram.replaced_skipped_body;
+}
+
+
+// Add a construct parsed in parallel to theProgram, just like parse_top_level_construct()
+//	would have. Returns false without changing theProgram if it has to be
+//	parsed sequentially instead. Sets ioNeedsResolving if it left any
+//	placeholders in global variables or functions.
+bool	merge_parsed_construct( program& theProgram, const program_outline::construct& inConstruct, parsed_construct& ioConstruct, bool& ioNeedsResolving )
+{
+	if( ioConstruct.failed || ioConstruct.end_token != inConstruct.end_token )
+		return false;
+	if( ioConstruct.replaced_skipped_body )
+		theProgram.replaced_skipped_body = true;
+	
+	if( inConstruct.kind & program_outline::type_declaration )
+	{
+		classdesc&	newClass = ioConstruct.new_class;
+		if( newClass.type_name != inConstruct.name || newClass.is_struct != inConstruct.is_struct
+			|| ioConstruct.is_declaration != (inConstruct.kind == program_outline::class_declaration) )
+			return false;
+		
+		resolve_placeholder_types( newClass, theProgram );
+		if( !ioConstruct.is_declaration && theProgram.classes.find( newClass.type_name ) != theProgram.classes.end() )
+			return false;
+		
+		type_handle	classType = make_shared<classdesc>( std::move(newClass) );
+		if( !ioConstruct.is_declaration )
+			theProgram.classes[classType->type_name] = classType;
+		theProgram.types[classType->type_name] = classType;
+		return true;
+	}
+	
+	varfunccontainer&	globals = ioConstruct.globals;
+	if( inConstruct.kind == program_outline::global_variable )
+	{
+		if( globals.variables.size() != 1 || globals.variables.find( inConstruct.name ) == globals.variables.end()
+			|| theProgram.variables.find( inConstruct.name ) != theProgram.variables.end() )
+			return false;
+	}
+	else if( globals.function_types.size() != 1 || globals.function_types.find( inConstruct.name ) == globals.function_types.end() )
+		return false;
+	
+	// Types declared more than once may differ at the end, so resolve those
+	//	now. All others can be done at the end, in parallel.
+	if( ioConstruct.has_redeclared_types )
+		resolve_placeholder_types( globals, theProgram );
+	else
+		ioNeedsResolving = true;
+	
+	for( auto& currVar : globals.variables )
+		theProgram.variables[currVar.first] = std::move(currVar.second);
+	for( auto& currFunction : globals.function_types )
+		theProgram.function_types[currFunction.first] = std::move(currFunction.second);
+	for( auto& currFunction : globals.functions )
+	{
+		auto	foundFunction = theProgram.functions.find( currFunction.first );
+		if( foundFunction != theProgram.functions.end() && foundFunction->second.skipped_body )
+			theProgram.replaced_skipped_body = true;
+		theProgram.functions[currFunction.first] = std::move(currFunction.second);
+	}
+	return true;
+}
+
+
+void	resolve_global_placeholder_types( program& theProgram, size_t inThreadCount )
+{
+	parallel_for( theProgram.variables.size(), inThreadCount, [&]( size_t inIndex )
+	{
+		resolve_placeholder_type( (theProgram.variables.begin() +inIndex)->second.type, theProgram );
+	} );
+	parallel_for( theProgram.function_types.size(), inThreadCount, [&]( size_t inIndex )
+	{
+		resolve_placeholder_types( (theProgram.function_types.begin() +inIndex)->second, theProgram );
+	} );
+	parallel_for( theProgram.functions.size(), inThreadCount, [&]( size_t inIndex )
+	{
+		resolve_placeholder_types( (theProgram.functions.begin() +inIndex)->second, theProgram );
+	} );
+}
+
+
+const size_t	parallel_parse_batch_size = 64;	// Constructs each worker parses before it picks the next batch.
+
+
+void	parse_program_parallel( vector<token>& tokens, program& theProgram, size_t inThreadCount )
+{
+	if( inThreadCount < 2 && !theProgram.lazy_function_bodies )
+	{
+		parse_program( tokens, theProgram );
+		return;
+	}
+	
+	shared_ptr<const parse_snapshot>	snapshot = make_shared<parse_snapshot>( tokens, theProgram );	// Skipped function bodies keep it.
+	const program_outline&		outline = snapshot->outline;
+	size_t						constructCount = outline.constructs.size();
+	vector<parsed_construct>	parsedConstructs( constructCount );
+	parallel_for( (constructCount +parallel_parse_batch_size -1) / parallel_parse_batch_size, inThreadCount, [&]( size_t inBatch )
+	{
+		program	workerProgram( theProgram );	// Nothing changes theProgram until all are parsed.
+		workerProgram.outline = &outline;
+		workerProgram.body_snapshot = snapshot;
+		for( size_t x = inBatch * parallel_parse_batch_size; x < min( constructCount, (inBatch +1) * parallel_parse_batch_size ); x++ )
+		{
+			workerProgram.outline_position = x;
+			parse_outlined_construct( tokens, workerProgram, outline.constructs[x], parsedConstructs[x] );
+		}
+	} );
+	
+	bool	needsResolving = false;
+	try
+	{
+		size_t	sequentialStart = constructCount ? outline.constructs.back().end_token : 0;
+		for( size_t x = 0; x < constructCount; x++ )
+		{
+			if( !merge_parsed_construct( theProgram, outline.constructs[x], parsedConstructs[x], needsResolving ) )
+			{
+				sequentialStart = outline.constructs[x].first_token;
+				break;
+			}
+		}
+		parsedConstructs.clear();
+		
+		vector<token>::iterator	currToken = tokens.begin() +sequentialStart;
+		while( currToken != tokens.end() )
+			parse_top_level_construct( tokens, currToken, theProgram );
+	}
+	catch( ... )
+	{
+		if( needsResolving )	// So whatever was parsed before the error is complete.
+			resolve_global_placeholder_types( theProgram, inThreadCount );
+		throw;
+	}
+	if( needsResolving )
+		resolve_global_placeholder_types( theProgram, inThreadCount );
+}
+
+
+// Parses the function bodies skipped because of lazy_function_bodies, in
+//	parallel. Types are shared, so each body only has to be parsed into the
+//	one funcdesc in its class or the program. Returns false if one fails to
+//	parse or wouldn't have ended at the same '}' if parsed right away.
+//	theProgram then has to be parsed again without skipping bodies to get
+//	the same result.
+bool	parse_skipped_function_bodies( vector<token>& tokens, program& theProgram, size_t inThreadCount )
+{
+	vector<funcdesc*>	skippedFunctions;
+	auto				addSkippedFunctions = [&]( atom_map<funcdesc>& inFunctions )
+	{
+		for( auto& currFunction : inFunctions )
+		{
+			if( currFunction.second.skipped_body )
+				skippedFunctions.push_back( &currFunction.second );
+		}
+	};
+	for( auto& currClass : theProgram.classes )	// Only definitions have functions, and they're all in classes.
+		addSkippedFunctions( currClass.second->functions );
+	addSkippedFunctions( theProgram.functions );
+	
+	atomic<bool>	failed( false );
+	parallel_for( (skippedFunctions.size() +parallel_parse_batch_size -1) / parallel_parse_batch_size, inThreadCount, [&]( size_t inBatch )
+	{
+		unique_ptr<program>	workerProgram;
+		for( size_t x = inBatch * parallel_parse_batch_size; x < min( skippedFunctions.size(), (inBatch +1) * parallel_parse_batch_size ) && !failed; x++ )
+		{
+			funcdesc&						currFunction = *skippedFunctions[x];
+			const skipped_function_body&	skippedBody = *currFunction.skipped_body;
+			if( !workerProgram || workerProgram->outline != &skippedBody.snapshot->outline )
+			{
+				workerProgram.reset( new program( skippedBody.snapshot->base_program ) );
+				workerProgram->outline = &skippedBody.snapshot->outline;
+			}
+			workerProgram->outline_position = skippedBody.construct_index;
+			workerProgram->saw_redeclared_type = false;
+			
+			classdesc	fieldsClass;	// The body only checks whether a field exists.
+			for( atom currField : skippedBody.visible_fields )
+				fieldsClass.variables[currField] = vardesc( currField, type_handle() );
+			
+			vector<token>::iterator	currToken = tokens.begin() +skippedBody.first_token;
+			try
+			{
+				parse_function_body( tokens, currToken, *workerProgram, fieldsClass, currFunction );
+			}
+			catch( const exception& )
+			{
+				failed = true;
+				break;
+			}
+			if( currToken != tokens.begin() +skippedBody.end_token || workerProgram->saw_redeclared_type )
+				failed = true;
+			resolve_placeholder_types( static_cast<varcontainer&>(currFunction), theProgram );
+			currFunction.skipped_body.reset();
+		}
+	} );
+	
+	return !failed;
+}
+
+
+// Parses all signatures first, then all function bodies at once. If that
+//	fails anywhere, or a function was defined again after its first body
+//	was skipped (which would then never be checked), parses everything
+//	again without skipping bodies, so errors are reported and the program
+//	is left exactly like it would be.
+void	parse_program_lazily( vector<token>& tokens, program& theProgram, size_t inThreadCount )
+{
+	program	originalProgram( theProgram );
+	theProgram.lazy_function_bodies = true;
+	try
+	{
+		parse_program_parallel( tokens, theProgram, inThreadCount );
+		if( !theProgram.replaced_skipped_body && parse_skipped_function_bodies( tokens, theProgram, inThreadCount ) )
+		{
+			theProgram.lazy_function_bodies = false;
+			return;
+		}
+	}
+	catch( const exception& )
+	{
+	}
+	
+	theProgram = originalProgram;
+	parse_program_parallel( tokens, theProgram, inThreadCount );
+}
+
+
+// Field layout:
+//	C keeps fields in the order they are declared in, so we choose one that
+//	wastes little: A class's '@hot' fields go first, right after its base or
+//	vtable, then the other fields, each group by decreasing alignment so
+//	there is hardly any padding between them. '@cold' fields go into a
+//	separate <Class>___cold struct the object points to, so they don't take
+//	up cache lines while code works with the rest. Sizes are for LP64.
+//	Structs are values and have no vtable, so their cold fields stay inline.
+
+const size_t	pointer_size = 8;
+const size_t	cache_line_size = 64;
+
+
+struct field_size
+{
+	size_t	size;
+	size_t	alignment;
+};
+
+
+struct class_layout
+{
+	class_layout() : size(0), alignment(1), padding(0), hot_end(0), cold_size(0), is_done(false) {}
+	
+	vector<atom>	fields;			// In struct order. An empty atom is the pointer to the cold fields.
+	vector<atom>	cold_fields;	// In <Class>___cold order.
+	size_t			size;
+	size_t			alignment;
+	size_t			padding;		// Bytes of size no field or base uses.
+	size_t			hot_end;		// Offset after the vtable and the hot fields.
+	size_t			cold_size;
+	bool			is_done;		// False while we work on it, in case it contains itself.
+};
+
+
+size_t	align_up( size_t inOffset, size_t inAlignment )
+{
+	return (inOffset +inAlignment -1) / inAlignment * inAlignment;
+}
+
+
+field_size	built_in_type_size( const string& inName )
+{
+	string	name = inName;
+	if( name.compare( 0, 9, "unsigned " ) == 0 )
+		name.erase( 0, 9 );
+	else if( name == "unsigned" )
+		name = "int";
+	if( name.size() > 4 && name.compare( name.size() -4, 4, " int" ) == 0 )	// "long int", "short int"
+		name.erase( name.size() -4 );
+	
+	if( name == "bool" || name == "char" || name == "int8_t" || name == "uint8_t" )
+		return field_size{ 1, 1 };
+	if( name == "short" || name == "int16_t" || name == "uint16_t" )
+		return field_size{ 2, 2 };
+	if( name == "int" || name == "int32_t" || name == "uint32_t" )
+		return field_size{ 4, 4 };
+	return field_size{ pointer_size, pointer_size };	// long, long long, and whatever we don't know.
+}
+
+
+field_size	layout_class( const program& theProgram, const classdesc& inClass, atom_map<class_layout>& ioLayouts );
+
+
+field_size	field_type_size( const program& theProgram, const type_handle& inType, atom_map<class_layout>& ioLayouts )
+{
+	auto	foundClass = theProgram.classes.find( inType->type_name );
+	if( foundClass == theProgram.classes.end() )
+		return built_in_type_size( inType->type_name.name() );
+	if( !foundClass->second->is_struct )	// Objects are referenced, see c_type_name().
+		return field_size{ pointer_size, pointer_size };
+	return layout_class( theProgram, static_cast<const classdesc&>(*foundClass->second), ioLayouts );
+}
+
+
+// Lays out inClass and whatever classes its struct contains, unless that was
+//	done already. Doesn't keep references into ioLayouts across recursion,
+//	as adding a layout may move the others.
+field_size	layout_class( const program& theProgram, const classdesc& inClass, atom_map<class_layout>& ioLayouts )
+{
+	auto	foundLayout = ioLayouts.find( inClass.type_name );
+	if( foundLayout != ioLayouts.end() )
+	{
+		if( !foundLayout->second.is_done )	// Contains itself, which C only allows through a pointer.
+			return field_size{ pointer_size, pointer_size };
+		return field_size{ foundLayout->second.size, foundLayout->second.alignment };
+	}
+	ioLayouts[inClass.type_name] = class_layout();
+	
+	class_layout	layout;
+	field_size		base{ pointer_size, pointer_size };	// The vtable.
+	if( inClass.is_struct )
+		base = field_size{ 0, 1 };
+	layout.hot_end = base.size;
+	auto			foundSuperclass = theProgram.classes.find( inClass.superclass_name );
+	if( foundSuperclass != theProgram.classes.end() )
+	{
+		base = layout_class( theProgram, static_cast<const classdesc&>(*foundSuperclass->second), ioLayouts );
+		layout.hot_end = ioLayouts.find( inClass.superclass_name )->second.hot_end;
+	}
+	
+	struct placed_field
+	{
+		atom		name;
+		field_size	size;
+		bool		is_hot;
+	};
+	vector<placed_field>	fields;
+	vector<placed_field>	coldFields;
+	for( const pair<atom,vardesc>& currVar : inClass.variables )
+	{
+		placed_field	field{ currVar.first, field_type_size( theProgram, currVar.second.type, ioLayouts ), currVar.second.temperature == vardesc::hot_field };
+		if( currVar.second.temperature == vardesc::cold_field && !inClass.is_struct )	// Struct values have nothing to point at it.
+			coldFields.push_back( field );
+		else
+			fields.push_back( field );
+	}
+	if( !coldFields.empty() )
+		fields.push_back( placed_field{ atom(), field_size{ pointer_size, pointer_size }, false } );
+	
+	// Stable, so fields that are alike stay in source order:
+	stable_sort( fields.begin(), fields.end(), []( const placed_field& a, const placed_field& b )
+	{
+		if( a.is_hot != b.is_hot )
+			return a.is_hot;
+		return a.size.alignment > b.size.alignment;
+	});
+	stable_sort( coldFields.begin(), coldFields.end(), []( const placed_field& a, const placed_field& b ){ return a.size.alignment > b.size.alignment; } );
+	
+	size_t	offset = base.size;
+	size_t	usedBytes = base.size;
+	layout.alignment = base.alignment;
+	for( const placed_field& currField : fields )
+	{
+		offset = align_up( offset, currField.size.alignment ) +currField.size.size;
+		usedBytes += currField.size.size;
+		layout.alignment = max( layout.alignment, currField.size.alignment );
+		layout.fields.push_back( currField.name );
+		if( currField.is_hot )
+			layout.hot_end = offset;
+	}
+	layout.size = align_up( offset, layout.alignment );
+	layout.padding = layout.size -usedBytes;
+	
+	size_t	coldAlignment = 1;
+	for( const placed_field& currField : coldFields )
+	{
+		layout.cold_size = align_up( layout.cold_size, currField.size.alignment ) +currField.size.size;
+		coldAlignment = max( coldAlignment, currField.size.alignment );
+		layout.cold_fields.push_back( currField.name );
+	}
+	layout.cold_size = align_up( layout.cold_size, coldAlignment );
+	layout.is_done = true;
+	
+	field_size	result{ layout.size, layout.alignment };
+	ioLayouts[inClass.type_name] = std::move(layout);
+	return result;
+}
+
+
+// Tab-separated, for --layout-report. Padding is inside the class's own
+//	part of the struct, and hot lines are the cache lines from the start
+//	of the object to the end of the last hot field.
+void	print_layout_report( ostream& inStream, const vector<type_handle>& inSortedClasses, const atom_map<class_layout>& inLayouts )
+{
+	inStream << "class\tsize\tpadding\tcache lines\thot lines\tcold size" << endl;
+	for( const type_handle& currClass : inSortedClasses )
+	{
+		const class_layout&	layout = inLayouts.find( currClass->type_name )->second;
+		inStream << currClass->type_name << "\t" << layout.size << "\t" << layout.padding << "\t" << align_up( layout.size, cache_line_size ) / cache_line_size
+			<< "\t" << align_up( layout.hot_end, cache_line_size ) / cache_line_size << "\t" << layout.cold_size << endl;
+	}
+}
+
+
+// Code generation:
+//	Objects of classes live on the heap, start with a pointer to their
+//	class's ___isa vtable and are passed around as pointers. Structs are
+//	values without a vtable. Methods become functions named
+//	<Class>___<method> that take the object as 'this', global functions and
+//	variables get a function___ or global___ prefix, so they can't collide
+//	with the names we make up or C's main().
+
+// What generating function bodies needs to know about all classes:
+struct codegen_context
+{
+	explicit codegen_context( const program& theProgram ) : the_program(theProgram) {}
+	
+	const classdesc*	class_named( atom inName ) const	// Classes and structs.
+	{
+		auto	foundClass = the_program.classes.find( inName );
+		return (foundClass != the_program.classes.end()) ? static_cast<const classdesc*>( foundClass->second.get() ) : nullptr;
+	}
+	const funcdesc*		method_named( atom inClassName, atom inName ) const	// Only if it has a body.
+	{
+		const classdesc*	theClass = class_named( inClassName );
+		if( !theClass )
+			return nullptr;
+		auto	foundMethod = theClass->functions.find( inName );
+		if( foundMethod == theClass->functions.end() || foundMethod->second.is_pure_virtual )
+			return nullptr;
+		return &foundMethod->second;
+	}
+	
+	const program&			the_program;
+	atom_map<class_layout>	layouts;
+	atom_map<vector<bool>>	overridden_below;	// Per method slot: Some subclass implements it differently.
+};
+
+
+struct codegen_options
+{
+	codegen_options() : layout_report(nullptr), runtime_vtables(false) {}
+	
+	ostream*	layout_report;		// Where --layout-report goes.
+	bool		runtime_vtables;	// Fill in mutable vtables in init___all___classes(), for code that still calls it.
+};
+
+
+const size_t	emit_batch_size = 64;	// Classes or functions each worker generates before it picks the next batch.
+
+
+// Collects the generated C in memory: Text that depends on all classes
+//	goes into stream(), the parts for each class or function are generated
+//	into their own buffers on worker threads by emit_parallel(). write()
+//	puts them all together in the order they were emitted, so the output is
+//	the same no matter how many threads made it, and writes it in one go.
+class code_emitter
+{
+public:
+	explicit code_emitter( size_t inThreadCount ) : mThreadCount(inThreadCount) {}
+	
+	ostream&	stream()	{ return mCurrent; }
+	void		emit_parallel( size_t inCount, const function<void(size_t,ostream&)>& inBody );	// inBody must not throw.
+	
+	void		write( ostream& ioStream );
+	void		write( const string& inFilePath );
+
+protected:
+	void		end_section();
+	
+	size_t			mThreadCount;
+	stringstream	mCurrent;
+	vector<string>	mSections;	// Everything before mCurrent, in order.
+};
+
+
+void	code_emitter::end_section()
+{
+	if( mCurrent.tellp() <= 0 )
+		return;
+	mSections.push_back( mCurrent.str() );
+	mCurrent.str( string() );
+}
+
+
+// Calls inBody( x, stream ) for every x in 0...inCount -1 and emits what
+//	they wrote in the order of x.
+void	code_emitter::emit_parallel( size_t inCount, const function<void(size_t,ostream&)>& inBody )
+{
+	end_section();
+	size_t	firstSection = mSections.size();
+	size_t	batchCount = (inCount +emit_batch_size -1) / emit_batch_size;
+	mSections.resize( firstSection +batchCount );
+	parallel_for( batchCount, mThreadCount, [&]( size_t inBatch )
+	{
+		stringstream	batchStream;
+		for( size_t x = inBatch * emit_batch_size; x < min( (inBatch +1) * emit_batch_size, inCount ); x++ )
+			inBody( x, batchStream );
+		mSections[firstSection +inBatch] = batchStream.str();
+	});
+}
+
+
+void	code_emitter::write( ostream& ioStream )
+{
+	end_section();
+	size_t	totalSize = 0;
+	for( const string& currSection : mSections )
+		totalSize += currSection.size();
+	string	contents;
+	contents.reserve( totalSize );
+	for( string& currSection : mSections )
+	{
+		contents.append( currSection );
+		string().swap( currSection );	// So we don't hold on to it twice.
+	}
+	mSections.clear();
+	
+	ioStream.write( contents.data(), contents.size() );
+	ioStream.flush();
+}
+
+
+void	code_emitter::write( const string& inFilePath )
+{
+	ofstream	file( inFilePath, ios::out | ios::binary | ios::trunc );
+	write( file );
+	file.close();
+	if( !file )
+		throw runtime_error( "Couldn't write file \"" + inFilePath + "\"." );
+}
+
+
+string	c_type_name( const program& theProgram, const type_handle& inType )
+{
+	auto	foundClass = theProgram.classes.find( inType->type_name );
+	if( foundClass == theProgram.classes.end() )
+		return inType->type_name.name();
+	if( foundClass->second->is_struct )
+		return "struct " + inType->type_name.name();
+	return "struct " + inType->type_name.name() + "*";
+}
+
+
+// The type of a pointer to a function like inFunction:
+string	c_function_pointer_type( const program& theProgram, const functypedesc& inFunction, const string& inThisType )
+{
+	string	result = c_type_name( theProgram, inFunction.return_type ) + " (*)( " + inThisType + "*";
+	for( const vardesc& currParam : inFunction.param_types )
+		result += ", " + c_type_name( theProgram, currParam.type );
+	return result + " )";
+}
+
+
+// inThisType is empty for functions that aren't methods:
+void	print_function_head( ostream& ioStream, const program& theProgram, const functypedesc& inFunction, const string& inName, const string& inThisType )
+{
+	ioStream << c_type_name( theProgram, inFunction.return_type ) << "	" << inName << "( ";
+	bool	isFirst = true;
+	if( !inThisType.empty() )
+	{
+		ioStream << inThisType << " *this";
+		isFirst = false;
+	}
+	for( const vardesc& currParam : inFunction.param_types )
+	{
+		ioStream << (isFirst ? "" : ", ") << c_type_name( theProgram, currParam.type ) << " " << currParam.var_name;
+		isFirst = false;
+	}
+	ioStream << (isFirst ? "void )" : " )");
+}
+
+
+// The class in inClass's hierarchy that has field inName, and how many
+//	superclasses up it is, or nullptr:
+const classdesc*	find_field( const codegen_context& inContext, const classdesc& inClass, atom inName, size_t& outLevels )
+{
+	outLevels = 0;
+	for( const classdesc* currClass = &inClass; currClass; currClass = inContext.class_named( currClass->superclass_name ) )
+	{
+		if( currClass->variables.find( inName ) != currClass->variables.end() )
+			return currClass;
+		outLevels++;
+	}
+	return nullptr;
+}
+
+
+// The field a method of inClass does nothing but return, or set to its one
+//	parameter, or an empty atom. We emit those as static inline functions
+//	callers use instead of the method, whenever they know which it is.
+atom	trivial_accessor_field( const codegen_context& inContext, const classdesc& inClass, const funcdesc& inMethod, bool& outIsSetter )
+{
+	outIsSetter = false;
+	if( inMethod.commands.size() != 1 || inMethod.skipped_body )
+		return atom();
+	const term_arena&	terms = inMethod.terms;
+	const term&			command = terms[inMethod.commands[0]];
+	term_index			firstParam = command.first_parameter;
+	if( command.kind != term::function_call || firstParam == no_term )
+		return atom();
+	term_index			secondParam = terms[firstParam].next_parameter;
+	
+	auto	fieldOfThis = [&]( term_index inTerm )
+	{
+		const term&	access = terms[inTerm];
+		if( access.kind != term::function_call || access.func_name != atom_dot || access.first_parameter == no_term )
+			return atom();
+		const term&	receiver = terms[access.first_parameter];
+		if( receiver.kind != term::parameter || receiver.func_name != atom_this || receiver.next_parameter == no_term )
+			return atom();
+		const term&	field = terms[receiver.next_parameter];
+		size_t		levels = 0;
+		if( field.kind != term::field || inClass.method_slots.find( field.func_name ) != inClass.method_slots.end()
+			|| !find_field( inContext, inClass, field.func_name, levels ) )
+			return atom();
+		return field.func_name;
+	};
+	
+	if( command.func_name == atom_return && secondParam == no_term && inMethod.param_types.empty() )
+		return fieldOfThis( firstParam );
+	if( command.func_name == atom_assign && secondParam != no_term && inMethod.param_types.size() == 1 )
+	{
+		const term&	value = terms[secondParam];
+		if( value.kind != term::parameter || value.func_name != inMethod.param_types[0].var_name )
+			return atom();
+		outIsSetter = true;
+		return fieldOfThis( firstParam );
+	}
+	return atom();
+}
+
+
+// Writes the C function for one function or method. With a union name,
+//	inClass is stored inline in that union and 'this' points at the union.
+class body_generator
+{
+public:
+	body_generator( const codegen_context& inContext, const classdesc* inClass, const funcdesc& inFunction, ostream& ioStream, atom inUnionName = atom() )
+		: mContext(inContext), mProgram(inContext.the_program), mClass(inClass), mFunction(inFunction), mStream(ioStream), mUnionName(inUnionName) {}
+	
+	void			generate( const string& inName );
+	type_handle		generate_field( const string& inReceiver, const classdesc& inClass, atom inField, ostream& ioStream );	// Also used for inline accessors.
+
+protected:
+	void			find_owned_locals();
+	void			generate_command( term_index inCommand );
+	void			generate_deallocs( const char* inIndent );
+	void			generate_converted( term_index inTerm, const type_handle& inType, ostream& ioStream );
+	type_handle		generate_term( term_index inTerm, ostream& ioStream );
+	type_handle		generate_member( term_index inReceiver, const term& inMember, atom inOperator, ostream& ioStream );
+	type_handle		generate_method_call( const string& inReceiver, const classdesc& inClass, atom inMethod, atom inDirectClass, ostream& ioStream );
+	string			receiver_text( term_index inTerm, type_handle& outType );
+	bool			is_union_this( term_index inTerm ) const	{ return !mUnionName.empty() && mFunction.terms[inTerm].kind == term::parameter && mFunction.terms[inTerm].func_name == atom_this; }
+	
+	const classdesc*	object_class( const type_handle& inType ) const
+	{
+		const classdesc*	theClass = inType ? mContext.class_named( inType->type_name ) : nullptr;
+		return (theClass && !theClass->is_struct) ? theClass : nullptr;
+	}
+	
+	const codegen_context&	mContext;
+	const program&			mProgram;
+	const classdesc*		mClass;		// Whose method it is, nullptr for global functions.
+	const funcdesc&			mFunction;
+	ostream&				mStream;
+	atom					mUnionName;
+	atom_map<bool>			mOwnedLocals;	// Objects we create and must free before we return, see find_owned_locals().
+	vector<atom>			mLiveLocals;	// The owned locals created so far, which a return must free.
+};
+
+
+void	body_generator::generate( const string& inName )
+{
+	string	thisType;
+	if( !mUnionName.empty() )
+		thisType = "struct " + mUnionName.name();
+	else if( mClass )
+		thisType = "struct " + mClass->type_name.name();
+	print_function_head( mStream, mProgram, mFunction, inName, thisType );
+	mStream << endl
+		<< "{" << endl;
+	for( const pair<atom,vardesc>& currVar : mFunction.variables )
+	{
+		mStream << "	" << c_type_name( mProgram, currVar.second.type ) << "	" << currVar.second.var_name;
+		const classdesc*	varClass = mContext.class_named( currVar.second.type->type_name );
+		if( varClass && varClass->is_struct )
+			mStream << " = {0}";
+		mStream << ";" << endl;
+	}
+	if( mFunction.variables.size() > 0 && mFunction.commands.size() > 0 )
+		mStream << endl;
+	find_owned_locals();
+	for( term_index currCommand : mFunction.commands )
+		generate_command( currCommand );
+	if( mFunction.commands.empty() || mFunction.terms[mFunction.commands.back()].func_name != atom_return )
+		generate_deallocs( "	" );
+	mStream << "}" << endl
+		<< endl;
+}
+
+
+// Objects declared without a value are ours. We free them when we return,
+//	unless they're declared more than once or the variable is used for
+//	anything but calling methods or getting fields, as then the object may
+//	live on elsewhere (stored, passed on, returned) and is leaked instead.
+void	body_generator::find_owned_locals()
+{
+	const term_arena&	terms = mFunction.terms;
+	atom_map<size_t>	declarations;
+	for( term_index currCommand : mFunction.commands )
+	{
+		const term&	command = terms[currCommand];
+		term_index	firstParam = command.first_parameter;
+		term_index	secondParam = (firstParam != no_term) ? terms[firstParam].next_parameter : no_term;
+		if( command.kind == term::function_call && command.func_name == atom_dot && secondParam != no_term
+			&& terms[firstParam].kind == term::variable && terms[secondParam].kind == term::function_call && terms[secondParam].func_name == atom_init )
+			declarations[terms[firstParam].func_name]++;
+	}
+	
+	vector<bool>	isReceiver( terms.size(), false );
+	for( term_index x = 0; x < terms.size(); x++ )
+	{
+		if( terms[x].kind == term::function_call && terms[x].func_name == atom_dot && terms[x].first_parameter != no_term )
+			isReceiver[terms[x].first_parameter] = true;
+	}
+	atom_map<bool>	escapes;
+	for( term_index x = 0; x < terms.size(); x++ )
+	{
+		if( terms[x].kind == term::variable && !isReceiver[x] )
+			escapes[terms[x].func_name] = true;
+	}
+	
+	for( const pair<atom,size_t>& currDeclaration : declarations )
+	{
+		if( currDeclaration.second == 1 && escapes.find( currDeclaration.first ) == escapes.end() )
+			mOwnedLocals[currDeclaration.first] = true;
+	}
+}
+
+
+// Free the owned locals created so far, newest first:
+void	body_generator::generate_deallocs( const char* inIndent )
+{
+	for( auto currLocal = mLiveLocals.rbegin(); currLocal != mLiveLocals.rend(); currLocal++ )
+	{
+		const classdesc*	varClass = object_class( mFunction.variables.find( *currLocal )->second.type );
+		mStream << inIndent;
+		generate_method_call( currLocal->name(), *varClass, atom("dealloc"), atom(), mStream );
+		mStream << ";" << endl;
+	}
+}
+
+
+void	body_generator::generate_command( term_index inCommand )
+{
+	const term_arena&	terms = mFunction.terms;
+	const term&			command = terms[inCommand];
+	term_index			firstParam = command.first_parameter;
+	term_index			secondParam = (firstParam != no_term) ? terms[firstParam].next_parameter : no_term;
+	
+	if( command.kind == term::function_call && command.func_name == atom_return && firstParam != no_term && !mLiveLocals.empty() )
+	{	// Get the result before we free objects it may come from:
+		mStream << "	{" << endl
+			<< "		" << c_type_name( mProgram, mFunction.return_type ) << "	result___ = ";
+		generate_converted( firstParam, mFunction.return_type, mStream );
+		mStream << ";" << endl;
+		generate_deallocs( "		" );
+		mStream << "		return result___;" << endl
+			<< "	}" << endl;
+		return;
+	}
+	
+	if( command.kind == term::function_call && command.func_name == atom_return )
+		generate_deallocs( "	" );
+	mStream << "	";
+	if( command.kind == term::function_call && command.func_name == atom_return )
+	{
+		mStream << "return";
+		if( firstParam != no_term )
+		{
+			mStream << " ";
+			generate_converted( firstParam, mFunction.return_type, mStream );
+		}
+	}
+	else if( command.kind == term::function_call && command.func_name == atom_dot && secondParam != no_term
+			&& terms[firstParam].kind == term::variable && terms[secondParam].kind == term::function_call && terms[secondParam].func_name == atom_init )
+	{	// Declaration of an object, see parse_function_body():
+		type_handle			varType;
+		string				variable = receiver_text( firstParam, varType );
+		const classdesc*	varClass = object_class( varType );
+		if( varClass )
+		{
+			mStream << variable << " = " << varClass->type_name << "___new();" << endl
+				<< "	if( !" << variable << " )" << endl
+				<< "		abort()";	// There's no way to report failure to the caller.
+			if( mOwnedLocals.find( terms[firstParam].func_name ) != mOwnedLocals.end() )
+				mLiveLocals.push_back( terms[firstParam].func_name );
+			if( varClass->method_slots.find( atom_init ) != varClass->method_slots.end() )
+			{
+				mStream << ";" << endl << "	";
+				generate_method_call( variable, *varClass, atom_init, terms[secondParam].direct_class, mStream );
+			}
+		}
+	}
+	else if( command.kind == term::function_call && command.func_name == atom_assign && secondParam != no_term )
+	{
+		type_handle	targetType = generate_term( firstParam, mStream );
+		mStream << " = ";
+		generate_converted( secondParam, targetType, mStream );
+	}
+	else
+		generate_term( inCommand, mStream );
+	mStream << ";" << endl;
+}
+
+
+// An object of a subclass has its superclass's struct as its 'base', so
+//	we only need to cast the pointer:
+void	body_generator::generate_converted( term_index inTerm, const type_handle& inType, ostream& ioStream )
+{
+	stringstream		value;
+	type_handle			termType = generate_term( inTerm, value );
+	const classdesc*	targetClass = object_class( inType );
+	const classdesc*	termClass = object_class( termType );
+	if( targetClass && termClass && targetClass != termClass )
+		ioStream << "(struct " << targetClass->type_name << "*) ";
+	ioStream << value.str();
+}
+
+
+// A term to call a method on or get a field of, bracketed unless it's a name:
+string	body_generator::receiver_text( term_index inTerm, type_handle& outType )
+{
+	stringstream	text;
+	outType = generate_term( inTerm, text );
+	term::term_type	kind = mFunction.terms[inTerm].kind;
+	if( kind == term::variable || kind == term::parameter || kind == term::global_variable )
+		return text.str();
+	return "(" + text.str() + ")";
+}
+
+
+// Returns the term's type, or nullptr if it's a number or we don't know.
+type_handle	body_generator::generate_term( term_index inTerm, ostream& ioStream )
+{
+	const term_arena&	terms = mFunction.terms;
+	const term&			theTerm = terms[inTerm];
+	switch( theTerm.kind )
+	{
+		case term::quoted_string:
+			ioStream << "\"" << theTerm.func_name << "\"";	// The lexer keeps escape sequences as they are.
+			break;
+		case term::character:
+			ioStream << "'" << theTerm.func_name << "'";
+			break;
+		case term::integer:
+			ioStream << theTerm.value.integer;
+			if( theTerm.value.integer > uint64_t(numeric_limits<int64_t>::max()) )
+				ioStream << "ULL";
+			break;
+		case term::number:
+			print_number( ioStream, theTerm.value.number );
+			break;
+		case term::variable:
+		{
+			ioStream << theTerm.func_name;
+			auto	foundVar = mFunction.variables.find( theTerm.func_name );
+			if( foundVar != mFunction.variables.end() )
+				return foundVar->second.type;
+			break;
+		}
+		case term::parameter:
+			ioStream << theTerm.func_name;
+			if( theTerm.func_name == atom_this )
+				return mClass ? mProgram.classes.find( mClass->type_name )->second : nullptr;
+			if( theTerm.slot < mFunction.param_types.size() )
+				return mFunction.param_types[theTerm.slot].type;
+			break;
+		case term::global_variable:
+		{
+			ioStream << "global___" << theTerm.func_name;
+			auto	foundVar = mProgram.variables.find( theTerm.func_name );
+			if( foundVar != mProgram.variables.end() )
+				return foundVar->second.type;
+			break;
+		}
+		case term::field:
+			ioStream << theTerm.func_name;
+			break;
+		case term::class_object:
+			ioStream << "&g___isa___" << theTerm.func_name;
+			break;
+		case term::function_call:
+		{
+			term_index	firstParam = theTerm.first_parameter;
+			term_index	secondParam = (firstParam != no_term) ? terms[firstParam].next_parameter : no_term;
+			if( firstParam == no_term )
+			{
+				if( theTerm.func_name.empty() )
+					break;
+				auto	foundFunction = mProgram.functions.find( theTerm.func_name );
+				if( foundFunction != mProgram.functions.end() )
+				{
+					ioStream << "function___" << theTerm.func_name << "()";
+					return foundFunction->second.return_type;
+				}
+				if( mClass && mClass->method_slots.find( theTerm.func_name ) != mClass->method_slots.end() )
+				{
+					if( !mUnionName.empty() )
+					{
+						ioStream << mUnionName << "___" << mClass->type_name << "___" << theTerm.func_name << "( this )";
+						return mProgram.classes.find( mClass->method_slots.find( theTerm.func_name )->second.owner )->second->functions.find( theTerm.func_name )->second.return_type;
+					}
+					return generate_method_call( "this", *mClass, theTerm.func_name, atom(), ioStream );
+				}
+				ioStream << theTerm.func_name << "()";
+				break;
+			}
+			if( (theTerm.func_name == atom_dot || theTerm.func_name == atom_arrow) && secondParam != no_term )
+				return generate_member( firstParam, terms[secondParam], theTerm.func_name, ioStream );
+			
+			ioStream << "(";
+			type_handle	result;
+			if( secondParam == no_term )
+			{
+				ioStream << theTerm.func_name;
+				result = generate_term( firstParam, ioStream );
+			}
+			else
+			{
+				result = generate_term( firstParam, ioStream );
+				ioStream << " " << theTerm.func_name << " ";
+				generate_term( secondParam, ioStream );
+			}
+			ioStream << ")";
+			return result;
+		}
+	}
+	return nullptr;
+}
+
+
+type_handle	body_generator::generate_member( term_index inReceiver, const term& inMember, atom inOperator, ostream& ioStream )
+{
+	if( is_union_this( inReceiver ) )
+	{
+		auto	foundSlot = mClass->method_slots.find( inMember.func_name );
+		if( foundSlot != mClass->method_slots.end() )
+		{	// We know which member of the union it is, so no need to switch:
+			ioStream << mUnionName << "___" << mClass->type_name << "___" << inMember.func_name << "( this )";
+			return mProgram.classes.find( foundSlot->second.owner )->second->functions.find( inMember.func_name )->second.return_type;
+		}
+		size_t				levels = 0;
+		const classdesc*	owner = find_field( mContext, *mClass, inMember.func_name, levels );
+		if( owner )
+		{
+			ioStream << "this->storage." << mClass->type_name;
+			for( size_t x = 0; x < levels; x++ )
+				ioStream << ".base";
+			ioStream << "." << inMember.func_name;
+			return owner->variables.find( inMember.func_name )->second.type;
+		}
+	}
+	
+	type_handle			receiverType;
+	string				receiver = receiver_text( inReceiver, receiverType );
+	const classdesc*	receiverClass = receiverType ? mContext.class_named( receiverType->type_name ) : nullptr;
+	if( receiverClass && !receiverClass->is_struct )
+	{
+		if( receiverClass->method_slots.find( inMember.func_name ) != receiverClass->method_slots.end() )
+			return generate_method_call( receiver, *receiverClass, inMember.func_name, inMember.direct_class, ioStream );
+		return generate_field( receiver, *receiverClass, inMember.func_name, ioStream );
+	}
+	
+	ioStream << receiver << ((inOperator == atom_arrow) ? "->" : ".") << inMember.func_name;
+	if( receiverClass )
+	{
+		auto	foundField = receiverClass->variables.find( inMember.func_name );
+		if( foundField != receiverClass->variables.end() )
+			return foundField->second.type;
+	}
+	return nullptr;
+}
+
+
+// Calls the implementation directly if call_resolver found the receiver's
+//	exact class, or no subclass of its class overrides the method. Otherwise
+//	goes through the vtable.
+type_handle	body_generator::generate_method_call( const string& inReceiver, const classdesc& inClass, atom inMethod, atom inDirectClass, ostream& ioStream )
+{
+	auto				foundSlot = inClass.method_slots.find( inMethod );
+	size_t				slotIndex = foundSlot -inClass.method_slots.begin();
+	const method_slot&	slot = foundSlot->second;
+	atom				implementer = inDirectClass;
+	if( implementer.empty() && !mContext.overridden_below.find( inClass.type_name )->second[slotIndex] )
+		implementer = slot.implementer;
+	const funcdesc*		implementation = implementer.empty() ? nullptr : mContext.method_named( implementer, inMethod );
+	if( implementation )
+	{
+		bool	isSetter = false;
+		bool	isAccessor = !trivial_accessor_field( mContext, *mContext.class_named( implementer ), *implementation, isSetter ).empty();
+		ioStream << implementer << "___" << inMethod << (isAccessor ? "___inline" : "") << "( ";
+		if( implementer != inClass.type_name )
+			ioStream << "(struct " << implementer << "*)";
+		ioStream << inReceiver << " )";
+		return implementation->return_type;
+	}
+	
+	ioStream << "call___" << slot.owner << "___" << inMethod << "( ";
+	if( slot.owner != inClass.type_name )
+		ioStream << "(struct " << slot.owner << "*)";
+	ioStream << inReceiver << " )";
+	return mProgram.classes.find( slot.owner )->second->functions.find( inMethod )->second.return_type;
+}
+
+
+type_handle	body_generator::generate_field( const string& inReceiver, const classdesc& inClass, atom inField, ostream& ioStream )
+{
+	size_t				levels = 0;
+	const classdesc*	owner = find_field( mContext, inClass, inField, levels );
+	ioStream << inReceiver << "->";
+	for( size_t x = 0; x < levels && owner; x++ )
+		ioStream << "base.";
+	if( owner )
+	{
+		const vector<atom>&	coldFields = mContext.layouts.find( owner->type_name )->second.cold_fields;
+		if( find( coldFields.begin(), coldFields.end(), inField ) != coldFields.end() )
+			ioStream << "___cold->";
+	}
+	ioStream << inField;
+	return owner ? owner->variables.find( inField )->second.type : nullptr;
+}
+
+
+// Vtables are constant data the C compiler lays out, so they end up in
+//	read-only memory shared by all processes, and nothing runs at startup.
+//	Each slot is in the ___isa struct of the class that declared it, which
+//	is nested in the 'base' of its subclasses' ___isa structs.
+void	print_vtable_initializer( ostream& ioStream, const codegen_context& inContext, const classdesc& inClass )
+{
+	ioStream << "{" << endl;
+	for( const pair<atom,method_slot>& currSlot : inClass.method_slots )
+	{
+		const method_slot&	slot = currSlot.second;
+		const funcdesc*		implementation = inContext.method_named( slot.implementer, currSlot.first );
+		ioStream << "	.";
+		for( size_t x = slot.owner_depth; x < inClass.number_of_superclasses; x++ )
+			ioStream << "base.";
+		ioStream << currSlot.first << " = ";
+		if( !implementation )	// Pure virtual.
+			ioStream << "NULL";
+		else if( slot.implementer != slot.owner )	// Takes a subclass as 'this'.
+		{
+			const funcdesc&	declaration = inContext.class_named( slot.owner )->functions.find( currSlot.first )->second;
+			ioStream << "(" << c_function_pointer_type( inContext.the_program, declaration, "struct " + slot.owner.name() ) << ") " << slot.implementer << "___" << currSlot.first;
+		}
+		else
+			ioStream << slot.implementer << "___" << currSlot.first;
+		ioStream << "," << endl;
+	}
+	ioStream << "}";
+}
+
+
+// Classes marked '@union' can also be stored inline, in a tagged union named
+//	after the union: A small tag in place of the vtable pointer says which
+//	class the value is, and methods dispatch by switching on it, so the
+//	value needs neither a heap block nor an indirect call. Each member's
+//	fields are in a <Class>___fields struct nested like <Class>, but without
+//	the vtable, and the union is as large as the largest of them. Every
+//	member gets a <Union>___<Class>___<method> version of each method that
+//	takes the union as 'this'.
+void	generate_union( ostream& ioStream, const codegen_context& inContext, atom inUnionName, const vector<const classdesc*>& inMembers, const atom_map<bool>& inHasFields )
+{
+	const program&	theProgram = inContext.the_program;
+	const char*		tagType = "uint32_t";
+	if( inMembers.size() <= UINT8_MAX +1 )
+		tagType = "uint8_t";
+	else if( inMembers.size() <= UINT16_MAX +1 )
+		tagType = "uint16_t";
+	
+	ioStream << "enum" << endl
+		<< "{" << endl;
+	for( size_t x = 0; x < inMembers.size(); x++ )
+		ioStream << "	" << inUnionName << "___tag___" << inMembers[x]->type_name << " = " << x << "," << endl;
+	ioStream << "};" << endl
+		<< endl;
+	
+	ioStream << "struct " << inUnionName << endl
+		<< "{" << endl
+		<< "	" << tagType << "	tag;" << endl;
+	bool	hasStorage = any_of( inMembers.begin(), inMembers.end(), [&]( const classdesc* inMember ){ return inHasFields.find( inMember->type_name )->second; } );
+	if( hasStorage )	// A member without any fields needs no storage.
+	{
+		ioStream << "	union" << endl
+			<< "	{" << endl;
+		for( const classdesc* currMember : inMembers )
+		{
+			if( inHasFields.find( currMember->type_name )->second )
+				ioStream << "		struct " << currMember->type_name << "___fields	" << currMember->type_name << ";" << endl;
+		}
+		ioStream << "	} storage;" << endl;
+	}
+	ioStream << "};" << endl
+		<< endl;
+	
+	string	thisType = "struct " + inUnionName.name();
+	for( const classdesc* currMember : inMembers )
+	{
+		for( const pair<atom,method_slot>& currSlot : currMember->method_slots )
+		{
+			const funcdesc&	method = theProgram.classes.find( currSlot.second.owner )->second->functions.find( currSlot.first )->second;
+			print_function_head( ioStream, theProgram, method, inUnionName.name() + "___" + currMember->type_name.name() + "___" + currSlot.first.name(), thisType );
+			ioStream << ";" << endl;
+		}
+	}
+	ioStream << endl;
+	
+	// Only methods all members inherited from the same class have the same signature:
+	for( const pair<atom,method_slot>& currSlot : inMembers[0]->method_slots )
+	{
+		bool	inAllMembers = all_of( inMembers.begin() +1, inMembers.end(), [&]( const classdesc* inMember )
+		{
+			auto	foundSlot = inMember->method_slots.find( currSlot.first );
+			return foundSlot != inMember->method_slots.end() && foundSlot->second.owner == currSlot.second.owner;
+		});
+		auto	foundOwner = theProgram.classes.find( currSlot.second.owner );
+		if( !inAllMembers || foundOwner == theProgram.classes.end() )
+			continue;
+		auto	foundMethod = foundOwner->second->functions.find( currSlot.first );
+		if( foundMethod == foundOwner->second->functions.end() )
+			continue;
+		const funcdesc&	method = foundMethod->second;
+		bool			returnsVoid = method.return_type->type_name == atom_void;
+		
+		stringstream	args;
+		for( const vardesc& currParam : method.param_types )
+			args << ", " << currParam.var_name;
+		
+		print_function_head( ioStream, theProgram, method, inUnionName.name() + "___" + method.func_name.name(), thisType );
+		ioStream << endl
+			<< "{" << endl
+			<< "	switch( this->tag )" << endl
+			<< "	{" << endl;
+		for( const classdesc* currMember : inMembers )
+		{
+			if( currMember == inMembers.back() )	// Tags are always valid, and this way we never fall off the end.
+				ioStream << "		default:" << endl;
+			else
+				ioStream << "		case " << inUnionName << "___tag___" << currMember->type_name << ":" << endl;
+			ioStream << "			" << (returnsVoid ? "" : "return ") << inUnionName << "___" << currMember->type_name << "___" << method.func_name << "( this" << args.str() << " );" << endl;
+			if( returnsVoid )
+				ioStream << "			break;" << endl;
+		}
+		ioStream << "	}" << endl
+			<< "}" << endl
+			<< endl;
+	}
+}
+
+
+// Superclasses before their subclasses, otherwise in declaration order.
+vector<type_handle>	sorted_classes( const program& theProgram )
+{
+	vector<type_handle>	sortedClasses;
+    transform( theProgram.classes.begin(), theProgram.classes.end(), std::back_inserter( sortedClasses ), [](const pair<atom,type_handle>& m){return m.second;} );
+	stable_sort( sortedClasses.begin(), sortedClasses.end(), []( const type_handle& a, const type_handle& b ){ return a->number_of_superclasses < b->number_of_superclasses; });
+	return sortedClasses;
+}
+
+
+// --layout-report without generating code, e.g. for --signatures-only.
+void	report_layouts( const program& theProgram, ostream& inStream )
+{
+	vector<type_handle>		sortedClasses = sorted_classes( theProgram );
+	atom_map<class_layout>	layouts;
+	for( const type_handle& currClassType : sortedClasses )
+		layout_class( theProgram, static_cast<const classdesc&>(*currClassType), layouts );
+	print_layout_report( inStream, sortedClasses, layouts );
+}
+
+
+void	generate_classes( program& theProgram, code_emitter& ioEmitter, const codegen_options& inOptions = codegen_options() )
+{
+	vector<type_handle>	sortedClasses = sorted_classes( theProgram );
+	codegen_context	context( theProgram );
+	
+	// Union members and their superclasses need a ___fields struct, see generate_union():
+	atom_map<vector<const classdesc*>>	unions;
+	atom_map<bool>						hasFields;	// The class or one of its superclasses has a field.
+	atom_map<bool>						needsFields;
+	for( const type_handle& currClassType : sortedClasses )
+	{
+		const classdesc&	currClass = static_cast<const classdesc&>(*currClassType);
+		auto				foundSuperclass = hasFields.find( currClass.superclass_name );
+		hasFields[currClass.type_name] = currClass.variables.size() > 0 || (foundSuperclass != hasFields.end() && foundSuperclass->second);
+		context.overridden_below[currClass.type_name].assign( currClass.method_slots.size(), false );
+		if( currClass.union_name.empty() )
+			continue;
+		unions[currClass.union_name].push_back( &currClass );
+		for( const classdesc* currChainClass = &currClass; currChainClass; currChainClass = context.class_named( currChainClass->superclass_name ) )
+			needsFields[currChainClass->type_name] = true;
+	}
+	
+	// Subclasses before their superclasses, so each passes on what it and its subclasses override:
+	for( auto currClassType = sortedClasses.rbegin(); currClassType != sortedClasses.rend(); currClassType++ )
+	{
+		const classdesc&	currClass = static_cast<const classdesc&>(**currClassType);
+		const classdesc*	superclass = context.class_named( currClass.superclass_name );
+		if( !superclass )
+			continue;
+		const vector<bool>&	overridden = context.overridden_below.find( currClass.type_name )->second;
+		vector<bool>&		superclassOverridden = context.overridden_below.find( superclass->type_name )->second;
+		for( size_t x = 0; x < superclassOverridden.size() && x < overridden.size(); x++ )
+		{
+			if( overridden[x] || (currClass.method_slots.begin() +x)->second.implementer != (superclass->method_slots.begin() +x)->second.implementer )
+				superclassOverridden[x] = true;
+		}
+	}
+	
+	for( const type_handle& currClassType : sortedClasses )
+		layout_class( theProgram, static_cast<const classdesc&>(*currClassType), context.layouts );
+	if( inOptions.layout_report )
+		print_layout_report( *inOptions.layout_report, sortedClasses, context.layouts );
+	
+	ostream&	common = ioEmitter.stream();	// Text that isn't about one class or function.
+	common << "#include <stdbool.h>" << endl
+		<< "#include <stdint.h>" << endl
+		<< "#include <stdlib.h>" << endl
+		<< endl;
+	for( const type_handle& currClassType : sortedClasses )
+		common << "struct " << currClassType->type_name << ";" << endl;
+	common << endl;
+	
+	ioEmitter.emit_parallel( sortedClasses.size(), [&]( size_t inIndex, ostream& out )
+	{
+		const classdesc&	currClass = static_cast<const classdesc&>(*sortedClasses[inIndex]);
+		if( !currClass.is_struct )
+		{
+			out << "struct " << currClass.type_name << "___isa" << endl
+				<< "{" << endl;
+			if( !currClass.superclass_name.empty() )
+				out << "	struct " << currClass.superclass_name << "___isa	base;" << endl;
+			// Inherited slots come first and are in 'base', the rest are ours:
+			const classdesc*	superclass = context.class_named( currClass.superclass_name );
+			for( auto currSlot = currClass.method_slots.begin() +(superclass ? superclass->method_slots.size() : 0); currSlot != currClass.method_slots.end(); currSlot++ )
+			{
+				const funcdesc&	currFunc = currClass.functions.find( currSlot->first )->second;
+				out << "	" << c_type_name( theProgram, currFunc.return_type ) << "	(*" << currFunc.func_name << ")( struct " << currClass.type_name << " *this";
+				for( const vardesc& currParam : currFunc.param_types )
+				{
+					out << ", " << c_type_name( theProgram, currParam.type ) << " " << currParam.var_name;
+				}
+				out << " );" << endl;
+			}
+			out << "};" << endl
+				<< endl;
+		}
+		
+		const class_layout&	layout = context.layouts.find( currClass.type_name )->second;
+		auto				printField = [&theProgram, &currClass, &out]( atom inName )
+		{
+			const vardesc&	field = currClass.variables.find( inName )->second;
+			out << "	" << c_type_name( theProgram, field.type ) << "	" << field.var_name << ";" << endl;
+		};
+		if( !layout.cold_fields.empty() )
+		{
+			out << "struct " << currClass.type_name << "___cold" << endl
+				<< "{" << endl;
+			for_each( layout.cold_fields.begin(), layout.cold_fields.end(), printField );
+			out << "};" << endl
+				<< endl;
+		}
+		
+		out << "struct " << currClass.type_name << endl
+			<< "{" << endl;
+		if( !currClass.superclass_name.empty() )
+			out << "	struct " << currClass.superclass_name << "	base;" << endl;
+		else if( !currClass.is_struct )
+			out << "	const struct " << currClass.type_name << "___isa*	vtable;" << endl;
+		for( atom currField : layout.fields )
+		{
+			if( currField.empty() )
+				out << "	struct " << currClass.type_name << "___cold*	___cold;" << endl;
+			else
+				printField( currField );
+		}
+		out << "};" << endl
+			<< endl;
+		
+		if( needsFields.find( currClass.type_name ) != needsFields.end() && hasFields.find( currClass.type_name )->second )
+		{
+			out << "struct " << currClass.type_name << "___fields" << endl
+				<< "{" << endl;
+			if( hasFields.find( currClass.superclass_name ) != hasFields.end() && hasFields.find( currClass.superclass_name )->second )
+				out << "	struct " << currClass.superclass_name << "___fields	base;" << endl;
+			for( atom currField : layout.fields )	// Cold fields are inline here, so a value needs no heap block.
+			{
+				if( !currField.empty() )
+					printField( currField );
+			}
+			for_each( layout.cold_fields.begin(), layout.cold_fields.end(), printField );
+			out << "};" << endl
+				<< endl;
+		}
+		
+		if( currClass.is_struct )
+			return;
+		
+		string	thisType = "struct " + currClass.type_name.name();
+		for( const pair<atom,funcdesc>& currFunc : currClass.functions )
+		{
+			if( !currFunc.second.is_pure_virtual )
+			{
+				print_function_head( out, theProgram, currFunc.second, currClass.type_name.name() + "___" + currFunc.second.func_name.name(), thisType );
+				out << ";" << endl;
+			}
+		}
+		out << endl;
+		
+		if( !inOptions.runtime_vtables )
+		{
+			out << "static const struct " << currClass.type_name << "___isa g___isa___" << currClass.type_name << " =" << endl;
+			print_vtable_initializer( out, context, currClass );
+			out << ";" << endl
+				<< endl;
+			return;
+		}
+		
+		out << "struct " << currClass.type_name << "___isa g___isa___" << currClass.type_name << " = {};" << endl
+			<< endl;
+		
+		out << "void init_class___" << currClass.type_name << "( struct " << currClass.type_name << "___isa* dest )" << endl
+			<< "{" << endl;
+		if( !currClass.superclass_name.empty() )
+			out << "	init_class___" << currClass.superclass_name << "( &(dest->base) );" << endl;
+		
+		for( const pair<atom,funcdesc>& currFunc : currClass.functions )
+		{
+			out << "	" << "dest->";
+			const method_slot&	slot = currClass.method_slots.find( currFunc.second.func_name )->second;
+			size_t				numLevels = currClass.number_of_superclasses -slot.owner_depth;	// Slot is in the owner's ___isa struct.
+			for( size_t x = 0; x < numLevels; x++ )
+				out << "base.";
+			out << currFunc.second.func_name << " = ";
+			if( currFunc.second.is_pure_virtual )
+				out << "NULL;" << endl;
+			else if( slot.owner != currClass.type_name )	// Takes a subclass as 'this'.
+				out << "(" << c_function_pointer_type( theProgram, currFunc.second, "struct " + slot.owner.name() ) << ") " << currClass.type_name << "___" << currFunc.second.func_name << ";" << endl;
+			else
+				out << currClass.type_name << "___" << currFunc.second.func_name << ";" << endl;
+		}
+		out << "}" << endl << endl;
+	});
+	
+	ioEmitter.emit_parallel( unions.size(), [&]( size_t inIndex, ostream& out )
+	{
+		const pair<atom,vector<const classdesc*>>&	currUnion = *(unions.begin() +inIndex);
+		generate_union( out, context, currUnion.first, currUnion.second, hasFields );
+	});
+	
+	if( inOptions.runtime_vtables )
+	{
+		common << "void	init___all___classes( void )" << endl << "{" << endl;
+		for( const type_handle& currClass : sortedClasses )
+		{
+			if( !currClass->is_struct )
+				common << "	init_class___" << currClass->type_name << "( &g___isa___" << currClass->type_name << " );" << endl;
+		}
+		common << "}" << endl << endl;
+	}
+	
+	// Creating objects, calling methods through the vtable, and trivial accessors:
+	ioEmitter.emit_parallel( sortedClasses.size(), [&]( size_t inIndex, ostream& out )
+	{
+		const classdesc&	currClass = static_cast<const classdesc&>(*sortedClasses[inIndex]);
+		if( currClass.is_struct )
+			return;
+		
+		// The object and the cold fields of it and its superclasses are one block, so dealloc frees them all:
+		out << "struct " << currClass.type_name << "*	" << currClass.type_name << "___new( void )" << endl
+			<< "{" << endl
+			<< "	struct block" << endl
+			<< "	{" << endl
+			<< "		struct " << currClass.type_name << "	object;" << endl;
+		for( const classdesc* currChainClass = &currClass; currChainClass; currChainClass = context.class_named( currChainClass->superclass_name ) )
+		{
+			if( !context.layouts.find( currChainClass->type_name )->second.cold_fields.empty() )
+				out << "		struct " << currChainClass->type_name << "___cold	" << currChainClass->type_name << ";" << endl;
+		}
+		out << "	}*	block = calloc( 1, sizeof(struct block) );" << endl
+			<< "	if( !block )" << endl
+			<< "		return NULL;" << endl;
+		string	path = "block->object.";
+		for( const classdesc* currChainClass = &currClass; currChainClass; currChainClass = context.class_named( currChainClass->superclass_name ) )
+		{
+			if( !context.layouts.find( currChainClass->type_name )->second.cold_fields.empty() )
+				out << "	" << path << "___cold = &block->" << currChainClass->type_name << ";" << endl;
+			if( currChainClass->superclass_name.empty() )
+				out << "	" << path << "vtable = (const struct " << currChainClass->type_name << "___isa*) &g___isa___" << currClass.type_name << ";" << endl;
+			path += "base.";
+		}
+		out << "	return &block->object;" << endl
+			<< "}" << endl
+			<< endl;
+		
+		for( const pair<atom,funcdesc>& currFunc : currClass.functions )
+		{
+			if( currFunc.second.is_override )
+				continue;
+			out << "static inline ";
+			print_function_head( out, theProgram, currFunc.second, "call___" + currClass.type_name.name() + "___" + currFunc.second.func_name.name(), "struct " + currClass.type_name.name() );
+			out << endl
+				<< "{" << endl
+				<< "	" << ((currFunc.second.return_type->type_name == atom_void) ? "" : "return ") << "((const struct " << currClass.type_name << "___isa*) this->";
+			for( size_t x = 0; x < currClass.number_of_superclasses; x++ )
+				out << "base.";
+			out << "vtable)->" << currFunc.second.func_name << "( this";
+			for( const vardesc& currParam : currFunc.second.param_types )
+				out << ", " << currParam.var_name;
+			out << " );" << endl
+				<< "}" << endl
+				<< endl;
+		}
+		
+		for( const pair<atom,funcdesc>& currFunc : currClass.functions )
+		{
+			bool	isSetter = false;
+			atom	field = trivial_accessor_field( context, currClass, currFunc.second, isSetter );
+			if( field.empty() )
+				continue;
+			out << "static inline ";
+			print_function_head( out, theProgram, currFunc.second, currClass.type_name.name() + "___" + currFunc.second.func_name.name() + "___inline", "struct " + currClass.type_name.name() );
+			out << endl
+				<< "{" << endl
+				<< "	" << (isSetter ? "" : "return ");
+			body_generator( context, &currClass, currFunc.second, out ).generate_field( "this", currClass, field, out );
+			if( isSetter )
+				out << " = " << currFunc.second.param_types[0].var_name;
+			out << ";" << endl
+				<< "}" << endl
+				<< endl;
+		}
+	});
+	
+	for( const pair<atom,vardesc>& currVar : theProgram.variables )
+		common << c_type_name( theProgram, currVar.second.type ) << "	global___" << currVar.first << ";" << endl;
+	for( const pair<atom,funcdesc>& currFunc : theProgram.functions )
+	{
+		print_function_head( common, theProgram, currFunc.second, "function___" + currFunc.first.name(), "" );
+		common << ";" << endl;
+	}
+	common << endl;
+	
+	// Bodies that weren't parsed (see --signatures-only) stay declarations:
+	ioEmitter.emit_parallel( sortedClasses.size(), [&]( size_t inIndex, ostream& out )
+	{
+		const classdesc&	currClass = static_cast<const classdesc&>(*sortedClasses[inIndex]);
+		for( const pair<atom,funcdesc>& currFunc : currClass.functions )
+		{
+			if( currFunc.second.is_pure_virtual || currFunc.second.skipped_body )
+				continue;
+			if( currClass.type_name == atom_object && currFunc.first == atom("dealloc") )
+			{	// Built in, there's no source for it.
+				print_function_head( out, theProgram, currFunc.second, "object___dealloc", "struct object" );
+				out << endl
+					<< "{" << endl
+					<< "	free( this );" << endl
+					<< "}" << endl
+					<< endl;
+				continue;
+			}
+			body_generator( context, &currClass, currFunc.second, out ).generate( currClass.type_name.name() + "___" + currFunc.first.name() );
+		}
+	});
+	ioEmitter.emit_parallel( unions.size(), [&]( size_t inIndex, ostream& out )
+	{
+		const pair<atom,vector<const classdesc*>>&	currUnion = *(unions.begin() +inIndex);
+		for( const classdesc* currMember : currUnion.second )
+		{
+			for( const pair<atom,method_slot>& currSlot : currMember->method_slots )
+			{
+				string			name = currUnion.first.name() + "___" + currMember->type_name.name() + "___" + currSlot.first.name();
+				const funcdesc*	implementation = context.method_named( currSlot.second.implementer, currSlot.first );
+				if( implementation && implementation->skipped_body )
+					continue;
+				if( implementation && currSlot.second.implementer != atom_object )
+				{
+					body_generator( context, currMember, *implementation, out, currUnion.first ).generate( name );
+					continue;
+				}
+				
+				// Pure virtual, or object's dealloc, which has nothing to free in a union:
+				const funcdesc&	method = theProgram.classes.find( currSlot.second.owner )->second->functions.find( currSlot.first )->second;
+				print_function_head( out, theProgram, method, name, "struct " + currUnion.first.name() );
+				out << endl
+					<< "{" << endl;
+				if( !implementation )
+					out << "	abort();" << endl;
+				out << "}" << endl
+					<< endl;
+			}
+		}
+	});
+	ioEmitter.emit_parallel( theProgram.functions.size(), [&]( size_t inIndex, ostream& out )
+	{
+		const pair<atom,funcdesc>&	currFunc = *(theProgram.functions.begin() +inIndex);
+		if( !currFunc.second.skipped_body )
+			body_generator( context, nullptr, currFunc.second, out ).generate( "function___" + currFunc.first.name() );
+	});
+	
+	auto	foundMain = theProgram.functions.find( atom("main") );
+	if( foundMain != theProgram.functions.end() && foundMain->second.param_types.empty() )
+	{
+		common << "int	main( void )" << endl
+			<< "{" << endl;
+		if( inOptions.runtime_vtables )
+			common << "	init___all___classes();" << endl;
+		if( foundMain->second.return_type->type_name == atom_void )
+			common << "	function___main();" << endl
+				<< "	return 0;" << endl;
+		else
+			common << "	return (int) function___main();" << endl;
+		common << "}" << endl;
+	}
+}
+
+
+// Bytecode interpreter:
+//	Runs a program without going through C, see --run. Each function's
+//	commands are lowered to instructions for a register machine. A frame's
+//	registers are 'this' (for methods), the parameters, the local variables
+//	in the order of funcdesc::variables, then temporaries, and instructions
+//	name registers by their index in the frame. Objects use the same model
+//	as the generated C: They point at their class, whose vtable has an
+//	entry for each of its method_slots at the same index as in all its
+//	subclasses, and the fields of a subclass come after its superclass's.
+//	Every value is 64 bits. Integers of all sizes are int64_t, number
+//	literals are double. Structs aren't supported yet.
+
+union vm_value
+{
+	int64_t					integer;
+	double					number;
+	struct vm_object*		object;
+	const char*				string;
+	const struct vm_class*	class_object;
+};
+
+
+typedef enum : uint8_t {
+	vm_integer_kind,
+	vm_number_kind,
+	vm_object_kind,
+	vm_string_kind
+} vm_kind;
+
+
+struct vm_class
+{
+	vm_class() : superclass(nullptr), field_count(0) {}
+	
+	atom				name;
+	const vm_class*		superclass;
+	uint32_t			field_count;	// Including those of its superclasses.
+	vector<uint32_t>	vtable;			// Index in vm_program::functions for each of the class's method_slots.
+	atom_map<uint32_t>	methods;		// The functions the class defines itself, including pure virtual ones.
+};
+
+
+struct vm_object
+{
+	const vm_class*	isa;
+	vm_value		fields[1];	// Actually isa->field_count of them.
+};
+
+
+// a, b and c are registers unless noted:
+#define VM_OPCODES( X ) \
+	X(load_constant)	/* a = constants[b] */ \
+	X(move)				/* a = b */ \
+	X(load_global)		/* a = globals[b] */ \
+	X(store_global)		/* globals[a] = b */ \
+	X(get_field)		/* a = b->fields[c] */ \
+	X(set_field)		/* a->fields[b] = c */ \
+	X(new_object)		/* a = new object of classes[b] */ \
+	X(free_object)		/* free a */ \
+	X(add) X(subtract) X(multiply) X(divide) X(modulo) X(shift_left) X(shift_right)		/* a = b op c */ \
+	X(equal) X(not_equal) X(less) X(greater) X(less_equal) X(greater_equal) \
+	X(add_number) X(subtract_number) X(multiply_number) X(divide_number) \
+	X(equal_number) X(not_equal_number) X(less_number) X(greater_number) X(less_equal_number) X(greater_equal_number) \
+	X(negate) X(negate_number) X(bit_not) X(logical_not) X(test)	/* a = op b, test is b != 0 */ \
+	X(integer_to_number) X(number_to_integer) \
+	X(jump_if_zero)		/* If a == 0, continue at instruction b */ \
+	X(jump_if_not_zero) \
+	X(call)				/* a = functions[b]( c, c +1 ... ) */ \
+	X(call_method)		/* a = c->isa->vtable[b]( c, c +1 ... ) */ \
+	X(return_value)		/* return a */ \
+	X(return_void) \
+	X(fail)				/* Throw with the message in constants[a] */
+
+#define VM_OPCODE_ENUM( name )		vm_op_##name,
+
+typedef enum : uint8_t {
+	VM_OPCODES( VM_OPCODE_ENUM )
+	vm_opcode_count
+} vm_opcode;
+
+
+struct vm_instruction
+{
+	vm_opcode	op;
+	uint32_t	a;
+	uint32_t	b;
+	uint32_t	c;
+};
+
+
+struct vm_function
+{
+	vm_function() : parameter_count(0), register_count(0), result_kind(vm_integer_kind), returns_void(true) {}
+	
+	string					name;
+	uint32_t				parameter_count;	// Including 'this'.
+	uint32_t				register_count;
+	vector<vm_instruction>	code;
+	vm_kind					result_kind;
+	bool					returns_void;
+};
+
+
+const size_t	vm_initial_stack_size = 64 * 1024;	// Registers, grows as needed.
+const size_t	vm_max_call_depth = 100000;
+
+
+class vm_program
+{
+public:
+	vm_program();
+	
+	void		load( const program& theProgram );
+	int			run_main();		// Returns main()'s result as the exit status.
+	vm_value	run( uint32_t inFunction );
+	
+	uint32_t	add_constant( vm_value inValue )	{ constants.push_back( inValue ); return uint32_t( constants.size() -1 ); }
+	uint32_t	add_message( const string& inMessage );
+	vm_kind		kind_of( const type_handle& inType ) const;
+	
+	const program*			the_program;
+	vector<vm_function>		functions;
+	deque<vm_class>			classes;			// Objects point at them, so they must never move.
+	atom_map<uint32_t>		class_indices;
+	atom_map<uint32_t>		function_indices;	// Global functions.
+	vector<vm_value>		globals;			// Indexed like program::variables.
+	vector<vm_value>		constants;			// Index 0 is 0.
+	deque<string>			messages;			// Strings for constants that aren't names.
+};
+
+
+vm_program::vm_program() : the_program(nullptr)
+{
+	add_constant( vm_value() );
+}
+
+
+uint32_t	vm_program::add_message( const string& inMessage )
+{
+	messages.push_back( inMessage );
+	vm_value	message;
+	message.string = messages.back().c_str();
+	return add_constant( message );
+}
+
+
+vm_kind		vm_program::kind_of( const type_handle& inType ) const
+{
+	if( !inType )
+		return vm_integer_kind;
+	auto	foundClass = the_program->classes.find( inType->type_name );
+	if( foundClass != the_program->classes.end() )
+	{
+		if( foundClass->second->is_struct )
+			throw runtime_error( "The interpreter can't run code that uses struct " + inType->type_name.name() + " yet." );
+		return vm_object_kind;
+	}
+	return vm_integer_kind;	// There are no floating-point types yet, only literals.
+}
+
+
+// A value the lowered code computed, and where it is:
+struct vm_operand
+{
+	uint32_t	reg;
+	vm_kind		kind;
+	type_handle	type;	// nullptr if it's a literal or we don't know.
+};
+
+
+// Lowers the commands of one function or method into its vm_function.
+class bytecode_lowerer
+{
+public:
+	bytecode_lowerer( vm_program& ioProgram, const classdesc* inClass, const funcdesc& inFunction, vm_function& outFunction );
+	
+	void		lower();
+
+protected:
+	void		lower_command( term_index inCommand );
+	vm_operand	lower_term( term_index inTerm );
+	vm_operand	lower_member( term_index inReceiver, const term& inMember );
+	vm_operand	lower_method_call( const vm_operand& inReceiver, const classdesc& inClass, atom inMethod, atom inDirectClass );
+	vm_operand	lower_call( vm_opcode inOp, uint32_t inCallee, const functypedesc& inCalleeType, const vm_operand* inReceiver );
+	vm_operand	lower_assignment( term_index inTarget, term_index inValue );
+	vm_operand	lower_operator( const term& inTerm );
+	vm_operand	lower_logical( const term& inTerm, bool inIsAnd );
+	vm_operand	converted( const vm_operand& inOperand, vm_kind inKind );
+	vm_operand	truth( const vm_operand& inOperand );	// Integer 1 if it's not 0, else 0.
+	
+	const classdesc*	class_named( atom inName ) const;
+	const classdesc*	object_class( const type_handle& inType ) const;
+	bool				find_field( const classdesc& inClass, atom inName, uint32_t& outIndex, type_handle& outType ) const;
+	
+	vm_operand	new_operand( vm_kind inKind, const type_handle& inType = nullptr );
+	void		emit( vm_opcode inOp, uint32_t inA = 0, uint32_t inB = 0, uint32_t inC = 0 )	{ mFunction.code.push_back( vm_instruction{ inOp, inA, inB, inC } ); }
+	
+	vm_program&			mProgram;
+	const program&		mSource;
+	const classdesc*	mClass;		// Whose method it is, nullptr for global functions.
+	const funcdesc&		mSourceFunction;
+	vm_function&		mFunction;
+	uint32_t			mFirstParameter;
+	uint32_t			mFirstLocal;
+	uint32_t			mFirstTemporary;
+	uint32_t			mNextTemporary;
+};
+
+
+bytecode_lowerer::bytecode_lowerer( vm_program& ioProgram, const classdesc* inClass, const funcdesc& inFunction, vm_function& outFunction )
+	: mProgram(ioProgram), mSource(*ioProgram.the_program), mClass(inClass), mSourceFunction(inFunction), mFunction(outFunction)
+{
+	mFirstParameter = inClass ? 1 : 0;
+	mFirstLocal = mFirstParameter +uint32_t( inFunction.param_types.size() );
+	mFirstTemporary = mFirstLocal +uint32_t( inFunction.variables.size() );
+	mNextTemporary = mFirstTemporary;
+}
+
+
+void	bytecode_lowerer::lower()
+{
+	mFunction.parameter_count = mFirstLocal;
+	mFunction.register_count = mFirstTemporary;
+	mFunction.returns_void = mSourceFunction.return_type->type_name == atom_void;
+	if( !mFunction.returns_void )
+		mFunction.result_kind = mProgram.kind_of( mSourceFunction.return_type );
+	for( const pair<atom,vardesc>& currVar : mSourceFunction.variables )
+		mProgram.kind_of( currVar.second.type );	// Rejects structs.
+	
+	for( term_index currCommand : mSourceFunction.commands )
+	{
+		mNextTemporary = mFirstTemporary;	// Nothing a command computes outlives it.
+		lower_command( currCommand );
+	}
+	emit( vm_op_return_void );
+}
+
+
+void	bytecode_lowerer::lower_command( term_index inCommand )
+{
+	const term_arena&	terms = mSourceFunction.terms;
+	const term&			command = terms[inCommand];
+	term_index			firstParam = command.first_parameter;
+	term_index			secondParam = (firstParam != no_term) ? terms[firstParam].next_parameter : no_term;
+	
+	if( command.kind == term::function_call && command.func_name == atom_return )
+	{
+		if( firstParam == no_term || mFunction.returns_void )
+			emit( vm_op_return_void );
+		else
+			emit( vm_op_return_value, converted( lower_term( firstParam ), mFunction.result_kind ).reg );
+	}
+	else if( command.kind == term::function_call && command.func_name == atom_dot && secondParam != no_term
+			&& terms[firstParam].kind == term::variable && terms[secondParam].kind == term::function_call && terms[secondParam].func_name == atom_init )
+	{	// Declaration of an object, see parse_function_body():
+		vm_operand			variable = lower_term( firstParam );
+		const classdesc*	varClass = object_class( variable.type );
+		if( !varClass )
+			return;
+		emit( vm_op_new_object, variable.reg, mProgram.class_indices.find( varClass->type_name )->second );
+		if( varClass->method_slots.find( atom_init ) != varClass->method_slots.end() )
+			lower_method_call( variable, *varClass, atom_init, varClass->method_slots.find( atom_init )->second.implementer );	// We just made it, so we know its class.
+	}
+	else
+		lower_term( inCommand );
+}
+
+
+vm_operand	bytecode_lowerer::new_operand( vm_kind inKind, const type_handle& inType )
+{
+	vm_operand	result = { mNextTemporary++, inKind, inType };
+	mFunction.register_count = max( mFunction.register_count, mNextTemporary );
+	return result;
+}
+
+
+const classdesc*	bytecode_lowerer::class_named( atom inName ) const
+{
+	auto	foundClass = mSource.classes.find( inName );
+	return (foundClass != mSource.classes.end()) ? static_cast<const classdesc*>( foundClass->second.get() ) : nullptr;
+}
+
+
+const classdesc*	bytecode_lowerer::object_class( const type_handle& inType ) const
+{
+	const classdesc*	theClass = inType ? class_named( inType->type_name ) : nullptr;
+	return (theClass && !theClass->is_struct) ? theClass : nullptr;
+}
+
+
+// Fields of superclasses come first, see vm_class::field_count:
+bool	bytecode_lowerer::find_field( const classdesc& inClass, atom inName, uint32_t& outIndex, type_handle& outType ) const
+{
+	for( const classdesc* currClass = &inClass; currClass; currClass = class_named( currClass->superclass_name ) )
+	{
+		auto	foundField = currClass->variables.find( inName );
+		if( foundField == currClass->variables.end() )
+			continue;
+		const vm_class&	owner = mProgram.classes[mProgram.class_indices.find( currClass->type_name )->second];
+		outIndex = (owner.superclass ? owner.superclass->field_count : 0) +uint32_t( foundField -currClass->variables.begin() );
+		outType = foundField->second.type;
+		return true;
+	}
+	return false;
+}
+
+
+vm_operand	bytecode_lowerer::converted( const vm_operand& inOperand, vm_kind inKind )
+{
+	if( inOperand.kind == vm_integer_kind && inKind == vm_number_kind )
+	{
+		vm_operand	result = new_operand( vm_number_kind );
+		emit( vm_op_integer_to_number, result.reg, inOperand.reg );
+		return result;
+	}
+	if( inOperand.kind == vm_number_kind && inKind == vm_integer_kind )
+	{
+		vm_operand	result = new_operand( vm_integer_kind );
+		emit( vm_op_number_to_integer, result.reg, inOperand.reg );
+		return result;
+	}
+	return inOperand;
+}
+
+
+vm_operand	bytecode_lowerer::truth( const vm_operand& inOperand )
+{
+	vm_operand	result = new_operand( vm_integer_kind );
+	if( inOperand.kind == vm_number_kind )
+	{
+		vm_operand	zero = new_operand( vm_number_kind );
+		vm_value	zeroValue;
+		zeroValue.number = 0.0;
+		emit( vm_op_load_constant, zero.reg, mProgram.add_constant( zeroValue ) );
+		emit( vm_op_not_equal_number, result.reg, inOperand.reg, zero.reg );
+	}
+	else
+		emit( vm_op_test, result.reg, inOperand.reg );
+	return result;
+}
+
+
+vm_operand	bytecode_lowerer::lower_term( term_index inTerm )
+{
+	const term_arena&	terms = mSourceFunction.terms;
+	const term&			theTerm = terms[inTerm];
+	vm_value			constant;
+	switch( theTerm.kind )
+	{
+		case term::quoted_string:
+		{
+			vm_operand	result = new_operand( vm_string_kind );
+			constant.string = theTerm.func_name.name().c_str();	// Atoms never go away. Escape sequences stay as the lexer kept them.
+			emit( vm_op_load_constant, result.reg, mProgram.add_constant( constant ) );
+			return result;
+		}
+		case term::character:
+		{
+			vm_operand		result = new_operand( vm_integer_kind );
+			const string&	text = theTerm.func_name.name();
+			constant.integer = (text.size() > 1 && text[0] == '\\') ? decode_escape( text[1] ) : (text.empty() ? 0 : text[0]);
+			emit( vm_op_load_constant, result.reg, mProgram.add_constant( constant ) );
+			return result;
+		}
+		case term::integer:
+		{
+			vm_operand	result = new_operand( vm_integer_kind );
+			constant.integer = int64_t( theTerm.value.integer );
+			emit( vm_op_load_constant, result.reg, mProgram.add_constant( constant ) );
+			return result;
+		}
+		case term::number:
+		{
+			vm_operand	result = new_operand( vm_number_kind );
+			constant.number = theTerm.value.number;
+			emit( vm_op_load_constant, result.reg, mProgram.add_constant( constant ) );
+			return result;
+		}
+		case term::variable:
+		{
+			uint32_t	slot = theTerm.slot;
+			if( slot >= mSourceFunction.variables.size() )
+				slot = uint32_t( mSourceFunction.variables.find( theTerm.func_name ) -mSourceFunction.variables.begin() );
+			if( slot >= mSourceFunction.variables.size() )
+				throw runtime_error( "Unknown variable \"" + theTerm.func_name.name() + "\" in " + mFunction.name + "." );
+			const type_handle&	varType = (mSourceFunction.variables.begin() +slot)->second.type;
+			return vm_operand{ mFirstLocal +slot, mProgram.kind_of( varType ), varType };
+		}
+		case term::parameter:
+			if( theTerm.func_name == atom_this )
+			{
+				if( !mClass )
+					throw runtime_error( "Used 'this' outside a method in " + mFunction.name + "." );
+				return vm_operand{ 0, vm_object_kind, mSource.classes.find( mClass->type_name )->second };
+			}
+			if( theTerm.slot >= mSourceFunction.param_types.size() )
+				throw runtime_error( "Unknown parameter \"" + theTerm.func_name.name() + "\" in " + mFunction.name + "." );
+			return vm_operand{ mFirstParameter +theTerm.slot, mProgram.kind_of( mSourceFunction.param_types[theTerm.slot].type ), mSourceFunction.param_types[theTerm.slot].type };
+		case term::global_variable:
+		{
+			auto	foundVar = mSource.variables.find( theTerm.func_name );
+			if( foundVar == mSource.variables.end() )
+				throw runtime_error( "Unknown global variable \"" + theTerm.func_name.name() + "\" in " + mFunction.name + "." );
+			vm_operand	result = new_operand( mProgram.kind_of( foundVar->second.type ), foundVar->second.type );
+			emit( vm_op_load_global, result.reg, uint32_t( foundVar -mSource.variables.begin() ) );
+			return result;
+		}
+		case term::field:
+			throw runtime_error( "Field \"" + theTerm.func_name.name() + "\" without an object in " + mFunction.name + "." );
+		case term::class_object:
+		{
+			vm_operand	result = new_operand( vm_object_kind );
+			auto		foundClass = mProgram.class_indices.find( theTerm.func_name );
+			if( foundClass == mProgram.class_indices.end() )
+				throw runtime_error( "The interpreter can't run code that uses struct " + theTerm.func_name.name() + " yet." );
+			constant.class_object = &mProgram.classes[foundClass->second];
+			emit( vm_op_load_constant, result.reg, mProgram.add_constant( constant ) );
+			return result;
+		}
+		case term::function_call:
+			break;
+	}
+	
+	term_index	firstParam = theTerm.first_parameter;
+	term_index	secondParam = (firstParam != no_term) ? terms[firstParam].next_parameter : no_term;
+	if( firstParam != no_term )
+	{
+		if( (theTerm.func_name == atom_dot || theTerm.func_name == atom_arrow) && secondParam != no_term )
+			return lower_member( firstParam, terms[secondParam] );
+		if( theTerm.func_name == atom_assign && secondParam != no_term )
+			return lower_assignment( firstParam, secondParam );
+		return lower_operator( theTerm );
+	}
+	
+	if( theTerm.func_name.empty() )	// Empty expression.
+		return new_operand( vm_integer_kind );
+	auto	foundFunction = mProgram.function_indices.find( theTerm.func_name );
+	if( foundFunction != mProgram.function_indices.end() )
+		return lower_call( vm_op_call, foundFunction->second, mSource.functions.find( theTerm.func_name )->second, nullptr );
+	if( mClass && mClass->method_slots.find( theTerm.func_name ) != mClass->method_slots.end() )
+		return lower_method_call( vm_operand{ 0, vm_object_kind, nullptr }, *mClass, theTerm.func_name, atom() );
+	throw runtime_error( "Can't call \"" + theTerm.func_name.name() + "\" from " + mFunction.name + ", it isn't defined." );
+}
+
+
+vm_operand	bytecode_lowerer::lower_member( term_index inReceiver, const term& inMember )
+{
+	vm_operand			receiver = lower_term( inReceiver );
+	const classdesc*	receiverClass = object_class( receiver.type );
+	if( !receiverClass )
+		throw runtime_error( "Can't find \"" + inMember.func_name.name() + "\" in " + mFunction.name + ", we don't know what kind of object it is in." );
+	if( receiverClass->method_slots.find( inMember.func_name ) != receiverClass->method_slots.end() )
+		return lower_method_call( receiver, *receiverClass, inMember.func_name, inMember.direct_class );
+	
+	uint32_t	fieldIndex = 0;
+	type_handle	fieldType;
+	if( !find_field( *receiverClass, inMember.func_name, fieldIndex, fieldType ) )
+		throw runtime_error( "Class " + receiverClass->type_name.name() + " has no field or method \"" + inMember.func_name.name() + "\"." );
+	vm_operand	result = new_operand( mProgram.kind_of( fieldType ), fieldType );
+	emit( vm_op_get_field, result.reg, receiver.reg, fieldIndex );
+	return result;
+}
+
+
+// Calls the implementation directly if call_resolver found the receiver's
+//	exact class, otherwise goes through the vtable:
+vm_operand	bytecode_lowerer::lower_method_call( const vm_operand& inReceiver, const classdesc& inClass, atom inMethod, atom inDirectClass )
+{
+	auto				foundSlot = inClass.method_slots.find( inMethod );
+	const funcdesc&		declaration = class_named( foundSlot->second.owner )->functions.find( inMethod )->second;
+	if( !inDirectClass.empty() )
+	{
+		const vm_class&	implementer = mProgram.classes[mProgram.class_indices.find( inDirectClass )->second];
+		return lower_call( vm_op_call, implementer.methods.find( inMethod )->second, declaration, &inReceiver );
+	}
+	return lower_call( vm_op_call_method, uint32_t( foundSlot -inClass.method_slots.begin() ), declaration, &inReceiver );
+}
+
+
+// The arguments go into consecutive registers after the receiver. The
+//	parser doesn't take any arguments yet, so those parameters are 0.
+vm_operand	bytecode_lowerer::lower_call( vm_opcode inOp, uint32_t inCallee, const functypedesc& inCalleeType, const vm_operand* inReceiver )
+{
+	bool		returnsVoid = inCalleeType.return_type->type_name == atom_void;
+	vm_operand	result = new_operand( returnsVoid ? vm_integer_kind : mProgram.kind_of( inCalleeType.return_type ), returnsVoid ? nullptr : inCalleeType.return_type );
+	uint32_t	firstArgument = mNextTemporary;
+	if( inReceiver )
+		emit( vm_op_move, new_operand( vm_object_kind ).reg, inReceiver->reg );
+	for( size_t x = 0; x < inCalleeType.param_types.size(); x++ )
+		emit( vm_op_load_constant, new_operand( vm_integer_kind ).reg, 0 );
+	emit( inOp, result.reg, inCallee, firstArgument );
+	return result;
+}
+
+
+vm_operand	bytecode_lowerer::lower_assignment( term_index inTarget, term_index inValue )
+{
+	const term_arena&	terms = mSourceFunction.terms;
+	const term&			target = terms[inTarget];
+	if( target.kind == term::variable || (target.kind == term::parameter && target.func_name != atom_this) )
+	{
+		vm_operand	variable = lower_term( inTarget );
+		vm_operand	value = converted( lower_term( inValue ), variable.kind );
+		emit( vm_op_move, variable.reg, value.reg );
+		return variable;
+	}
+	if( target.kind == term::global_variable )
+	{
+		auto		foundVar = mSource.variables.find( target.func_name );
+		if( foundVar == mSource.variables.end() )
+			throw runtime_error( "Unknown global variable \"" + target.func_name.name() + "\" in " + mFunction.name + "." );
+		vm_operand	value = converted( lower_term( inValue ), mProgram.kind_of( foundVar->second.type ) );
+		emit( vm_op_store_global, uint32_t( foundVar -mSource.variables.begin() ), value.reg );
+		return value;
+	}
+	
+	term_index	receiverTerm = target.first_parameter;
+	term_index	memberTerm = (receiverTerm != no_term) ? terms[receiverTerm].next_parameter : no_term;
+	if( target.kind == term::function_call && (target.func_name == atom_dot || target.func_name == atom_arrow) && memberTerm != no_term )
+	{
+		vm_operand			receiver = lower_term( receiverTerm );
+		const classdesc*	receiverClass = object_class( receiver.type );
+		uint32_t			fieldIndex = 0;
+		type_handle			fieldType;
+		if( receiverClass && find_field( *receiverClass, terms[memberTerm].func_name, fieldIndex, fieldType ) )
+		{
+			vm_operand	value = converted( lower_term( inValue ), mProgram.kind_of( fieldType ) );
+			emit( vm_op_set_field, receiver.reg, fieldIndex, value.reg );
+			return value;
+		}
+	}
+	throw runtime_error( "Can't assign to this in " + mFunction.name + "." );
+}
+
+
+struct vm_operator
+{
+	const char*	name;
+	vm_opcode	integer_op;
+	vm_opcode	number_op;		// Same as integer_op if it only works on integers.
+	bool		is_comparison;	// Result is an integer even for numbers.
+};
+
+
+static const vm_operator	sVMBinaryOperators[] =
+{
+	{ "+", vm_op_add, vm_op_add_number, false },
+	{ "-", vm_op_subtract, vm_op_subtract_number, false },
+	{ "*", vm_op_multiply, vm_op_multiply_number, false },
+	{ "/", vm_op_divide, vm_op_divide_number, false },
+	{ "%", vm_op_modulo, vm_op_modulo, false },
+	{ "<<", vm_op_shift_left, vm_op_shift_left, false },
+	{ ">>", vm_op_shift_right, vm_op_shift_right, false },
+	{ "==", vm_op_equal, vm_op_equal_number, true },
+	{ "!=", vm_op_not_equal, vm_op_not_equal_number, true },
+	{ "<", vm_op_less, vm_op_less_number, true },
+	{ ">", vm_op_greater, vm_op_greater_number, true },
+	{ "<=", vm_op_less_equal, vm_op_less_equal_number, true },
+	{ ">=", vm_op_greater_equal, vm_op_greater_equal_number, true },
+};
+
+
+vm_operand	bytecode_lowerer::lower_operator( const term& inTerm )
+{
+	const term_arena&	terms = mSourceFunction.terms;
+	const string&		name = inTerm.func_name.name();
+	term_index			firstParam = inTerm.first_parameter;
+	term_index			secondParam = terms[firstParam].next_parameter;
+	if( secondParam == no_term )
+	{
+		vm_operand	operand = lower_term( firstParam );
+		if( name == "+" )
+			return operand;
+		if( name == "!" )
+		{
+			vm_operand	result = new_operand( vm_integer_kind );
+			emit( vm_op_logical_not, result.reg, truth( operand ).reg );
+			return result;
+		}
+		if( name == "-" )
+		{
+			vm_operand	result = new_operand( operand.kind );
+			emit( (operand.kind == vm_number_kind) ? vm_op_negate_number : vm_op_negate, result.reg, operand.reg );
+			return result;
+		}
+		if( name == "~" )
+		{
+			vm_operand	result = new_operand( vm_integer_kind );
+			emit( vm_op_bit_not, result.reg, converted( operand, vm_integer_kind ).reg );
+			return result;
+		}
+		throw runtime_error( "The interpreter doesn't support the unary operator \"" + name + "\" yet." );
+	}
+	
+	if( name == "&&" || name == "||" )
+		return lower_logical( inTerm, name == "&&" );
+	
+	for( const vm_operator& currOperator : sVMBinaryOperators )
+	{
+		if( name != currOperator.name )
+			continue;
+		vm_operand	left = lower_term( firstParam );
+		vm_operand	right = lower_term( secondParam );
+		bool		isNumber = (left.kind == vm_number_kind || right.kind == vm_number_kind) && currOperator.number_op != currOperator.integer_op;
+		vm_kind		operandKind = isNumber ? vm_number_kind : vm_integer_kind;	// Objects and strings compare by address.
+		left = converted( left, operandKind );
+		right = converted( right, operandKind );
+		vm_operand	result = new_operand( currOperator.is_comparison ? vm_integer_kind : operandKind );
+		emit( isNumber ? currOperator.number_op : currOperator.integer_op, result.reg, left.reg, right.reg );
+		return result;
+	}
+	throw runtime_error( "The interpreter doesn't support the operator \"" + name + "\" yet." );
+}
+
+
+// Like C, only evaluates the right side if the left one doesn't decide:
+vm_operand	bytecode_lowerer::lower_logical( const term& inTerm, bool inIsAnd )
+{
+	const term_arena&	terms = mSourceFunction.terms;
+	vm_operand			result = new_operand( vm_integer_kind );
+	emit( vm_op_move, result.reg, truth( lower_term( inTerm.first_parameter ) ).reg );
+	size_t				jump = mFunction.code.size();
+	emit( inIsAnd ? vm_op_jump_if_zero : vm_op_jump_if_not_zero, result.reg );
+	emit( vm_op_move, result.reg, truth( lower_term( terms[inTerm.first_parameter].next_parameter ) ).reg );
+	mFunction.code[jump].b = uint32_t( mFunction.code.size() );
+	return result;
+}
+
+
+void	vm_program::load( const program& theProgram )
+{
+	the_program = &theProgram;
+	
+	vector<type_handle>	sortedClasses;	// Superclasses first.
+	for( const pair<atom,type_handle>& currClass : theProgram.classes )
+	{
+		if( !currClass.second->is_struct )
+			sortedClasses.push_back( currClass.second );
+	}
+	stable_sort( sortedClasses.begin(), sortedClasses.end(), []( const type_handle& a, const type_handle& b ){ return a->number_of_superclasses < b->number_of_superclasses; });
+	
+	// Number all functions first, so calls can refer to ones we haven't lowered yet:
+	for( const type_handle& currClassType : sortedClasses )
+	{
+		const classdesc&	currClass = static_cast<const classdesc&>(*currClassType);
+		class_indices[currClass.type_name] = uint32_t( classes.size() );
+		classes.emplace_back();
+		vm_class&			newClass = classes.back();
+		newClass.name = currClass.type_name;
+		auto				foundSuperclass = class_indices.find( currClass.superclass_name );
+		if( foundSuperclass != class_indices.end() )
+			newClass.superclass = &classes[foundSuperclass->second];
+		newClass.field_count = (newClass.superclass ? newClass.superclass->field_count : 0) +uint32_t( currClass.variables.size() );
+		for( const pair<atom,funcdesc>& currFunc : currClass.functions )
+		{
+			newClass.methods[currFunc.first] = uint32_t( functions.size() );
+			functions.emplace_back();
+			functions.back().name = currClass.type_name.name() + "." + currFunc.first.name();
+		}
+	}
+	for( const pair<atom,funcdesc>& currFunc : theProgram.functions )
+	{
+		function_indices[currFunc.first] = uint32_t( functions.size() );
+		functions.emplace_back();
+		functions.back().name = currFunc.first.name();
+	}
+	globals.assign( theProgram.variables.size(), vm_value() );
+	
+	for( const type_handle& currClassType : sortedClasses )
+	{
+		const classdesc&	currClass = static_cast<const classdesc&>(*currClassType);
+		vm_class&			theClass = classes[class_indices.find( currClass.type_name )->second];
+		for( const pair<atom,method_slot>& currSlot : currClass.method_slots )
+			theClass.vtable.push_back( classes[class_indices.find( currSlot.second.implementer )->second].methods.find( currSlot.first )->second );
+	
+		for( const pair<atom,funcdesc>& currFunc : currClass.functions )
+		{
+			vm_function&	newFunction = functions[theClass.methods.find( currFunc.first )->second];
+			if( currClass.type_name == atom_object && currFunc.first == atom("dealloc") )
+			{	// Built in, there's no source for it.
+				newFunction.parameter_count = newFunction.register_count = 1;
+				newFunction.code = { { vm_op_free_object, 0, 0, 0 }, { vm_op_return_void, 0, 0, 0 } };
+			}
+			else if( currFunc.second.is_pure_virtual || currFunc.second.skipped_body )
+			{
+				newFunction.parameter_count = newFunction.register_count = 1 +uint32_t( currFunc.second.param_types.size() );
+				string	reason = currFunc.second.is_pure_virtual ? " is pure virtual." : " wasn't parsed.";
+				newFunction.code = { { vm_op_fail, add_message( "Called " + newFunction.name + ", which" + reason ), 0, 0 } };
+			}
+			else
+				bytecode_lowerer( *this, &currClass, currFunc.second, newFunction ).lower();
+		}
+	}
+	for( const pair<atom,funcdesc>& currFunc : theProgram.functions )
+	{
+		vm_function&	newFunction = functions[function_indices.find( currFunc.first )->second];
+		if( currFunc.second.skipped_body )
+		{
+			newFunction.parameter_count = newFunction.register_count = uint32_t( currFunc.second.param_types.size() );
+			newFunction.code = { { vm_op_fail, add_message( "Called " + newFunction.name + ", which wasn't parsed." ), 0, 0 } };
+		}
+		else
+			bytecode_lowerer( *this, nullptr, currFunc.second, newFunction ).lower();
+	}
+}
+
+
+int	vm_program::run_main()
+{
+	auto	foundMain = function_indices.find( atom("main") );
+	if( foundMain == function_indices.end() || functions[foundMain->second].parameter_count != 0 )
+		throw runtime_error( "There is no main() function without parameters to run." );
+	const vm_function&	mainFunction = functions[foundMain->second];
+	vm_value			result = run( foundMain->second );
+	if( mainFunction.returns_void )
+		return EXIT_SUCCESS;
+	return (mainFunction.result_kind == vm_number_kind) ? int( result.number ) : int( result.integer );
+}
+
+
+// Threaded code: With GCC and clang, every handler jumps straight to the
+//	next instruction's handler through a table of label addresses, so the
+//	branch predictor gets to learn which instruction tends to follow which.
+//	Other compilers get a switch in a loop.
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO		1
+#define VM_HANDLER_ADDRESS( name )	&&vm_handler_##name,
+#define VM_LOOP_BEGIN()		VM_DISPATCH();
+#define VM_LOOP_END()
+#define VM_CASE( name )		vm_handler_##name:
+#define VM_DISPATCH()		goto *sHandlers[pc->op]
+#else
+#define VM_COMPUTED_GOTO		0
+#define VM_LOOP_BEGIN()		for( ;; ) { switch( pc->op ) {
+#define VM_LOOP_END()		default: throw runtime_error( "Invalid instruction." ); } }
+#define VM_CASE( name )		case vm_op_##name:
+#define VM_DISPATCH()		continue
+#endif
+#define VM_NEXT()			{ pc++; VM_DISPATCH(); }
+#define VM_BINARY( name, field, resultField, op )	VM_CASE( name ) regs[pc->a].resultField = regs[pc->b].field op regs[pc->c].field; VM_NEXT();
+#define VM_WRAPPING( name, op )	VM_CASE( name ) regs[pc->a].integer = int64_t( uint64_t(regs[pc->b].integer) op uint64_t(regs[pc->c].integer) ); VM_NEXT();
+
+
+struct vm_frame
+{
+	const vm_function*		function;
+	const vm_instruction*	call;		// Result goes into its register a.
+	size_t					base;
+};
+
+
+vm_value	vm_program::run( uint32_t inFunction )
+{
+#if VM_COMPUTED_GOTO
+	static const void* const	sHandlers[] = { VM_OPCODES( VM_HANDLER_ADDRESS ) };
+#endif
+	const vm_function*		function = &functions[inFunction];
+	vector<vm_value>		stack( max( vm_initial_stack_size, size_t( function->register_count ) ) );
+	vector<vm_frame>		frames;
+	size_t					base = 0;
+	vm_value*				regs = stack.data();
+	const vm_instruction*	pc = function->code.data();
+	const vm_value*			constantValues = constants.data();
+	const vm_function*		callee = nullptr;
+	vm_value				result;
+	
+	VM_LOOP_BEGIN()
+	VM_CASE( load_constant )
+		regs[pc->a] = constantValues[pc->b];
+		VM_NEXT();
+	VM_CASE( move )
+		regs[pc->a] = regs[pc->b];
+		VM_NEXT();
+	VM_CASE( load_global )
+		regs[pc->a] = globals[pc->b];
+		VM_NEXT();
+	VM_CASE( store_global )
+		globals[pc->a] = regs[pc->b];
+		VM_NEXT();
+	VM_CASE( get_field )
+		if( !regs[pc->b].object )
+			throw runtime_error( "Got a field of a null object in " + function->name + "." );
+		regs[pc->a] = regs[pc->b].object->fields[pc->c];
+		VM_NEXT();
+	VM_CASE( set_field )
+		if( !regs[pc->a].object )
+			throw runtime_error( "Set a field of a null object in " + function->name + "." );
+		regs[pc->a].object->fields[pc->b] = regs[pc->c];
+		VM_NEXT();
+	VM_CASE( new_object )
+	{
+		const vm_class&	theClass = classes[pc->b];
+		vm_object*		newObject = (vm_object*) calloc( 1, sizeof(vm_object) +theClass.field_count * sizeof(vm_value) );
+		if( !newObject )
+			throw bad_alloc();
+		newObject->isa = &theClass;
+		regs[pc->a].object = newObject;
+		VM_NEXT();
+	}
+	VM_CASE( free_object )
+		free( regs[pc->a].object );
+		VM_NEXT();
+	
+	VM_WRAPPING( add, + )
+	VM_WRAPPING( subtract, - )
+	VM_WRAPPING( multiply, * )
+	VM_CASE( divide )
+		if( regs[pc->c].integer == 0 )
+			throw runtime_error( "Division by zero in " + function->name + "." );
+		if( regs[pc->c].integer == -1 )	// INT64_MIN / -1 would trap, wrap around like VM_WRAPPING instead.
+			regs[pc->a].integer = int64_t( -uint64_t(regs[pc->b].integer) );
+		else
+			regs[pc->a].integer = regs[pc->b].integer / regs[pc->c].integer;
+		VM_NEXT();
+	VM_CASE( modulo )
+		if( regs[pc->c].integer == 0 )
+			throw runtime_error( "Division by zero in " + function->name + "." );
+		if( regs[pc->c].integer == -1 )	// INT64_MIN % -1 would trap.
+			regs[pc->a].integer = 0;
+		else
+			regs[pc->a].integer = regs[pc->b].integer % regs[pc->c].integer;
+		VM_NEXT();
+	VM_CASE( shift_left )
+		regs[pc->a].integer = int64_t( uint64_t(regs[pc->b].integer) << (regs[pc->c].integer & 63) );
+		VM_NEXT();
+	VM_CASE( shift_right )
+		regs[pc->a].integer = regs[pc->b].integer >> (regs[pc->c].integer & 63);
+		VM_NEXT();
+	VM_BINARY( equal, integer, integer, == )
+	VM_BINARY( not_equal, integer, integer, != )
+	VM_BINARY( less, integer, integer, < )
+	VM_BINARY( greater, integer, integer, > )
+	VM_BINARY( less_equal, integer, integer, <= )
+	VM_BINARY( greater_equal, integer, integer, >= )
+	
+	VM_BINARY( add_number, number, number, + )
+	VM_BINARY( subtract_number, number, number, - )
+	VM_BINARY( multiply_number, number, number, * )
+	VM_BINARY( divide_number, number, number, / )
+	VM_BINARY( equal_number, number, integer, == )
+	VM_BINARY( not_equal_number, number, integer, != )
+	VM_BINARY( less_number, number, integer, < )
+	VM_BINARY( greater_number, number, integer, > )
+	VM_BINARY( less_equal_number, number, integer, <= )
+	VM_BINARY( greater_equal_number, number, integer, >= )
+	
+	VM_CASE( negate )
+		regs[pc->a].integer = int64_t( -uint64_t(regs[pc->b].integer) );
+		VM_NEXT();
+	VM_CASE( negate_number )
+		regs[pc->a].number = -regs[pc->b].number;
+		VM_NEXT();
+	VM_CASE( bit_not )
+		regs[pc->a].integer = ~regs[pc->b].integer;
+		VM_NEXT();
+	VM_CASE( logical_not )
+		regs[pc->a].integer = !regs[pc->b].integer;
+		VM_NEXT();
+	VM_CASE( test )
+		regs[pc->a].integer = regs[pc->b].integer != 0;
+		VM_NEXT();
+	VM_CASE( integer_to_number )
+		regs[pc->a].number = double( regs[pc->b].integer );
+		VM_NEXT();
+	VM_CASE( number_to_integer )
+		// NaN fails both comparisons. 2^63 itself is already out of range.
+		if( !(regs[pc->b].number >= -9223372036854775808.0 && regs[pc->b].number < 9223372036854775808.0) )
+			throw runtime_error( "Number out of integer range in " + function->name + "." );
+		regs[pc->a].integer = int64_t( regs[pc->b].number );
+		VM_NEXT();
+	
+	VM_CASE( jump_if_zero )
+		if( regs[pc->a].integer == 0 )
+		{
+			pc = function->code.data() +pc->b;
+			VM_DISPATCH();
+		}
+		VM_NEXT();
+	VM_CASE( jump_if_not_zero )
+		if( regs[pc->a].integer != 0 )
+		{
+			pc = function->code.data() +pc->b;
+			VM_DISPATCH();
+		}
+		VM_NEXT();
+	
+	VM_CASE( call )
+		callee = &functions[pc->b];
+		goto enter_callee;
+	VM_CASE( call_method )
+		if( !regs[pc->c].object )
+			throw runtime_error( "Called a method of a null object in " + function->name + "." );
+		callee = &functions[regs[pc->c].object->isa->vtable[pc->b]];
+	enter_callee:
+	{
+		if( frames.size() >= vm_max_call_depth )
+			throw runtime_error( "Too many nested calls in " + callee->name + "." );
+		frames.push_back( vm_frame{ function, pc, base } );
+		size_t	calleeBase = base +function->register_count;	// Arguments are temporaries, so they're below that.
+		if( calleeBase +callee->register_count > stack.size() )
+			stack.resize( max( stack.size() * 2, calleeBase +callee->register_count ) );
+		vm_value*	arguments = stack.data() +base +pc->c;
+		base = calleeBase;
+		regs = stack.data() +base;
+		copy( arguments, arguments +callee->parameter_count, regs );
+		fill( regs +callee->parameter_count, regs +callee->register_count, vm_value() );
+		function = callee;
+		pc = function->code.data();
+		VM_DISPATCH();
+	}
+	VM_CASE( return_value )
+		result = regs[pc->a];
+		goto leave_function;
+	VM_CASE( return_void )
+		result = vm_value();
+	leave_function:
+		if( frames.empty() )
+			return result;
+		function = frames.back().function;
+		pc = frames.back().call;
+		base = frames.back().base;
+		frames.pop_back();
+		regs = stack.data() +base;
+		regs[pc->a] = result;
+		VM_NEXT();
+	VM_CASE( fail )
+		throw runtime_error( constantValues[pc->a].string );
+	VM_LOOP_END()
+}
+
+
+// AST cache:
+//	Reading a parsed program back is much faster than lexing and parsing it
+//	again, so with --cache we save it next to the source, keyed by a hash of
+//	the source text. The file is a header, a table of all names, one array
+//	of all terms laid out like term_arena keeps them, and a stream of 32-bit
+//	words describing variables, functions and types. Names, types and terms
+//	are referred to by their index in those tables, and every type that is
+//	shared in memory is written only once.
+
+const char		ast_cache_magic[8] = { 'M', 'U', 'S', 'H', 'A', 'S', 'T', 0 };
+const uint32_t	ast_cache_version = 4;	// Increase whenever the parser or this format changes.
+
+
+struct ast_cache_header
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	name_count;
+	uint64_t	source_hash;
+	uint64_t	source_size;
+	uint64_t	names_offset;	// name_count offset and length pairs, followed by the characters.
+	uint64_t	terms_offset;
+	uint64_t	term_count;
+	uint64_t	words_offset;
+	uint64_t	word_count;
+	uint32_t	type_count;
+	uint32_t	padding;
+	uint64_t	cache_hash;		// Of everything after the header, so we notice a damaged file.
+};
+
+
+// A term with its name as an index into the file's name table:
+struct cached_term
+{
+	uint8_t			kind;
+	uint32_t		slot;
+	uint32_t		name;
+	term_index		first_parameter;
+	term_index		next_parameter;
+	uint32_t		direct_class;	// Name index.
+	literal_value	value;
+};
+
+
+uint64_t	hash_bytes( const char* inData, size_t inSize )
+{
+	uint64_t	hash = 0xcbf29ce484222325ULL ^ inSize;
+	size_t		x = 0;
+	for( ; x +sizeof(uint64_t) <= inSize; x += sizeof(uint64_t) )
+	{
+		uint64_t	word;
+		memcpy( &word, inData +x, sizeof(word) );
+		hash = (hash ^ word) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	for( ; x < inSize; x++ )
+		hash = (hash ^ (uint8_t) inData[x]) * 0x100000001b3ULL;
+	return hash;
+}
+
+
+class ast_cache_writer
+{
+public:
+	ast_cache_writer() : mHasSkippedBodies(false) {}
+	
+	// Returns false if theProgram can't be cached or the file couldn't be written.
+	bool	write( const string& inCachePath, const source_buffer& inSource, const program& theProgram );
+	
+protected:
+	uint32_t	name_index( atom inName );
+	uint32_t	type_index( const type_handle& inType );
+	void		write_variables( const varcontainer& inContainer );
+	void		write_function_type( const functypedesc& inFunction );
+	void		write_function( const funcdesc& inFunction );
+	void		write_container( const varfunccontainer& inContainer );
+	void		write_type( const typedesc& inType );
+	
+	vector<atom>							mNames;
+	unordered_map<atom,uint32_t>			mNameIndexes;
+	vector<const typedesc*>					mTypes;
+	unordered_map<const typedesc*,uint32_t>	mTypeIndexes;
+	vector<cached_term>						mTerms;
+	vector<uint32_t>						mWords;
+	bool									mHasSkippedBodies;
+};
+
+
+uint32_t	ast_cache_writer::name_index( atom inName )
+{
+	auto	foundName = mNameIndexes.find( inName );
+	if( foundName != mNameIndexes.end() )
+		return foundName->second;
+	mNames.push_back( inName );
+	mNameIndexes[inName] = uint32_t( mNames.size() -1 );
+	return uint32_t( mNames.size() -1 );
+}
+
+
+uint32_t	ast_cache_writer::type_index( const type_handle& inType )
+{
+	auto	foundType = mTypeIndexes.find( inType.get() );
+	if( foundType != mTypeIndexes.end() )
+		return foundType->second;
+	mTypes.push_back( inType.get() );	// write() writes it once it's done with whatever refers to it.
+	mTypeIndexes[inType.get()] = uint32_t( mTypes.size() -1 );
+	return uint32_t( mTypes.size() -1 );
+}
+
+
+void	ast_cache_writer::write_variables( const varcontainer& inContainer )
+{
+	mWords.push_back( uint32_t( inContainer.variables.size() ) );
+	for( const pair<atom,vardesc>& currVar : inContainer.variables )
+	{
+		mWords.push_back( name_index( currVar.second.var_name ) );
+		mWords.push_back( type_index( currVar.second.type ) );
+		mWords.push_back( currVar.second.temperature );
+	}
+}
+
+
+void	ast_cache_writer::write_function_type( const functypedesc& inFunction )
+{
+	mWords.push_back( name_index( inFunction.func_name ) );
+	mWords.push_back( type_index( inFunction.return_type ) );
+	mWords.push_back( uint32_t( inFunction.param_types.size() ) );
+	for( const vardesc& currParam : inFunction.param_types )
+	{
+		mWords.push_back( name_index( currParam.var_name ) );
+		mWords.push_back( type_index( currParam.type ) );
+	}
+}
+
+
+void	ast_cache_writer::write_function( const funcdesc& inFunction )
+{
+	if( inFunction.skipped_body )
+		mHasSkippedBodies = true;
+	
+	write_function_type( inFunction );
+	mWords.push_back( (inFunction.is_pure_virtual ? 1 : 0) | (inFunction.is_override ? 2 : 0) );
+	write_variables( inFunction );
+	
+	mWords.push_back( uint32_t( mTerms.size() ) );
+	mWords.push_back( uint32_t( inFunction.terms.size() ) );
+	for( term_index x = 0; x < inFunction.terms.size(); x++ )
+	{
+		const term&	currTerm = inFunction.terms[x];
+		cached_term	cachedTerm;
+		memset( &cachedTerm, 0, sizeof(cachedTerm) );	// So padding doesn't make equal caches differ.
+		cachedTerm.kind = currTerm.kind;
+		cachedTerm.slot = currTerm.slot;
+		cachedTerm.name = name_index( currTerm.func_name );
+		cachedTerm.first_parameter = currTerm.first_parameter;
+		cachedTerm.next_parameter = currTerm.next_parameter;
+		cachedTerm.direct_class = name_index( currTerm.direct_class );
+		cachedTerm.value = currTerm.value;
+		mTerms.push_back( cachedTerm );
+	}
+	mWords.push_back( uint32_t( inFunction.commands.size() ) );
+	mWords.insert( mWords.end(), inFunction.commands.begin(), inFunction.commands.end() );
+}
+
+
+void	ast_cache_writer::write_container( const varfunccontainer& inContainer )
+{
+	write_variables( inContainer );
+	mWords.push_back( uint32_t( inContainer.function_types.size() ) );
+	for( const pair<atom,functypedesc>& currFunction : inContainer.function_types )
+		write_function_type( currFunction.second );
+	mWords.push_back( uint32_t( inContainer.functions.size() ) );
+	for( const pair<atom,funcdesc>& currFunction : inContainer.functions )
+		write_function( currFunction.second );
+}
+
+
+void	ast_cache_writer::write_type( const typedesc& inType )
+{
+	mWords.push_back( name_index( inType.type_name ) );
+	mWords.push_back( name_index( inType.union_name ) );
+	mWords.push_back( name_index( inType.superclass_name ) );
+	mWords.push_back( uint32_t( inType.number_of_superclasses ) );
+	mWords.push_back( inType.is_struct ? 1 : 0 );
+	mWords.push_back( uint32_t( inType.template_arguments.size() ) );
+	for( const type_handle& currArgument : inType.template_arguments )
+		mWords.push_back( type_index( currArgument ) );
+	mWords.push_back( uint32_t( inType.superclass_template_arguments.size() ) );
+	for( const type_handle& currArgument : inType.superclass_template_arguments )
+		mWords.push_back( type_index( currArgument ) );
+	write_container( inType );
+	
+	const classdesc*	theClass = dynamic_cast<const classdesc*>( &inType );
+	mWords.push_back( theClass ? uint32_t( theClass->method_slots.size() ) : 0 );
+	if( theClass )
+	{
+		for( const pair<atom,method_slot>& currSlot : theClass->method_slots )
+		{
+			mWords.push_back( name_index( currSlot.first ) );
+			mWords.push_back( name_index( currSlot.second.owner ) );
+			mWords.push_back( uint32_t( currSlot.second.owner_depth ) );
+			mWords.push_back( name_index( currSlot.second.implementer ) );
+			mWords.push_back( currSlot.second.is_overridden ? 1 : 0 );
+		}
+	}
+}
+
+
+bool	ast_cache_writer::write( const string& inCachePath, const source_buffer& inSource, const program& theProgram )
+{
+	name_index( atom() );	// So index 0 is the empty name.
+	
+	write_container( theProgram );
+	mWords.push_back( uint32_t( theProgram.types.size() ) );
+	for( const pair<atom,type_handle>& currType : theProgram.types )
+	{
+		mWords.push_back( name_index( currType.first ) );
+		mWords.push_back( type_index( currType.second ) );
+	}
+	mWords.push_back( uint32_t( theProgram.classes.size() ) );
+	for( const pair<atom,type_handle>& currClass : theProgram.classes )
+	{
+		mWords.push_back( name_index( currClass.first ) );
+		mWords.push_back( type_index( currClass.second ) );
+	}
+	for( size_t x = 0; x < mTypes.size(); x++ )	// Writing a type may add more.
+		write_type( *mTypes[x] );
+	
+	if( mHasSkippedBodies )
+		return false;
+	
+	vector<uint32_t>	nameRanges;
+	string				nameChars;
+	for( atom currName : mNames )
+	{
+		nameRanges.push_back( uint32_t( nameChars.size() ) );
+		nameRanges.push_back( uint32_t( currName.name().size() ) );
+		nameChars.append( currName.name() );
+	}
+	nameChars.resize( (nameChars.size() +7) & ~size_t(7) );	// Keep everything after it aligned.
+	
+	ast_cache_header	header = {};
+	memcpy( header.magic, ast_cache_magic, sizeof(header.magic) );
+	header.version = ast_cache_version;
+	header.name_count = uint32_t( mNames.size() );
+	header.source_hash = hash_bytes( inSource.data(), inSource.size() );
+	header.source_size = inSource.size();
+	header.names_offset = sizeof(header);
+	header.terms_offset = header.names_offset +nameRanges.size() * sizeof(uint32_t) +nameChars.size();
+	header.term_count = mTerms.size();
+	header.words_offset = header.terms_offset +mTerms.size() * sizeof(cached_term);
+	header.word_count = mWords.size();
+	header.type_count = uint32_t( mTypes.size() );
+	
+	string	contents;
+	contents.reserve( header.words_offset +mWords.size() * sizeof(uint32_t) -sizeof(header) );
+	contents.append( (const char*) nameRanges.data(), nameRanges.size() * sizeof(uint32_t) );
+	contents.append( nameChars );
+	contents.append( (const char*) mTerms.data(), mTerms.size() * sizeof(cached_term) );
+	contents.append( (const char*) mWords.data(), mWords.size() * sizeof(uint32_t) );
+	header.cache_hash = hash_bytes( contents.data(), contents.size() );
+	
+	// Write to a new file and move it in place, so a reader never sees half a cache:
+	string		tempPath = inCachePath + ".tmp";
+	ofstream	file( tempPath, ios::out | ios::binary | ios::trunc );
+	file.write( (const char*) &header, sizeof(header) );
+	file.write( contents.data(), contents.size() );
+	file.close();
+	if( !file || rename( tempPath.c_str(), inCachePath.c_str() ) != 0 )
+	{
+		remove( tempPath.c_str() );
+		return false;
+	}
+	return true;
+}
+
+
+class ast_cache_reader
+{
+public:
+	ast_cache_reader() : mTerms(nullptr), mTermCount(0), mWords(nullptr), mWordsEnd(nullptr) {}
+	
+	// Returns false without changing outProgram if there is no valid cache for inSource.
+	bool	read( const string& inCachePath, const source_buffer& inSource, program& outProgram );
+	
+protected:
+	uint32_t	next_word();
+	uint32_t	next_count( size_t inWordsPerEntry );
+	atom		next_name();
+	type_handle	next_type();
+	void		read_variables( varcontainer& outContainer );
+	void		read_function_type( functypedesc& outFunction );
+	void		read_function( funcdesc& outFunction );
+	void		read_container( varfunccontainer& outContainer );
+	void		read_type( classdesc& outType );
+	
+	vector<atom>		mNames;
+	vector<type_handle>	mTypes;
+	const cached_term*	mTerms;
+	size_t				mTermCount;
+	const uint32_t*		mWords;
+	const uint32_t*		mWordsEnd;
+};
+
+
+uint32_t	ast_cache_reader::next_word()
+{
+	if( mWords >= mWordsEnd )
+		throw runtime_error( "AST cache is truncated." );
+	return *mWords++;
+}
+
+
+uint32_t	ast_cache_reader::next_count( size_t inWordsPerEntry )
+{
+	uint32_t	count = next_word();
+	if( count * inWordsPerEntry > size_t(mWordsEnd -mWords) )	// Don't let a bad count make us allocate a lot.
+		throw runtime_error( "AST cache is truncated." );
+	return count;
+}
+
+
+atom	ast_cache_reader::next_name()
+{
+	uint32_t	index = next_word();
+	if( index >= mNames.size() )
+		throw runtime_error( "AST cache refers to a name that doesn't exist." );
+	return mNames[index];
+}
+
+
+type_handle	ast_cache_reader::next_type()
+{
+	uint32_t	index = next_word();
+	if( index >= mTypes.size() )
+		throw runtime_error( "AST cache refers to a type that doesn't exist." );
+	return mTypes[index];
+}
+
+
+void	ast_cache_reader::read_variables( varcontainer& outContainer )
+{
+	for( uint32_t x = next_count( 3 ); x > 0; x-- )
+	{
+		atom		varName = next_name();
+		type_handle	varType = next_type();
+		uint32_t	temperature = next_word();
+		if( temperature > vardesc::cold_field )
+			throw runtime_error( "AST cache contains an unknown field temperature." );
+		outContainer.variables[varName] = vardesc( varName, varType, vardesc::field_temperature( temperature ) );
+	}
+}
+
+
+void	ast_cache_reader::read_function_type( functypedesc& outFunction )
+{
+	outFunction.func_name = next_name();
+	outFunction.return_type = next_type();
+	uint32_t	paramCount = next_count( 2 );
+	outFunction.param_types.reserve( paramCount );
+	for( uint32_t x = 0; x < paramCount; x++ )
+	{
+		atom	paramName = next_name();
+		outFunction.param_types.push_back( vardesc( paramName, next_type() ) );
+	}
+}
+
+
+void	ast_cache_reader::read_function( funcdesc& outFunction )
+{
+	read_function_type( outFunction );
+	uint32_t	flags = next_word();
+	outFunction.is_pure_virtual = (flags & 1) != 0;
+	outFunction.is_override = (flags & 2) != 0;
+	read_variables( outFunction );
+	
+	size_t	firstTerm = next_word(), termCount = next_word();
+	if( firstTerm > mTermCount || termCount > mTermCount -firstTerm )
+		throw runtime_error( "AST cache refers to terms that don't exist." );
+	outFunction.terms.reserve( termCount );
+	for( const cached_term* currTerm = mTerms +firstTerm; currTerm != mTerms +firstTerm +termCount; currTerm++ )
+	{
+		if( currTerm->name >= mNames.size() || currTerm->direct_class >= mNames.size() || currTerm->kind > term::class_object
+			|| (currTerm->first_parameter >= termCount && currTerm->first_parameter != no_term)
+			|| (currTerm->next_parameter >= termCount && currTerm->next_parameter != no_term) )
+			throw runtime_error( "AST cache contains an invalid term." );
+		term&	newTerm = outFunction.terms[outFunction.terms.new_term( mNames[currTerm->name], term::term_type(currTerm->kind) )];
+		newTerm.slot = currTerm->slot;
+		newTerm.first_parameter = currTerm->first_parameter;
+		newTerm.next_parameter = currTerm->next_parameter;
+		newTerm.direct_class = mNames[currTerm->direct_class];
+		newTerm.value = currTerm->value;
+	}
+	
+	uint32_t	commandCount = next_count( 1 );
+	outFunction.commands.assign( mWords, mWords +commandCount );
+	mWords += commandCount;
+	for( term_index currCommand : outFunction.commands )
+	{
+		if( currCommand >= termCount )
+			throw runtime_error( "AST cache refers to terms that don't exist." );
+	}
+}
+
+
+void	ast_cache_reader::read_container( varfunccontainer& outContainer )
+{
+	read_variables( outContainer );
+	for( uint32_t x = next_count( 3 ); x > 0; x-- )
+	{
+		functypedesc	newFunction;
+		read_function_type( newFunction );
+		outContainer.function_types[newFunction.func_name] = std::move(newFunction);
+	}
+	for( uint32_t x = next_count( 3 ); x > 0; x-- )
+	{
+		funcdesc	newFunction;
+		read_function( newFunction );
+		outContainer.functions[newFunction.func_name] = std::move(newFunction);
+	}
+}
+
+
+void	ast_cache_reader::read_type( classdesc& outType )
+{
+	outType.type_name = next_name();
+	outType.union_name = next_name();
+	outType.superclass_name = next_name();
+	outType.number_of_superclasses = next_word();
+	outType.is_struct = next_word() != 0;
+	for( uint32_t x = next_count( 1 ); x > 0; x-- )
+		outType.template_arguments.push_back( next_type() );
+	for( uint32_t x = next_count( 1 ); x > 0; x-- )
+		outType.superclass_template_arguments.push_back( next_type() );
+	read_container( outType );
+	for( uint32_t x = next_count( 5 ); x > 0; x-- )
+	{
+		method_slot&	newSlot = outType.method_slots[next_name()];
+		newSlot.owner = next_name();
+		newSlot.owner_depth = next_word();
+		newSlot.implementer = next_name();
+		newSlot.is_overridden = next_word() != 0;
+	}
+}
+
+
+bool	ast_cache_reader::read( const string& inCachePath, const source_buffer& inSource, program& outProgram )
+{
+	try
+	{
+		source_buffer			cache( inCachePath );
+		const char*				cacheData = cache.data();
+		ast_cache_header		header;
+		if( cache.size() < sizeof(header) )
+			return false;
+		memcpy( &header, cacheData, sizeof(header) );
+		
+		if( memcmp( header.magic, ast_cache_magic, sizeof(header.magic) ) != 0 || header.version != ast_cache_version
+			|| header.source_size != inSource.size() || header.names_offset != sizeof(header)
+			|| header.terms_offset < header.names_offset +header.name_count * 2 * sizeof(uint32_t) || header.terms_offset % 8 != 0
+			|| header.term_count > (cache.size() -header.terms_offset) / sizeof(cached_term)
+			|| header.words_offset != header.terms_offset +header.term_count * sizeof(cached_term)
+			|| header.word_count != (cache.size() -header.words_offset) / sizeof(uint32_t) )
+			return false;
+		if( header.source_hash != hash_bytes( inSource.data(), inSource.size() )
+			|| header.cache_hash != hash_bytes( cacheData +sizeof(header), cache.size() -sizeof(header) ) )
+			return false;
+		
+		const uint32_t*	nameRanges = (const uint32_t*) (cacheData +header.names_offset);
+		const char*		nameChars = (const char*) (nameRanges +2 * header.name_count);
+		size_t			nameCharCount = (cacheData +header.terms_offset) -nameChars;
+		mNames.reserve( header.name_count );
+		for( uint32_t x = 0; x < header.name_count; x++ )
+		{
+			if( nameRanges[x * 2] > nameCharCount || nameRanges[x * 2 +1] > nameCharCount -nameRanges[x * 2] )
+				return false;
+			string_view	currName( nameChars +nameRanges[x * 2], nameRanges[x * 2 +1] );
+			mNames.push_back( currName.empty() ? atom() : atom( currName ) );	// atom("") isn't the empty atom.
+		}
+		
+		mTerms = (const cached_term*) (cacheData +header.terms_offset);
+		mTermCount = header.term_count;
+		mWords = (const uint32_t*) (cacheData +header.words_offset);
+		mWordsEnd = mWords +header.word_count;
+		
+		// Types may refer to each other in any order, so make them all first:
+		if( header.type_count > header.word_count )
+			return false;
+		for( uint32_t x = 0; x < header.type_count; x++ )
+			mTypes.push_back( make_shared<classdesc>() );
+		
+		program	newProgram;
+		newProgram.types = atom_map<type_handle>();
+		newProgram.classes = atom_map<type_handle>();
+		newProgram.functions = atom_map<funcdesc>();
+		read_container( newProgram );
+		for( uint32_t x = next_count( 2 ); x > 0; x-- )
+		{
+			atom	typeName = next_name();
+			newProgram.types[typeName] = next_type();
+		}
+		for( uint32_t x = next_count( 2 ); x > 0; x-- )
+		{
+			atom	className = next_name();
+			newProgram.classes[className] = next_type();
+		}
+		for( type_handle& currType : mTypes )
+			read_type( static_cast<classdesc&>(*currType) );	// We made them all as classdescs above.
+		if( mWords != mWordsEnd )
+			return false;
+		
+		outProgram = std::move(newProgram);
+		return true;
+	}
+	catch( const exception& )
+	{
+		return false;	// No cache, or a broken one. We'll just parse.
+	}
+}
+
+
+// Watch mode:
+//	Keeps the tokens and the parsed program of a file around between saves.
+//	After an edit, only the edited range is lexed again, and only the
+//	top-level constructs it touches are parsed again, plus any later ones
+//	that looked up a type or global variable those declare. Whenever that
+//	can't give exactly the same result as compiling the whole file (e.g. a
+//	construct was added, renamed or now sees different declarations), we
+//	fall back to compiling everything.
+
+class watch_session
+{
+public:
+	explicit watch_session( const string& inFilePath ) : mFilePath(inFilePath), mThreadCount(max( thread::hardware_concurrency(), 1U )), mCompiled(false), mParsedOK(false), mTokensLexed(0), mConstructsParsed(0) {}
+	
+	void	update();	// Compile the file again if it changed, and print the output.
+	
+protected:
+	struct construct	// One class, struct, global variable or function.
+	{
+		size_t	first_token;
+		atom	name;		// What it declares.
+		bool	is_visible;	// Declares a type or a global variable, which later constructs may look up.
+	};
+	
+	struct declaration
+	{
+		uint32_t	first;	// Index of the first construct declaring it +1, 0 for built-ins.
+		uint32_t	count;
+	};
+	
+	void	compile_all();
+	bool	compile_edit( const string& inNewText );
+	bool	reparse_construct( size_t inIndex, vector<token>::iterator& ioCurrToken );
+	bool	sees_same_declarations( size_t inIndex, size_t inFirstToken, size_t inEndToken ) const;
+	void	note_references( size_t inIndex, size_t inFirstToken, size_t inEndToken );
+	size_t	end_token( size_t inIndex ) const	{ return (inIndex +1 < mConstructs.size()) ? mConstructs[inIndex +1].first_token : mTokens.size(); }
+	size_t	number_of_declarations() const;
+	
+	string									mFilePath;
+	size_t									mThreadCount;	// For validate_classes() and generate_classes().
+	string									mText;		// Tokens point into this.
+	vector<token>							mTokens;
+	program									mProgram;
+	vector<construct>						mConstructs;
+	unordered_map<atom,declaration>			mDeclarations;
+	unordered_map<atom,vector<uint32_t>>	mReferencedBy;	// Constructs that use an identifier. May contain stale entries.
+	bool									mCompiled;
+	bool									mParsedOK;
+	size_t									mTokensLexed;		// Statistics for the last update.
+	size_t									mConstructsParsed;
+};
+
+
+void	watch_session::update()
+{
+	string	newText;
+	try
+	{
+		source_buffer	source( mFilePath );
+		newText.assign( source.data(), source.size() );
+	}
+	catch( const exception& err )
+	{
+		cout << err.what() << endl;
+		return;
+	}
+	
+	if( mCompiled && newText == mText )
+		return;
+	
+	auto	startTime = chrono::steady_clock::now(), compiledTime = startTime;
+	bool	wasIncremental = false;
+	try
+	{
+		if( mParsedOK )
+		{
+			try
+			{
+				wasIncremental = compile_edit( newText );
+			}
+			catch( const exception& )
+			{
+				// Compile everything below, so errors are reported just like without watch mode.
+			}
+		}
+		if( !wasIncremental )
+		{
+			mText = std::move( newText );
+			compile_all();
+		}
+		
+		compiledTime = chrono::steady_clock::now();
+		code_emitter	emitter( mThreadCount );
+		generate_classes( mProgram, emitter );
+		emitter.write( cout );
+	}
+	catch( const parse_error& err )
+	{
+		cout << mFilePath << ":" << err.line << ":" << err.offset << ":" << err.what() << endl;
+	}
+	catch( const exception& err )
+	{
+		cout << err.what() << endl;
 	}
-	else
-		PE_ERROR( "Expected term here, found " << PE_TOKEN_NAME );
 	
-	return result;
+	if( compiledTime == startTime )
+		compiledTime = chrono::steady_clock::now();
+	chrono::duration<double,milli>	compileDuration = compiledTime -startTime, outputDuration = chrono::steady_clock::now() -compiledTime;
+	cerr << "Compiled " << mFilePath << (wasIncremental ? " incrementally" : "") << ": lexed " << mTokensLexed << " of " << mTokens.size()
+		<< " tokens, parsed " << mConstructsParsed << " of " << mConstructs.size() << " constructs in " << compileDuration.count()
+		<< " ms, output took " << outputDuration.count() << " ms." << endl;
 }
 
 
-string	parse_longest_binary_operator_name( vector<token>& tokens, vector<token>::iterator& currToken, program& theProgram )
+void	watch_session::compile_all()
 {
-	string						opName;
-	string						prevOpName;
-	vector<token>::iterator		prevToken = currToken;
+	mCompiled = true;
+	mParsedOK = false;
+	mProgram = program();
+	mConstructs.clear();
+	mDeclarations.clear();
+	mReferencedBy.clear();
 	
-	while( true )
+	mText.reserve( mText.size() +mText.size() / 8 +4096 );	// Room to grow, so most edits don't move the text our tokens point to.
+	mTokens = tokenize( mText.data(), mText.data() +mText.size() );
+	mTokensLexed = mTokens.size();
+	mConstructsParsed = 0;
+	
+	for( const auto& currType : mProgram.types )
+		mDeclarations[currType.first] = declaration{ 0, 1 };
+	for( const auto& currClass : mProgram.classes )
+		mDeclarations[currClass.first] = declaration{ 0, 1 };
+	
+	parse_and_validate( mProgram, mThreadCount, [&]()
 	{
-		if( currToken == tokens.end() || currToken->kind != token::operator_identifier )
-			break;
-
-		opName.append( currToken->text );
-		currToken++;
-		if( theProgram.binary_operator_priorities.find(opName) != theProgram.binary_operator_priorities.end() )
+		vector<token>::iterator	currToken = mTokens.begin();
+		while( currToken != mTokens.end() )
 		{
-			prevOpName = opName;
-			prevToken = currToken;
+			construct	newConstruct;
+			newConstruct.first_token = currToken -mTokens.begin();
+			newConstruct.name = parse_top_level_construct( mTokens, currToken, mProgram );
+			newConstruct.is_visible = mProgram.types.find( newConstruct.name ) != mProgram.types.end()
+										|| mProgram.variables.find( newConstruct.name ) != mProgram.variables.end();
+			mConstructs.push_back( newConstruct );
+			mConstructsParsed++;
+			
+			auto	foundDeclaration = mDeclarations.find( newConstruct.name );
+			if( foundDeclaration == mDeclarations.end() )
+				mDeclarations[newConstruct.name] = declaration{ (uint32_t) mConstructs.size(), 1 };
+			else
+				foundDeclaration->second.count++;
+			note_references( mConstructs.size() -1, newConstruct.first_token, currToken -mTokens.begin() );
 		}
-	}
+	});
 	
-	currToken = prevToken;
-	return prevOpName;
+	mParsedOK = true;
 }
 
 
-term	parse_expression( vector<token>& tokens, vector<token>::iterator& currToken, program& theProgram, classdesc& currClass, funcdesc& currFunction )
+// Returns false if the edit can't be compiled on its own. mText, mTokens
+//	and mProgram may have been changed by then, so compile everything again.
+bool	watch_session::compile_edit( const string& inNewText )
 {
-	term		result;
-	if( currToken == tokens.end() )
-		return result;
-	
-	term	argOne = parse_term( tokens, currToken, theProgram, currClass, currFunction );
-	if( currToken == tokens.end() )
-		return argOne;
+	// Find the edited range:
+	size_t	oldLength = mText.size(), newLength = inNewText.size();
+	size_t	commonLength = min( oldLength, newLength );
+	size_t	prefixLength = mismatch( mText.begin(), mText.begin() +commonLength, inNewText.begin() ).first -mText.begin();
+	size_t	suffixLength = 0;
+	while( suffixLength < commonLength -prefixLength && mText[oldLength -1 -suffixLength] == inNewText[newLength -1 -suffixLength] )
+		suffixLength++;
+	size_t		oldEditEnd = oldLength -suffixLength, newEditEnd = newLength -suffixLength;
+	ptrdiff_t	offsetDelta = (ptrdiff_t)newLength -(ptrdiff_t)oldLength;
 	
-	string		opName;
-	size_t		currPriority;
+	// Tokens before the construct containing the last token that starts before
+	//	the edit can't change, so start lexing again at its first token. That's
+	//	an identifier, so we know the lexer state there without having saved it.
+	auto	firstChangedToken = lower_bound( mTokens.begin(), mTokens.end(), prefixLength, []( const token& a, size_t b ){ return a.offset < b; } );
+	if( firstChangedToken == mTokens.begin() )
+		return false;
+	size_t	lastUnchangedToken = (firstChangedToken -mTokens.begin()) -1;
+	size_t	firstConstruct = (upper_bound( mConstructs.begin(), mConstructs.end(), lastUnchangedToken, []( size_t a, const construct& b ){ return a < b.first_token; } ) -mConstructs.begin()) -1;
+	size_t	restartIndex = mConstructs[firstConstruct].first_token;
+	token	restartToken = mTokens[restartIndex];
+	if( restartToken.kind != token::identifier )
+		return false;
 	
-	// Set up a "fake" operator to start with so loop below can treat it
-	//	just like any other operator to its left. This operator is lowest
-	//	priority, meaning all other
-	result.func_name = "__dummy_operator";	// Absolute lowest priority.
-	result.kind = term::function_call;
-	result.parameters.push_back( term() );
-	result.parameters.push_back( argOne );
+	const char*	oldText = mText.data();
+	mText.replace( prefixLength, oldEditEnd -prefixLength, inNewText, prefixLength, newEditEnd -prefixLength );
+	if( mText.data() != oldText )
+	{
+		for( size_t x = 0; x < restartIndex; x++ )
+			mTokens[x].text = string_view( mText.data() +mTokens[x].offset, mTokens[x].text.length() );
+	}
 	
-	term*	rightmost = &result;
-
-	while( true )
+	// Lex until we're past the edit and produce an identifier that starts
+	//	where an old one did. From there on, the old tokens are still valid.
+	info		lexer( mText.data(), mText.data() +mText.size() );
+	size_t		resyncIndex = mTokens.size();	// Old index of the first token after the edit we can keep.
+	ptrdiff_t	lineDelta = 0;
+	size_t		checkedTokens = 0;
+	bool		resynced = false;
+	lexer.curr = lexer.start +restartToken.offset;
+	lexer.lineNumber = restartToken.lineNumber;
+	while( !resynced && lex_next_char( lexer ) )
 	{
-		opName = parse_longest_binary_operator_name( tokens, currToken, theProgram );
-		if( opName.length() == 0 )
-			break;
-		currPriority = priority_for_binary_operator( theProgram, opName );
-		size_t	prevPriority = priority_for_binary_operator( theProgram, rightmost->func_name );
-		if( currPriority > prevPriority )
-		{
-			term	currOp( opName );
-			currOp.kind = term::function_call;
-			currOp.parameters.push_back( rightmost->parameters[1] );
-			if( opName == "." || opName == "->" )
-			{
-				if( currToken == tokens.end() || currToken->kind != token::identifier )
-					PE_ERROR("Expected field name after '" << opName << "', found " << PE_TOKEN_NAME);
-				currOp.parameters.push_back( term(currToken->text) );
-				currOp.parameters[1].kind = term::field;
-				currToken++;
-			}
-			else
-			{
-				currOp.parameters.push_back( parse_term( tokens, currToken, theProgram, currClass, currFunction ) );
-			}
-			rightmost->parameters[1] = currOp;
-			rightmost = &rightmost->parameters[1];
-		}
-		else
+		for( ; checkedTokens < lexer.tokens.size() && !resynced; checkedTokens++ )
 		{
-			term	currOp( opName );
-			currOp.kind = term::function_call;
-			currOp.parameters.push_back( *rightmost );
-			if( opName == "." || opName == "->" )
-			{
-				if( currToken == tokens.end() || currToken->kind != token::identifier )
-					PE_ERROR("Expected field name after '" << opName << "', found " << PE_TOKEN_NAME);
-				currOp.parameters.push_back( term(currToken->text) );
-				currOp.parameters[1].kind = term::field;
-				currToken++;
-			}
-			else
+			const token&	newToken = lexer.tokens[checkedTokens];
+			if( newToken.offset < newEditEnd || newToken.kind != token::identifier )
+				continue;
+			
+			size_t	oldOffset = newToken.offset -offsetDelta;
+			auto	oldToken = lower_bound( mTokens.begin() +restartIndex, mTokens.end(), oldOffset, []( const token& a, size_t b ){ return a.offset < b; } );
+			if( oldToken != mTokens.end() && oldToken->offset == oldOffset && oldToken->kind == token::identifier )
 			{
-				currOp.parameters.push_back( parse_term( tokens, currToken, theProgram, currClass, currFunction ) );
+				resyncIndex = oldToken -mTokens.begin();
+				lineDelta = (ptrdiff_t)newToken.lineNumber -(ptrdiff_t)oldToken->lineNumber;
+				lexer.tokens.resize( checkedTokens );
+				resynced = true;
 			}
-			*rightmost = currOp;
-			rightmost = &rightmost->parameters[1];
 		}
 	}
+	if( !resynced )
+		finish_token( lexer );
+	mTokensLexed = lexer.tokens.size();
 	
-	return result.parameters[1];	// *always* __dummy_operator's right argument, as that has lowest priority.
-}
-
-
-void	parse_function_body( vector<token>& tokens, vector<token>::iterator& currToken, program& theProgram, classdesc& currClass, funcdesc& currFunction )
-{
-	while( true )
+	// Splice the new tokens in and move the ones after them:
+	size_t		lastConstruct = lower_bound( mConstructs.begin() +firstConstruct, mConstructs.end(), resyncIndex, []( const construct& a, size_t b ){ return a.first_token < b; } ) -mConstructs.begin();
+	ptrdiff_t	tokenDelta = (ptrdiff_t)lexer.tokens.size() -(ptrdiff_t)(resyncIndex -restartIndex);
+	for( size_t x = resyncIndex; x < mTokens.size(); x++ )
 	{
-		if( currToken == tokens.end() || (currToken->kind == token::operator_identifier && currToken->text.compare("}") == 0 ) )
-			break;
-		
-		if( currToken->kind == token::identifier && currToken->text.compare("return") == 0 )
-		{
-			currToken++;
-			
-			term	currCommand( "return" );
-			term	expr = parse_expression( tokens, currToken, theProgram, currClass, currFunction );
-			currCommand.parameters.push_back( expr );
-			currFunction.commands.push_back( currCommand );
-		}
-		else
+		token&	currToken = mTokens[x];
+		currToken.offset += offsetDelta;
+		currToken.lineNumber += lineDelta;
+		currToken.text = string_view( mText.data() +currToken.offset, currToken.text.length() );
+	}
+	mTokens.erase( mTokens.begin() +restartIndex, mTokens.begin() +resyncIndex );
+	mTokens.insert( mTokens.begin() +restartIndex, lexer.tokens.begin(), lexer.tokens.end() );
+	for( size_t x = lastConstruct; x < mConstructs.size(); x++ )
+		mConstructs[x].first_token += tokenDelta;
+	
+	// Parse the edited constructs again. They have to declare the same
+	//	things as before and end where the next unchanged one starts:
+	size_t			declarationCount = number_of_declarations();
+	vector<uint32_t>	dependents;	// Min-heap of constructs to parse again because they may have seen a changed declaration.
+	auto			reparse = [&]( size_t inIndex, vector<token>::iterator& ioCurrToken )
+	{
+		if( !reparse_construct( inIndex, ioCurrToken ) )
+			return false;
+		if( mConstructs[inIndex].is_visible )
 		{
-			typedesc	theType = parse_type( tokens, currToken, theProgram );
-			string		varName = "";
-			if( theType.type_name != "" )
+			for( uint32_t currReference : mReferencedBy[mConstructs[inIndex].name] )
 			{
-				if( currToken == tokens.end() || currToken->kind != token::identifier )
-					PE_ERROR( "Expected identifier for variable name here, found " << PE_TOKEN_NAME );
-				varName = currToken->text;
-				
-				currToken++;
-				
-				if( currToken == tokens.end() || currToken->kind != token::operator_identifier )
-					PE_ERROR( "Expected ';' or '=' here, found " << PE_TOKEN_NAME );
-				
-				currFunction.variables[varName] = vardesc(varName,theType);
-				if( currToken->text == ";" )
+				if( currReference >= lastConstruct && currReference != inIndex )
 				{
-					currToken++;
-				
-					if( !theType.is_struct )
-					{
-						term	assignmentStmt(".");
-						assignmentStmt.parameters.push_back( term(varName) );
-						assignmentStmt.parameters[0].kind = term::variable;
-						term	funcCall("init");
-						assignmentStmt.parameters.push_back( funcCall );
-						currFunction.commands.push_back( assignmentStmt );
-					}
-					continue;
+					dependents.push_back( currReference );
+					push_heap( dependents.begin(), dependents.end(), greater<uint32_t>() );
 				}
-				if( currToken->text != "=" )
-					PE_ERROR( "Expected ';' or '=' here, found " << PE_TOKEN_NAME );
-				currToken++;
-			}
-			term	expr = parse_expression( tokens, currToken, theProgram, currClass, currFunction );
-			if( varName.length() != 0 )
-			{
-				term	assignmentStmt("=");
-				assignmentStmt.parameters.push_back( term(varName) );
-				assignmentStmt.parameters[0].kind = term::variable;
-				assignmentStmt.parameters.push_back( expr );
-				currFunction.commands.push_back( assignmentStmt );
 			}
-			else
-				currFunction.commands.push_back( expr );
 		}
+		return true;
+	};
+	
+	vector<token>::iterator	currToken = mTokens.begin() +restartIndex;
+	mConstructsParsed = 0;
+	for( size_t x = firstConstruct; x < lastConstruct; x++ )
+	{
+		mConstructs[x].first_token = currToken -mTokens.begin();
+		if( currToken == mTokens.end() || !reparse( x, currToken ) )
+			return false;
+	}
+	if( (size_t)(currToken -mTokens.begin()) != ((lastConstruct < mConstructs.size()) ? mConstructs[lastConstruct].first_token : mTokens.size()) )
+		return false;
+	
+	size_t	lastReparsed = SIZE_MAX;
+	while( !dependents.empty() )
+	{
+		pop_heap( dependents.begin(), dependents.end(), greater<uint32_t>() );
+		size_t	currIndex = dependents.back();
+		dependents.pop_back();
+		if( currIndex == lastReparsed )
+			continue;
+		lastReparsed = currIndex;
 		
-		if( currToken->kind != token::operator_identifier || currToken->text != ";" )
-			PE_ERROR( "Expected ';' here, found " << PE_TOKEN_NAME );
-		
-		currToken++;
+		currToken = mTokens.begin() +mConstructs[currIndex].first_token;
+		if( !reparse( currIndex, currToken ) || (size_t)(currToken -mTokens.begin()) != end_token( currIndex ) )
+			return false;
 	}
+	
+	if( number_of_declarations() != declarationCount )
+		return false;
+	validate_classes( mProgram, mThreadCount );	// On an error, we compile everything again to report it.
+	devirtualize_calls( mProgram, mThreadCount );
+	return true;
 }
 
 
-void	validate_class( program& theProgram, classdesc& newClass )
+// Parse the construct at inIndex again in place, starting at ioCurrToken.
+//	Returns false if it now declares something else.
+bool	watch_session::reparse_construct( size_t inIndex, vector<token>::iterator& ioCurrToken )
 {
-	classdesc	superclass;
-	bool		hasSuperClass = (newClass.superclass_name.length() > 0);
-	if( hasSuperClass )
-	{
-		map<string,classdesc>::iterator foundSuperclass = theProgram.classes.find( newClass.superclass_name );
-		if( foundSuperclass == theProgram.classes.end() )
-		{
-			parse_error err;
-			err.err_msg << "Class '" << newClass.type_name << "' has unknown superclass '" << newClass.superclass_name << "'";
-			throw err;
-		}
-		
-		if( foundSuperclass->second.number_of_superclasses == 0 && foundSuperclass->second.superclass_name.size() > 0 )
-			validate_class( theProgram, foundSuperclass->second );
-		superclass = foundSuperclass->second;
-		
-		newClass.number_of_superclasses = superclass.number_of_superclasses +1;
-	}
+	construct&	currConstruct = mConstructs[inIndex];
+	size_t		firstToken = ioCurrToken -mTokens.begin();
+	
+	mProgram.types.hide( currConstruct.name );
+	mProgram.classes.hide( currConstruct.name );
+	mProgram.variables.hide( currConstruct.name );
+	mProgram.function_types.hide( currConstruct.name );
+	mProgram.functions.hide( currConstruct.name );
+	
+	atom	name = parse_top_level_construct( mTokens, ioCurrToken, mProgram );
+	mConstructsParsed++;
+	if( name != currConstruct.name
+		|| mProgram.types.has_hidden() || mProgram.classes.has_hidden() || mProgram.variables.has_hidden()
+		|| mProgram.function_types.has_hidden() || mProgram.functions.has_hidden() )
+		return false;
+	
+	size_t	endToken = ioCurrToken -mTokens.begin();
+	bool	isVisible = mProgram.types.find( name ) != mProgram.types.end() || mProgram.variables.find( name ) != mProgram.variables.end();
+	if( isVisible != currConstruct.is_visible || !sees_same_declarations( inIndex, firstToken, endToken ) )
+		return false;
+	
+	note_references( inIndex, firstToken, endToken );
+	return true;
+}
 
-	for( auto currMethod : newClass.functions )
+
+// When we parse a construct again while all the others are already in
+//	mProgram, it only sees the same declarations it did when compiling the
+//	whole file if nothing it uses is declared after it, or more than once.
+bool	watch_session::sees_same_declarations( size_t inIndex, size_t inFirstToken, size_t inEndToken ) const
+{
+	for( size_t x = inFirstToken; x < inEndToken; x++ )
 	{
-		if( hasSuperClass )
-		{
-			string		className;
-			funcdesc	originalFunction = superclass.find_function( theProgram, currMethod.second.func_name, className );
-			bool		foundOriginal = (originalFunction.func_name == currMethod.second.func_name);
-			if( !foundOriginal && currMethod.second.is_override )
-			{
-				parse_error err;
-				err.err_msg << newClass.type_name << "::" << currMethod.second.func_name << " is declared as an override, but there is no method to override in its superclasses.";
-				throw err;
-			}
-			if( foundOriginal && !currMethod.second.is_override )
-			{
-				parse_error err;
-				err.err_msg << newClass.type_name << "::" << currMethod.second.func_name << " hides method inherited from " << className << ". Did you mean to mark it as 'override'?";
-				throw err;
-			}
-			
-			if( foundOriginal )
-			{
-				const vector<vardesc>&			foundFuncParams = originalFunction.param_types;
-				vector<vardesc>::const_iterator	currFoundParam = foundFuncParams.begin();
-				for( auto currParam : currMethod.second.param_types )
-				{
-					if( currFoundParam == foundFuncParams.end() )
-					{
-						parse_error err;
-						err.err_msg << newClass.type_name << "::" << originalFunction.func_name << "'s parameter count doesn't match the one defined in " << className;
-						throw err;
-					}
-					
-					if( currParam.type_name != currFoundParam->type_name )
-					{
-						parse_error err;
-						err.err_msg << newClass.type_name << "::" << originalFunction.func_name << "'s parameters don't match the one defined in " << className << ". Expected an " << currFoundParam->type_name << ", found a " << currParam.type_name;
-						throw err;
-					}
-					
-					currFoundParam++;
-				}
-			}
-		}
-		else
-		{
-			if( currMethod.second.is_override )
-			{
-				parse_error err;
-				err.err_msg << newClass.type_name << "::" << currMethod.second.func_name << " is declared as an override, but there is no base class.";
-				throw err;
-			}
-		}
+		if( mTokens[x].kind != token::identifier )
+			continue;
+		auto	foundDeclaration = mDeclarations.find( mTokens[x].name );
+		if( foundDeclaration != mDeclarations.end()
+			&& (foundDeclaration->second.count > 1 || foundDeclaration->second.first > inIndex +1) )
+			return false;
 	}
+	return true;
 }
 
 
-void	parse_top_level_construct( vector<token>& tokens, vector<token>::iterator& currToken, program& theProgram )
+void	watch_session::note_references( size_t inIndex, size_t inFirstToken, size_t inEndToken )
 {
-	if( currToken->kind == token::identifier && (currToken->text.compare("class") == 0
-												|| currToken->text.compare("struct") == 0) )
+	for( size_t x = inFirstToken; x < inEndToken; x++ )
 	{
-		bool	isStruct = currToken->text.compare("struct") == 0;
-		
-		currToken++;
-		
-		if( currToken->kind != token::identifier )
-			PE_ERROR( "Expected identifier after 'class', found " << PE_TOKEN_NAME );
-		
-		string		className = currToken->text;
-		string		baseClassName = "object";
-		string		unionName = "";
-		bool		mayBeDeclaration = true;
-		bool		isDeclaration = false;
-		
-		currToken++;
-		
-		if( !isStruct && currToken->kind == token::operator_identifier && currToken->text.compare(":") == 0 )
-		{
-			currToken++;
-			
-			if( currToken->kind != token::identifier )
-				PE_ERROR( "Expected base class name after ':', found " << PE_TOKEN_NAME );
-			
-			baseClassName = currToken->text;
-			
-			currToken++;
-			
-			mayBeDeclaration = false;
-		}
-		if( !isStruct && currToken->kind == token::identifier && currToken->text.compare("@union") == 0 )
-		{
-			currToken++;
-			
-			if( currToken->kind != token::identifier )
-				PE_ERROR( "Expected identifier after '@union', found " << PE_TOKEN_NAME );
-			
-			unionName = currToken->text;
-			
-			currToken++;
-			
-			mayBeDeclaration = false;
-		}
-
-		classdesc	newClass;
-		newClass.type_name = className;
-		newClass.superclass_name = isStruct ? "" : baseClassName;
-		newClass.is_struct = isStruct;
-		newClass.union_name = unionName;
+		if( mTokens[x].kind != token::identifier )
+			continue;
+		vector<uint32_t>&	references = mReferencedBy[mTokens[x].name];
+		if( references.empty() || references.back() != inIndex )
+			references.push_back( (uint32_t) inIndex );
+	}
+}
 
-		if( mayBeDeclaration && currToken != tokens.end() && currToken->kind == token::operator_identifier && currToken->text.compare(";") == 0 )
-		{	// declaration:
-			currToken++;
-			isDeclaration = true;
-		}
-		else if( currToken != tokens.end() && (currToken->kind == token::operator_identifier && currToken->text.compare("{") == 0) )
-		{	// definition:
-			currToken++;
-			
-			while( true )
-			{
-				if( currToken == tokens.end() || (currToken->kind == token::operator_identifier && currToken->text.compare("}") == 0 ) )
-					break;
-				
-				bool	isOverride = false;
-				if( !isStruct && currToken->kind == token::identifier && currToken->text.compare("override") == 0 )
-				{
-					currToken++;
-					if( currToken == tokens.end() )
-						PE_ERROR( "Expected method declaration or definition after 'override', found " << PE_TOKEN_NAME );
-					isOverride = true;
-				}
-				parse_var_or_function( tokens, currToken, theProgram, newClass, newClass, isOverride, !isStruct );
-			}
-			
-			if( currToken == tokens.end() || currToken->kind != token::operator_identifier || currToken->text.compare("}") != 0 )
-				PE_ERROR( "Expected '}' at end of class/struct, found " << PE_TOKEN_NAME );
-			
-			currToken++;
-		}
-		else
-		{
-			throw runtime_error( "This class declaration/definition is incomplete." );
-		}
-		
-		validate_class( theProgram, newClass );
 
-		if( !isDeclaration )
-		{
-			if( theProgram.classes.find(className) != theProgram.classes.end() )
-				PE_ERROR( "A class named '" << className << "' already exists" );
-			theProgram.classes[className] = newClass;
-		}
-		
-		theProgram.types[className] = newClass;
-	}
-	else
-	{
-		classdesc	dummy_class("__dummy_class");
-		parse_var_or_function( tokens, currToken, theProgram, theProgram, dummy_class, false, true );
-	}
+size_t	watch_session::number_of_declarations() const
+{
+	return mProgram.types.size() +mProgram.classes.size() +mProgram.variables.size()
+			+mProgram.function_types.size() +mProgram.functions.size();
 }
 
 
-void	generate_classes( program& theProgram )
+bool	file_modification_time( const char* inFilePath, timespec& outTime )
 {
-	vector<classdesc>	sortedClasses;
-    transform( theProgram.classes.begin(), theProgram.classes.end(), std::back_inserter( sortedClasses ), [](map<string,classdesc>::value_type m){return m.second;} );
-	sort( sortedClasses.begin(), sortedClasses.end(), []( const classdesc& a, const classdesc& b ){ return a.number_of_superclasses < b.number_of_superclasses; });
+	struct stat	fileInfo = {};
+	if( stat( inFilePath, &fileInfo ) != 0 )
+		return false;
+#if __APPLE__
+	outTime = fileInfo.st_mtimespec;
+#else
+	outTime = fileInfo.st_mtim;
+#endif
+	return true;
+}
+
 
-	for( auto currClass : sortedClasses )
+// Compile the file whenever it is saved, until we're killed.
+int	watch_file( const char* inFilePath )
+{
+	watch_session	session( inFilePath );
+	timespec		lastModified = {};
+	
+	while( true )
 	{
-		cout << "struct " << currClass.type_name << "___isa" << endl
-			<< "{" << endl;
-		if( currClass.superclass_name.size() > 0 )
-			cout << "	struct " << currClass.superclass_name << "___isa	base;" << endl;
-		for( auto currFunc : currClass.functions )
-		{
-			if( !currFunc.second.is_override )
-			{
-				cout << "	" << currFunc.second.return_type.type_name << "	(*" << currFunc.second.func_name << ")( struct " << currClass.type_name << " *this";
-				for( auto currParam : currFunc.second.param_types )
-				{
-					cout << ", " << currParam.type_name << " " << currParam.var_name;
-				}
-				cout << " );" << endl;
-			}
-		}
-		cout << "};" << endl
-			<< endl;
-		
-		cout << "struct " << currClass.type_name << endl
-			<< "{" << endl;
-		if( currClass.superclass_name.size() > 0 )
-			cout << "	struct " << currClass.superclass_name << "	base;" << endl;
-		else
-			cout << "	struct " << currClass.type_name << "___isa*	vtable;" << endl;
-		for( auto currVar : currClass.variables )
-		{
-			cout << "	" << currVar.second.type_name << "	" << currVar.second.var_name << ";" << endl;
-		}
-		cout << "};" << endl
-			<< endl;
-		
-		cout << "struct " << currClass.type_name << "___isa g___isa___" << currClass.type_name << " = {};" << endl
-			<< endl;
-		
-		cout << "void init_class___" << currClass.type_name << "( " << currClass.type_name << "___isa* dest )" << endl
-			<< "{" << endl;
-		if( currClass.superclass_name.size() > 0 )
-			cout << "	init_class___" << currClass.superclass_name << "( &(dest->base) );" << endl;
-		
-		for( auto currFunc : currClass.functions )
+		timespec	modified = {};
+		if( file_modification_time( inFilePath, modified )
+			&& (modified.tv_sec != lastModified.tv_sec || modified.tv_nsec != lastModified.tv_nsec) )
 		{
-			cout << "	" << "dest->";
-			size_t	numLevels = currClass.find_override_depth_for_function( theProgram, currFunc.second.func_name );
-			for( size_t x = 0; x < numLevels; x++ )
-				cout << "base.";
-			cout << currFunc.second.func_name << " = " << currClass.type_name << "___" << currFunc.second.func_name << ";" << endl;
+			lastModified = modified;
+			session.update();
+			cout << flush;
 		}
-		cout << "}" << endl << endl;
+		usleep( 100000 );
 	}
 	
-	cout << "void	init___all___classes( void )" << endl << "{" << endl;
-	for( auto currClass : sortedClasses )
-	{
-		cout << "	init_class___" << currClass.type_name << "( &g___isa___" << currClass.type_name << " );" << endl;
-	}
-	cout << "}" << endl << endl;
+	return EXIT_SUCCESS;
 }
 
 
@@ -1583,24 +7414,157 @@ int main( int argc, const char * argv[] )
 {
 	int						result = EXIT_SUCCESS;
 	program					theProgram;
+	const char*				filePath = nullptr;
+	bool					mapFile = true;
+	bool					streamTokens = false;
+	bool					useTableLexer = false;
+	bool					checkLexer = false;
+	bool					watch = false;
+	bool					lazyBodies = false;
+	bool					signaturesOnly = false;
+	bool					useCache = false;
+	bool					memoryStats = false;
+	bool					layoutReport = false;
+	bool					runtimeVtables = false;
+	bool					dumpAST = false;
+	bool					runProgram = false;
+	const char*				outputPath = nullptr;
+	size_t					threadCount = max( thread::hardware_concurrency(), 1U );
+	
+	for( int x = 1; x < argc; x++ )
+	{
+		if( strcmp( argv[x], "--no-mmap" ) == 0 )
+			mapFile = false;
+		else if( strcmp( argv[x], "--stream" ) == 0 )
+			streamTokens = true;
+		else if( strcmp( argv[x], "--dfa" ) == 0 )
+			useTableLexer = true;
+		else if( strcmp( argv[x], "--check-lexer" ) == 0 )
+			checkLexer = true;
+		else if( strcmp( argv[x], "--watch" ) == 0 )
+			watch = true;
+		else if( strcmp( argv[x], "--lazy-bodies" ) == 0 )
+			lazyBodies = true;
+		else if( strcmp( argv[x], "--signatures-only" ) == 0 )
+			signaturesOnly = true;
+		else if( strcmp( argv[x], "--cache" ) == 0 )
+			useCache = true;
+		else if( strcmp( argv[x], "--memory-stats" ) == 0 )
+			memoryStats = true;
+		else if( strcmp( argv[x], "--layout-report" ) == 0 )
+			layoutReport = true;
+		else if( strcmp( argv[x], "--runtime-vtables" ) == 0 )
+			runtimeVtables = true;
+		else if( strcmp( argv[x], "--dump-ast" ) == 0 )
+			dumpAST = true;
+		else if( strcmp( argv[x], "--run" ) == 0 )
+			runProgram = true;
+		else if( strcmp( argv[x], "-o" ) == 0 && (x +1) < argc )
+			outputPath = argv[++x];
+		else if( strcmp( argv[x], "-j" ) == 0 && (x +1) < argc )
+			threadCount = max( atoi( argv[++x] ), 1 );
+		else
+			filePath = argv[x];
+	}
+	
+	if( !filePath )
+	{
+		cerr << "Usage: " << argv[0] << " [--no-mmap] [--stream] [--dfa] [--check-lexer] [--watch] [--lazy-bodies] [--signatures-only] [--cache] [--memory-stats] [--layout-report] [--runtime-vtables] [--dump-ast] [--run] [-j <threads>] [-o <file.c>] <file.mush>" << endl;
+		return EXIT_FAILURE;
+	}
+	
+	if( signaturesOnly && (runProgram || outputPath || runtimeVtables) )
+	{	// Calls to functions we never parsed wouldn't link or run.
+		cerr << "--signatures-only only checks declarations and can't be combined with --run, --runtime-vtables or -o." << endl;
+		return EXIT_FAILURE;
+	}
+	
+	if( watch )
+		return watch_file( filePath );
 
+	memory_report	memoryReport( memoryStats );
 	try
 	{
-		ifstream				file( argv[1] );
+		source_buffer			source( filePath, mapFile );
+		memoryReport.end_phase( "read" );
 		
-		vector<token>			tokens = tokenize(file);
-		vector<token>::iterator	currToken = tokens.begin();
+		if( checkLexer )	// Only compare the two lexers, don't compile anything.
+			return check_lexers( source, threadCount, cout ) ? EXIT_SUCCESS : EXIT_FAILURE;
 		
-		while( currToken != tokens.end() )
+		string	cachePath = string( filePath ) + ".ast";
+		useCache = useCache && !signaturesOnly;	// A cache always has all function bodies.
+		if( useCache && ast_cache_reader().read( cachePath, source, theProgram ) )
 		{
-			parse_top_level_construct( tokens, currToken, theProgram );
+			useCache = false;	// Nothing to write back.
+			memoryReport.end_phase( "load cache" );
+		}
+		else if( streamTokens )	// Lex as we parse, never holding all tokens in memory.
+		{
+			token_stream	tokens( source );
+			parse_and_validate( theProgram, threadCount, [&]()
+			{
+				parse_program( tokens, theProgram );
+				memoryReport.end_phase( "lex+parse" );
+			});
+			memoryReport.end_phase( "validate" );
+		}
+		else
+		{
+			vector<token>	tokens = useTableLexer ? tokenize_dfa( source ) : tokenize_parallel( source, threadCount );
+			memoryReport.end_phase( "lex" );
+			parse_and_validate( theProgram, threadCount, [&]()
+			{
+				if( signaturesOnly )	// We generate no code below, so never parse the bodies.
+				{
+					theProgram.lazy_function_bodies = true;
+					parse_program_parallel( tokens, theProgram, threadCount );
+				}
+				else if( lazyBodies )
+					parse_program_lazily( tokens, theProgram, threadCount );
+				else
+					parse_program_parallel( tokens, theProgram, threadCount );
+				memoryReport.end_phase( "parse" );
+			});
+			memoryReport.end_phase( "validate" );
+		}
+		
+		if( useCache )
+		{
+			ast_cache_writer().write( cachePath, source, theProgram );	// If that fails, we just parse again next time.
+			memoryReport.end_phase( "write cache" );
 		}
 		
-		generate_classes( theProgram );
+		if( signaturesOnly )	// Declarations are valid, that's all we were asked.
+		{
+			if( layoutReport )
+				report_layouts( theProgram, cerr );
+		}
+		else if( runProgram )	// Interpret main() instead of generating C.
+		{
+			vm_program	interpreter;
+			interpreter.load( theProgram );
+			memoryReport.end_phase( "lower" );
+			result = interpreter.run_main();
+			memoryReport.end_phase( "run" );
+		}
+		else
+		{
+			codegen_options	options;
+			options.layout_report = layoutReport ? &cerr : nullptr;
+			options.runtime_vtables = runtimeVtables;
+			code_emitter	emitter( threadCount );
+			generate_classes( theProgram, emitter, options );
+			memoryReport.end_phase( "generate" );
+			if( outputPath )
+				emitter.write( outputPath );
+			else
+				emitter.write( cout );
+			memoryReport.end_phase( "write" );
+		}
 	}
 	catch( const parse_error& err )
 	{
-		cout << argv[1] << ":" << err.line << ":" << err.offset << ":" << err.what() << endl;
+		cout << filePath << ":" << err.line << ":" << err.offset << ":" << err.what() << endl;
 		
 		result = EXIT_FAILURE;
 	}
@@ -1611,7 +7575,12 @@ int main( int argc, const char * argv[] )
 		result = EXIT_FAILURE;
 	}
 	
-	theProgram.print( 0 );
+	if( dumpAST )	// Only for debugging the parser, goes after the C code when both are on stdout.
+	{
+		theProgram.print( 0 );
+		memoryReport.end_phase( "print" );
+	}
+	memoryReport.print( cerr );
 	
     return result;
 }